@@ -21,8 +21,13 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "async_ip_network.h"
+#include "ip_trace.h"
+#include "ip_error.h"
+#include "ip_system.h"
 
 #ifdef WIN32
 #include <Windows.h>
@@ -40,16 +45,106 @@
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
   
 const size_t QUEUE_MAX_ITEMS = 10;
+
+#define WRITE_UPDATE_INTERVAL_MS 100        // Maximum time between writing thread passes, for reconnection and closing deadlines
+#define WRITE_POLL_INTERVAL_US 1000         // Time between checks for new write requests
+#define FILE_CHUNK_LENGTH 65536             // Maximum number of file bytes sent for each connection per writing thread pass
+#define WRITE_QUANTUM_LENGTH 8192           // Bytes granted to connections of weight 1 per writing thread pass (messages count as whole queue slots)
+#define PACING_BURST_INTERVAL_MS 10         // Sending time at the rate of paced connections that may be accumulated while idle
+
+// Marking of sockets for each priority class: differentiated services code point (expedited forwarding, default and 
+// lower effort) and Linux queueing priority (interactive, best effort and bulk bands)
+static const uint8_t PRIORITY_DSCP_LIST[ ASYNC_IP_PRIORITIES_NUMBER ] = { 46, 0, 8 };
+static const int PRIORITY_SOCKET_LIST[ ASYNC_IP_PRIORITIES_NUMBER ] = { 6, 0, 2 };
   
+// File data to be sent by the writing thread, in chunks interleaved with queued messages
+typedef struct _FileTransfer
+{
+  int fileDescriptor;
+  uint64_t offset;
+  size_t remainingLength;
+}
+FileTransfer;
+
+// Caller buffer to be sent by the writing thread, referenced by the kernel (until released) when sent without copies
+typedef struct _BufferTransfer
+{
+  const char* buffer;
+  size_t length;
+  size_t sentLength;
+  bool isZeroCopy;
+  uint32_t firstSendID;                     // Number of first zero-copy send of the buffer on the connection socket
+  uint32_t sendsCount;                      // Zero-copy sends of the buffer
+  uint32_t pendingCompletionsCount;         // Zero-copy sends of the buffer not finished by the kernel
+  AsyncIPBufferReleaser ref_Release;
+  void* userData;
+}
+BufferTransfer;
+
+// Received message stored in read queues of client connections
+typedef struct _QueuedMessage
+{
+  char data[ IP_MAX_MESSAGE_LENGTH ];
+  uint64_t receiveTime;                     // Kernel receive time, for timestamping connections (0 otherwise)
+}
+QueuedMessage;
+
+// Reconnection state of client connections
+typedef struct _ReconnectionData
+{
+  AsyncIPReconnectionSettings settings;
+  bool isDisconnected;
+  unsigned int attemptsCount;
+  uint64_t nextAttemptTime;
+  uint8_t attemptState;                     // Attempts run on their own thread, as connecting (and filter handshakes) may block
+}
+ReconnectionData;
+
 // Structure that stores read and write message queues for a IPConnection struct used asyncronously
 typedef struct _AsyncIPConnectionData
 {
   IPConnection baseConnection;
   TSQueue readQueue;
-  TSQueue writeQueue;
+  TSQueue writeQueuesList[ ASYNC_IP_PRIORITIES_NUMBER ];   // Write lanes by priority (created on first use, except the normal one)
+  enum AsyncIPPriority priority;                          // Lane of messages written without explicit priority
+  IPDispatchTable dispatchTable;
+  AsyncIPEventHandler ref_HandleEvent;
+  void* eventUserData;
+  ReconnectionData* reconnection;
+  bool isBaseBusy;                          // Base connection used by a thread not holding the connection (e.g. reconnecting or filter handshakes)
+  bool hasHeldMessage;                      // Message taken from the queue but not sent (failed before reconnection, or full shared memory ring)
+  char heldMessage[ IP_MAX_MESSAGE_LENGTH ];
+  uint8_t closingState;
+  uint64_t closingDeadline;
+  bool isCoalescing;
+  bool isFlushRequested;
+  bool isCorked;                            // Socket holding partial segments of coalesced messages since cork time
+  uint64_t corkTime;
+  TSQueue fileQueue;
+  FileTransfer currentFile;
+  bool hasCurrentFile;
+  TSQueue bufferQueue;
+  BufferTransfer currentBuffer;
+  bool hasCurrentBuffer;
+  BufferTransfer* sentBuffersList;          // Buffers fully sent, waiting for zero-copy completions
+  size_t sentBuffersCount;
+  uint32_t nextSendID;
+  size_t zeroCopyMinLength;
+  bool isSegmenting;                        // Queued messages sent at once, as a train of UDP datagrams
+  unsigned int writeWeight;                 // Share of the writing thread, relative to other connections
+  int64_t writeDeficit;                     // Bytes the connection may still send in the current pass, or owes for datagrams sent whole
+  uint64_t pacingRate;                      // Maximum sending rate (in bytes per second), or 0 if not paced
+  int64_t pacingTokens;                     // Bytes the token bucket allows to send, negative while repaying datagrams sent whole
+  uint64_t pacingTime;                      // Time (in nanoseconds) up to which tokens were added to the bucket
+  size_t memoryLength;                      // Memory allocated for the connection (queues and base connection), charged to the global budget
+  size_t baseMemoryLength;                  // Part of the charged memory allocated by the base connection
 }
 AsyncIPConnectionData;
 
+// Graceful closing steps, advanced by the writing thread
+enum { CONNECTION_OPEN, CONNECTION_FLUSHING, CONNECTION_DRAINING };
+enum { ATTEMPT_NONE, ATTEMPT_RUNNING, ATTEMPT_SUCCEEDED, ATTEMPT_FAILED };
+
 // Opaque type to reference encapsulated asynchronous connection struct
 typedef AsyncIPConnectionData* AsyncIPConnection;
 
@@ -57,15 +152,86 @@ typedef AsyncIPConnectionData* AsyncIPConnection;
 static Thread globalReadThread = THREAD_INVALID_HANDLE;
 static Thread globalWriteThread = THREAD_INVALID_HANDLE;
 static volatile bool isNetworkRunning = false;
+static THREAD_LOCAL bool isNetworkThread = false;                   // Set for reading and writing threads, that cannot wait for their own exit
+
+// Incremented on every write (or flush) request, so that the writing thread only runs over all connections when needed
+static uint64_t writeRequestsCount = 0;
+// Connections written again on every poll interval (paced, blocked by a full shared memory ring or with transfers waiting 
+// for the socket), so that only those are visited between full passes. Listed by the writing thread only
+static unsigned long* retriedConnectionsList = NULL;
+static size_t retriedConnectionsCount = 0;
+static size_t retriedConnectionsSize = 0;
+// Bytes of messages and buffers waiting to be sent on all connections
+static uint64_t queuedBytesCount = 0;
+// Memory charged to all connections
+static uint64_t memoryUsageCount = 0;
+// Longest pass (in nanoseconds) of reading or writing threads over all connections, since last queried
+static uint64_t maxLoopTime = 0;
+
+static AsyncIPAdmissionSettings admissionSettings = { .maxConnections = 0, .maxQueuedBytes = 0, .maxMemoryBytes = 0 };
 
 // Internal (private) list of asyncronous connections created (accessible only by index)
 static TSMap globalConnectionsList = NULL;
 
+#define POOL_HOST_LENGTH 256
+#define POOL_EXPIRED_MAX 16                 // Maximum idle connections closed per acquisition (others expire on the next ones)
+
+// Client connection created through the pool, either idle or in use (with invalid identifier while being opened)
+typedef struct _PooledConnection
+{
+  unsigned long connectionID;
+  uint8_t connectionType;
+  char host[ POOL_HOST_LENGTH ];
+  uint16_t port;
+  bool isIdle;
+  uint64_t idleTime;
+}
+PooledConnection;
+
+static AsyncIPPoolSettings poolSettings = { .maxConnections = 0, .maxIdleConnections = 4, .idleTimeout = 60000, .ref_CheckHealth = NULL };
+static PooledConnection* pooledConnectionsList = NULL;
+static size_t pooledConnectionsCount = 0;
+static ThreadLock poolLock = NULL;
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
 /////                                      INFORMATION UTILITIES                                      /////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Charges memory about to be allocated for given connection, unless it would exceed the global budget
+static bool ChargeMemory( AsyncIPConnection connection, size_t length )
+{
+  uint64_t memoryUsage = ATOMIC_FETCH_ADD( &memoryUsageCount, length ) + length;
+  if( admissionSettings.maxMemoryBytes > 0 && memoryUsage > admissionSettings.maxMemoryBytes )
+  {
+    ATOMIC_FETCH_SUB( &memoryUsageCount, length );
+    return false;
+  }
+  
+  connection->memoryLength += length;
+  
+  return true;
+}
+
+// Returns memory freed by given connection to the global budget
+static inline void ReleaseMemory( AsyncIPConnection connection, size_t length )
+{
+  ATOMIC_FETCH_SUB( &memoryUsageCount, length );
+  connection->memoryLength -= length;
+}
+
+// Charges changes of memory already allocated by the base connection (e.g. datagram train buffers received by the reading thread)
+static void UpdateBaseMemory( AsyncIPConnection connection )
+{
+  size_t baseMemoryLength = IP_GetMemoryUsage( connection->baseConnection );
+  if( baseMemoryLength == connection->baseMemoryLength ) return;
+  
+  int64_t changeLength = (int64_t) baseMemoryLength - (int64_t) connection->baseMemoryLength;
+  ATOMIC_FETCH_ADD( &memoryUsageCount, changeLength );
+  connection->memoryLength += changeLength;
+  connection->baseMemoryLength = baseMemoryLength;
+}
+
 // Returns the number of asyncronous connections created (method for encapsulation purposes)
 size_t AsyncIP_GetActivesNumber()
 {
@@ -93,6 +259,36 @@ size_t AsyncIP_GetClientsNumber( unsigned long serverID )
   return clientsNumber;
 }
 
+// Returns memory charged to the connection of given identifier
+size_t AsyncIP_GetMemoryUsage( unsigned long connectionID )
+{
+  AsyncIPConnection connection = (AsyncIPConnection) TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return 0;
+  
+  UpdateBaseMemory( connection );
+  size_t memoryLength = connection->memoryLength;
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return memoryLength;
+}
+
+// Returns memory charged to all connections
+uint64_t AsyncIP_GetTotalMemoryUsage( void )
+{
+  return ATOMIC_LOAD( &memoryUsageCount );
+}
+
+// Returns (and resets) longest reading or writing pass time
+uint64_t AsyncIP_GetMaxLoopTime( void )
+{
+  uint64_t loopTime;
+  do { loopTime = ATOMIC_LOAD( &maxLoopTime ); } 
+  while( !ATOMIC_COMPARE_EXCHANGE( &maxLoopTime, loopTime, 0 ) );
+  
+  return loopTime;
+}
+
 // Returns address string (host and port) for the connection of given identifier
 char* AsyncIP_GetAddress( unsigned long connectionID )
 {
@@ -112,39 +308,95 @@ char* AsyncIP_GetAddress( unsigned long connectionID )
 // Forward definition
 static void* AsyncReadQueues( void* );
 static void* AsyncWriteQueues( void* );
+static AsyncIPConnection WaitBaseConnection( unsigned long, AsyncIPConnection );
 
 // Create new AsyncIPConnection structure (from a given IPConnection structure) and add it to the internal list
-static unsigned long AddAsyncConnection( IPConnection baseConnection )
+static unsigned long AddAsyncConnection( IPConnection baseConnection, IPDispatchTable dispatchTable )
 {
+  // Network stopped from its own threads is still finishing, and cannot be waited for from them
+  while( globalConnectionsList != NULL && !isNetworkRunning )
+  {
+    if( isNetworkThread )
+    {
+      IP_REPORT_ERROR( "network is stopping, connection not added" );
+      IP_CloseConnection( baseConnection );
+      return (unsigned long) IP_CONNECTION_INVALID_ID;
+    }
+#ifdef _WIN32
+    Sleep( WRITE_POLL_INTERVAL_US / 1000 );
+#else
+    usleep( WRITE_POLL_INTERVAL_US );
+#endif
+  }
+  
   if( globalConnectionsList == NULL ) 
   {
     globalConnectionsList = TSM_Create( TSMAP_INT, sizeof(AsyncIPConnectionData) );
+    isNetworkRunning = true;
     globalReadThread = Thread_Start( AsyncReadQueues, (void*) globalConnectionsList, THREAD_JOINABLE );
     globalWriteThread = Thread_Start( AsyncWriteQueues, (void*) globalConnectionsList, THREAD_JOINABLE );
   }
   
-  AsyncIPConnectionData connectionData = { .baseConnection = baseConnection };
+  AsyncIPConnectionData connectionData = { .baseConnection = baseConnection, .dispatchTable = dispatchTable };
   
-  size_t readQueueItemSize = ( !IP_IsServer( baseConnection ) ) ? IP_MAX_MESSAGE_LENGTH : sizeof(unsigned long);
+  size_t readQueueItemSize = ( !IP_IsServer( baseConnection ) ) ? sizeof(QueuedMessage) : sizeof(unsigned long);
   connectionData.readQueue = TSQ_Create( QUEUE_MAX_ITEMS, readQueueItemSize );  
-  connectionData.writeQueue = TSQ_Create( QUEUE_MAX_ITEMS, IP_MAX_MESSAGE_LENGTH );
+  connectionData.writeQueuesList[ ASYNC_IP_PRIORITY_NORMAL ] = TSQ_Create( QUEUE_MAX_ITEMS, IP_MAX_MESSAGE_LENGTH );
+  connectionData.priority = ASYNC_IP_PRIORITY_NORMAL;
+  connectionData.writeWeight = 1;
+  
+  // Connections were admitted within the memory budget beforehand
+  connectionData.baseMemoryLength = IP_GetMemoryUsage( baseConnection );
+  connectionData.memoryLength = sizeof(AsyncIPConnectionData) + connectionData.baseMemoryLength;
+  connectionData.memoryLength += QUEUE_MAX_ITEMS * ( readQueueItemSize + IP_MAX_MESSAGE_LENGTH );
+  ATOMIC_FETCH_ADD( &memoryUsageCount, connectionData.memoryLength );
   
   unsigned long connectionID = TSM_SetItem( globalConnectionsList, baseConnection, &connectionData );  
   
   return connectionID;
 }
 
+// Verifies if the global limits of connections and memory allow opening (or accepting) another one
+static inline bool IsConnectionAdmitted( void )
+{
+  // Memory of a new client: its data, read queue, normal write lane and receive buffer (other lanes and transfer queues are charged on creation)
+  size_t connectionMemoryLength = sizeof(AsyncIPConnectionData) + QUEUE_MAX_ITEMS * ( sizeof(QueuedMessage) + IP_MAX_MESSAGE_LENGTH ) + IP_MAX_MESSAGE_LENGTH;
+  if( admissionSettings.maxMemoryBytes > 0 && ATOMIC_LOAD( &memoryUsageCount ) + connectionMemoryLength > admissionSettings.maxMemoryBytes ) return false;
+  
+  if( admissionSettings.maxConnections == 0 || globalConnectionsList == NULL ) return true;
+  
+  return ( TSM_GetItemsCount( globalConnectionsList ) < admissionSettings.maxConnections );
+}
+
+// Verifies if data of given priority may be queued within the global limit. Lower priorities are refused first (bulk data above 
+// half of it), while control messages are always admitted, so that urgent traffic still goes through during overload
+static bool IsWriteAdmitted( enum AsyncIPPriority priority, size_t dataLength )
+{
+  uint64_t maxQueuedLength = admissionSettings.maxQueuedBytes;
+  if( maxQueuedLength == 0 || priority == ASYNC_IP_PRIORITY_CONTROL ) return true;
+  
+  if( priority == ASYNC_IP_PRIORITY_BULK ) maxQueuedLength /= 2;
+  
+  return ( ATOMIC_LOAD( &queuedBytesCount ) + dataLength <= maxQueuedLength );
+}
+
 // Creates a new IPConnection structure (from the defined properties) and add it to the asynchronous connection list
 unsigned long AsyncIP_OpenConnection( uint8_t connectionType, const char* host, uint16_t port )
 {
+  if( !IsConnectionAdmitted() )
+  {
+    IP_REPORT_ERROR( "maximum number of connections (%lu) or memory budget (%lu bytes) reached", admissionSettings.maxConnections, admissionSettings.maxMemoryBytes );
+    return (unsigned long) IP_CONNECTION_INVALID_ID;
+  }
+  
   IPConnection baseConnection = IP_OpenConnection( connectionType, host, port );
   if( baseConnection == NULL )
   {
-    fprintf( stderr, "failed to create connection type %x on host %s and port %u", connectionType, ( host == NULL ) ? "(ANY)" : host, port );
+    IP_REPORT_ERROR( "failed to create connection type %x on host %s and port %u", connectionType, ( host == NULL ) ? "(ANY)" : host, port );
     return (unsigned long) IP_CONNECTION_INVALID_ID;
   } 
   
-  return AddAsyncConnection( baseConnection );
+  return AddAsyncConnection( baseConnection, NULL );
 }
 
 size_t AsyncIP_SetMessageLength( unsigned long connectionID, size_t messageLength )
@@ -159,17 +411,108 @@ size_t AsyncIP_SetMessageLength( unsigned long connectionID, size_t messageLengt
   return messageLength;
 }
 
+bool AsyncIP_SetStreamFilter( unsigned long connectionID, const IPStreamFilter* filter )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  connection = WaitBaseConnection( connectionID, connection );
+  if( connection == NULL ) return false;
+  
+  // Reading and writing threads skip the connection during handshakes, instead of consuming their data or waiting for them
+  IPConnection baseConnection = connection->baseConnection;
+  connection->isBaseBusy = true;
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  bool filterSet = IP_SetStreamFilter( baseConnection, filter );
+  
+  // Connection is not discarded while busy
+  connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  connection->isBaseBusy = false;
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return filterSet;
+}
+
+bool AsyncIP_SetEventHandler( unsigned long connectionID, AsyncIPEventHandler handler, void* userData )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  connection->ref_HandleEvent = handler;
+  connection->eventUserData = userData;
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return true;
+}
+
+bool AsyncIP_SetReconnection( unsigned long connectionID, const AsyncIPReconnectionSettings* settings )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  bool isSet = false;
+  if( IP_IsServer( connection->baseConnection ) )
+    IP_REPORT_ERROR( "connection index %lu is not of a client connection", connectionID );
+  else if( settings != NULL && ( !IP_IsStream( connection->baseConnection ) || IP_IsAccepted( connection->baseConnection ) ) )
+    IP_REPORT_ERROR( "connection index %lu: only connected stream (TCP or local) clients can be reconnected", connectionID );
+  else if( settings == NULL )
+  {
+    connection = WaitBaseConnection( connectionID, connection );
+    if( connection == NULL ) return false;
+    if( connection->reconnection != NULL ) ReleaseMemory( connection, sizeof(ReconnectionData) );
+    free( connection->reconnection );
+    connection->reconnection = NULL;
+    isSet = true;
+  }
+  else
+  {
+    if( connection->reconnection == NULL && ChargeMemory( connection, sizeof(ReconnectionData) ) ) 
+      connection->reconnection = (ReconnectionData*) calloc( 1, sizeof(ReconnectionData) );
+    if( connection->reconnection != NULL ) 
+    {
+      connection->reconnection->settings = *settings;
+      isSet = true;
+    }
+    else IP_REPORT_ERROR( "connection index %lu: memory budget reached", connectionID );
+  }
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return isSet;
+}
+
+bool AsyncIP_SetDispatchTable( unsigned long connectionID, IPDispatchTable table )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  connection->dispatchTable = table;
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
 /////                                     ASYNCRONOUS UPDATE                                          /////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Maximum number of tokens of a bucket filled at given rate (at least one message, so that slow connections still send)
+static inline int64_t GetPacingBurstLength( uint64_t pacingRate )
+{
+  int64_t burstLength = (int64_t) ( pacingRate * PACING_BURST_INTERVAL_MS / 1000 );
+  return ( burstLength > IP_MAX_MESSAGE_LENGTH ) ? burstLength : IP_MAX_MESSAGE_LENGTH;
+}
+
 static void ReadToQueue( unsigned long connectionID )
 {
   AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
   if( connection == NULL ) return;
   
-  // Do not proceed if queue is full
-  if( TSQ_GetItemsCount( connection->readQueue ) >= QUEUE_MAX_ITEMS ) 
+  // Do not proceed if queue is full, or while the base connection is used elsewhere (e.g. socket replaced by reconnection)
+  if( TSQ_GetItemsCount( connection->readQueue ) >= QUEUE_MAX_ITEMS || connection->isBaseBusy ) 
   {
     TSM_ReleaseItem( globalConnectionsList, connectionID );
     return;
@@ -179,186 +522,1551 @@ static void ReadToQueue( unsigned long connectionID )
   {
     if( IP_IsServer( connection->baseConnection ) )
     {
+      // Overloaded processes refuse new clients early, keeping latency of established ones bounded
+      bool isOverloaded = ( admissionSettings.maxQueuedBytes > 0 && ATOMIC_LOAD( &queuedBytesCount ) >= admissionSettings.maxQueuedBytes );
+      if( isOverloaded || !IsConnectionAdmitted() )
+      {
+        IP_RejectClient( connection->baseConnection );
+        TSM_ReleaseItem( globalConnectionsList, connectionID );
+        return;
+      }
+      
       IPConnection newClient = IP_AcceptClient( connection->baseConnection );
       if( newClient != NULL )
       {
         char* addressString = IP_GetAddress( newClient );
         if( addressString != NULL )
         {
+          // Accepted clients dispatch typed messages with the handlers of their server
+          IPDispatchTable dispatchTable = connection->dispatchTable;
+          bool isSegmenting = connection->isSegmenting;
+          enum AsyncIPPriority priority = connection->priority;
+          unsigned int writeWeight = connection->writeWeight;
+          uint64_t pacingRate = connection->pacingRate;
           TSM_ReleaseItem( globalConnectionsList, connectionID );
-          unsigned long newClientID = AddAsyncConnection( newClient );
+          unsigned long newClientID = AddAsyncConnection( newClient, dispatchTable );
+          // Accepted UDP clients share the socket (and segmentation offload) of their server, and sockets of TCP ones keep its marking and pacing
+          bool isInherited = ( isSegmenting || priority != ASYNC_IP_PRIORITY_NORMAL || writeWeight != 1 || pacingRate > 0 );
+          AsyncIPConnection client = isInherited ? TSM_AcquireItem( globalConnectionsList, newClientID ) : NULL;
+          if( client != NULL )
+          {
+            client->isSegmenting = isSegmenting;
+            client->priority = priority;
+            client->writeWeight = writeWeight;
+            client->pacingRate = pacingRate;
+            client->pacingTokens = GetPacingBurstLength( pacingRate );
+            client->pacingTime = System_GetTimeNanoseconds();
+            TSM_ReleaseItem( globalConnectionsList, newClientID );
+          }
+          // Server may have been closed while not held
+          connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+          if( connection == NULL ) return;
           TSQ_Enqueue( connection->readQueue, &newClientID, TSQUEUE_WAIT );
-          return;
+          IP_TRACE( READ_ENQUEUE, connectionID, sizeof(unsigned long) );
         }
       }
     }
     else
     {
       char* lastMessage = IP_ReceiveMessage( connection->baseConnection );
-      if( lastMessage != NULL ) TSQ_Enqueue( connection->readQueue, (void*) lastMessage, TSQUEUE_WAIT );
+      if( lastMessage != NULL ) 
+      {
+        QueuedMessage queuedMessage;
+        memcpy( queuedMessage.data, lastMessage, IP_MAX_MESSAGE_LENGTH );
+        queuedMessage.receiveTime = IP_GetReceiveTime( connection->baseConnection );
+        if( connection->dispatchTable != NULL )
+        {
+          // Handlers get a copy of the message, as the receive buffer is freed if the connection gets closed meanwhile,
+          // and run without holding the connection, which allows them to call any asynchronous method (e.g. write replies)
+          IPDispatchTable dispatchTable = connection->dispatchTable;
+          TSM_ReleaseItem( globalConnectionsList, connectionID );
+          if( IPDispatch_HandleMessage( dispatchTable, connectionID, queuedMessage.data, IP_MAX_MESSAGE_LENGTH ) != 0 ) return;
+          // Untyped messages, or without registered handler, are still queued
+          connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+          if( connection == NULL ) return;
+        }
+        TSQ_Enqueue( connection->readQueue, (void*) &queuedMessage, TSQUEUE_WAIT );
+        IP_TRACE( READ_ENQUEUE, connectionID, IP_MAX_MESSAGE_LENGTH );
+      }
     }
   }
   
   TSM_ReleaseItem( globalConnectionsList, connectionID );
 }
 
+// Raises the longest pass time, if the pass started at given time (in nanoseconds) took longer
+static inline void UpdateMaxLoopTime( uint64_t passStartTime )
+{
+  uint64_t passTime = System_GetTimeNanoseconds() - passStartTime;
+  uint64_t loopTime = ATOMIC_LOAD( &maxLoopTime );
+  while( passTime > loopTime && !ATOMIC_COMPARE_EXCHANGE( &maxLoopTime, loopTime, passTime ) ) 
+    loopTime = ATOMIC_LOAD( &maxLoopTime );
+}
+
 // Loop of message reading (storing in queue) to be called asyncronously for client/server connections
 static void* AsyncReadQueues( void* args )
 {
-  isNetworkRunning = true;
+  isNetworkThread = true;
   
   while( isNetworkRunning )
   {    
     // Blocking call
     if( IP_WaitEvent( 5000 ) > 0 ) 
+    {
+      uint64_t passStartTime = System_GetTimeNanoseconds();
       TSM_RunForAllKeys( globalConnectionsList, ReadToQueue );
+      UpdateMaxLoopTime( passStartTime );
+    }
   }
   
   return NULL;
 }
 
-static void WriteFromQueue( unsigned long connectionID )
+// Returns number of messages queued for writing in all priority lanes of given connection
+static size_t CountQueuedMessages( AsyncIPConnection connection )
 {
-  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
-  if( connection == NULL ) return;
-  
-  char firstMessage[ IP_MAX_MESSAGE_LENGTH ];
-  
-  // Do not proceed if queue is empty
-  if( TSQ_GetItemsCount( connection->writeQueue ) == 0 )
+  size_t messagesCount = 0;
+  for( int lane = 0; lane < ASYNC_IP_PRIORITIES_NUMBER; lane++ )
   {
-    TSM_ReleaseItem( globalConnectionsList, connectionID );
-    return;
+    if( connection->writeQueuesList[ lane ] != NULL ) messagesCount += TSQ_GetItemsCount( connection->writeQueuesList[ lane ] );
   }
   
-  TSQ_Dequeue( connection->writeQueue, (void*) firstMessage, TSQUEUE_WAIT );
-  
-  if( IP_SendMessage( connection->baseConnection, firstMessage ) == -1 )
+  return messagesCount;
+}
+
+// Takes oldest message from the highest priority lane with queued messages. Returns false if all lanes are empty
+static bool DequeueMessage( unsigned long connectionID, AsyncIPConnection connection, char* message )
+{
+  for( int lane = 0; lane < ASYNC_IP_PRIORITIES_NUMBER; lane++ )
   {
-    TSM_ReleaseItem( globalConnectionsList, connectionID );
-    TSM_RemoveItem( globalConnectionsList, connectionID );
-    return;
+    TSQueue writeQueue = connection->writeQueuesList[ lane ];
+    if( writeQueue == NULL || TSQ_GetItemsCount( writeQueue ) == 0 ) continue;
+    
+    TSQ_Dequeue( writeQueue, (void*) message, TSQUEUE_WAIT );
+    IP_TRACE( WRITE_DEQUEUE, connectionID, IP_MAX_MESSAGE_LENGTH );
+    ATOMIC_FETCH_SUB( &queuedBytesCount, IP_MAX_MESSAGE_LENGTH );
+    return true;
   }
   
-  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  return false;
 }
 
-// Loop of message writing (removing in order from queue) to be called asyncronously for client connections
-static void* AsyncWriteQueues( void* args )
+static void DiscardWriteQueues( AsyncIPConnection connection )
 {
-  isNetworkRunning = true;
-  
-  while( isNetworkRunning )
+  for( int lane = 0; lane < ASYNC_IP_PRIORITIES_NUMBER; lane++ )
   {
-    TSM_RunForAllKeys( globalConnectionsList, WriteFromQueue );
+    TSQueue writeQueue = connection->writeQueuesList[ lane ];
+    if( writeQueue == NULL ) continue;
     
-#ifdef _WIN32
-    Sleep( 1000 );
-#else
-    usleep( 1000*1000 );  /* sleep for 100 milliSeconds */
-#endif
+    uint64_t droppedLength = TSQ_GetItemsCount( writeQueue ) * IP_MAX_MESSAGE_LENGTH;
+    ATOMIC_FETCH_SUB( &queuedBytesCount, droppedLength );
+    
+    TSQ_Discard( writeQueue );
+    connection->writeQueuesList[ lane ] = NULL;
   }
-  
-  return NULL;//(void*) 1;
 }
 
+// Notifies connection event to the application, without holding the connection (so that the handler may use it)
+static void NotifyEvent( unsigned long connectionID, AsyncIPEventHandler ref_HandleEvent, void* userData, enum AsyncIPEvent event )
+{
+  if( ref_HandleEvent != NULL ) ref_HandleEvent( connectionID, event, userData );
+}
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////
-/////                                      SYNCRONOUS UPDATE                                          /////
-///////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns true if there are file or buffer transfers not finished on given connection
+static bool HasPendingTransfers( AsyncIPConnection connection )
+{
+  if( connection->hasCurrentFile || ( connection->fileQueue != NULL && TSQ_GetItemsCount( connection->fileQueue ) > 0 ) ) return true;
+  if( connection->hasCurrentBuffer || connection->sentBuffersCount > 0 ) return true;
+  return ( connection->bufferQueue != NULL && TSQ_GetItemsCount( connection->bufferQueue ) > 0 );
+}
 
-// Get (and remove) message from the beginning (oldest) of the given index corresponding read queue
-// Method to be called from the main thread
-char* AsyncIP_ReadMessage( unsigned long clientID )
+// Hands given buffers back to their owners (after the connection is released), as not referenced by the kernel anymore
+static void ReleaseBuffers( unsigned long connectionID, BufferTransfer* buffersList, size_t buffersNumber )
 {
-  static char messageData[ IP_MAX_MESSAGE_LENGTH ];
-  char* firstMessage = NULL;
+  for( size_t bufferIndex = 0; bufferIndex < buffersNumber; bufferIndex++ )
+  {
+    BufferTransfer* transfer = &(buffersList[ bufferIndex ]);
+    ATOMIC_FETCH_SUB( &queuedBytesCount, transfer->length );
+    if( transfer->ref_Release != NULL ) transfer->ref_Release( connectionID, transfer->buffer, ( transfer->sentLength == transfer->length ), transfer->userData );
+  }
+}
+
+// Tells if sent (or partially sent) buffers of given connection are still referenced by the kernel, waiting for completions
+static bool HasReferencedBuffers( AsyncIPConnection connection )
+{
+  if( connection->hasCurrentBuffer && connection->currentBuffer.pendingCompletionsCount > 0 ) return true;
   
-  AsyncIPConnection client = TSM_AcquireItem( globalConnectionsList, clientID );
-  if( client != NULL )
+  return ( connection->sentBuffersCount > 0 );
+}
+
+// Drops unfinished file and buffer transfers of given connection, after socket closing (files are not closed, buffers are released right away)
+static void DiscardTransfers( unsigned long connectionID, AsyncIPConnection connection )
+{
+  if( connection->fileQueue != NULL )
   {
-    if( !IP_IsServer( client->baseConnection ) )
+    TSQ_Discard( connection->fileQueue );
+    connection->fileQueue = NULL;
+    connection->hasCurrentFile = false;
+  }
+  
+  if( connection->bufferQueue != NULL )
+  {
+    // Socket was reset, so that buffers waiting for completions are not read anymore, but their data may not have been delivered
+    if( connection->hasCurrentBuffer && connection->currentBuffer.pendingCompletionsCount > 0 ) connection->currentBuffer.sentLength = 0;
+    for( size_t bufferIndex = 0; bufferIndex < connection->sentBuffersCount; bufferIndex++ )
+      connection->sentBuffersList[ bufferIndex ].sentLength = 0;
+    if( connection->hasCurrentBuffer ) ReleaseBuffers( connectionID, &(connection->currentBuffer), 1 );
+    ReleaseBuffers( connectionID, connection->sentBuffersList, connection->sentBuffersCount );
+    BufferTransfer transfer;
+    while( TSQ_GetItemsCount( connection->bufferQueue ) > 0 )
     {
-      if( TSQ_GetItemsCount( client->readQueue ) > 0 )
-      {
-        firstMessage = (char*) &messageData;
-        TSQ_Dequeue( client->readQueue, firstMessage, TSQUEUE_WAIT );
-      }
+      TSQ_Dequeue( connection->bufferQueue, (void*) &transfer, TSQUEUE_WAIT );
+      ReleaseBuffers( connectionID, &transfer, 1 );
     }
-    else
-      fprintf( stderr, "connection index %lu is not of a client connection", clientID );
+    
+    TSQ_Discard( connection->bufferQueue );
+    connection->bufferQueue = NULL;
+    free( connection->sentBuffersList );
+    connection->sentBuffersList = NULL;
+    connection->sentBuffersCount = 0;
+    connection->hasCurrentBuffer = false;
   }
-  TSM_ReleaseItem( globalConnectionsList, clientID );
+}
+
+// Exponential backoff with "equal jitter": half of the delay is fixed and half is random, spreading simultaneous reconnections
+static uint64_t GetReconnectionDelay( ReconnectionData* reconnection )
+{
+  uint64_t delay = reconnection->settings.minDelay;
+  for( unsigned int attemptIndex = 1; attemptIndex < reconnection->attemptsCount && delay < reconnection->settings.maxDelay; attemptIndex++ )
+    delay *= 2;
+  if( delay > reconnection->settings.maxDelay ) delay = reconnection->settings.maxDelay;
   
-  return firstMessage;
+  return delay / 2 + (uint64_t) rand() % ( delay / 2 + 1 );
 }
 
-bool AsyncIP_WriteMessage( unsigned long connectionID, const char* message )
+static void MarkDisconnected( ReconnectionData* reconnection )
 {
-  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
-  if( connection == NULL ) return false;
+  reconnection->isDisconnected = true;
+  reconnection->attemptsCount = 0;
+  reconnection->nextAttemptTime = System_GetTimeMilliseconds();
+}
+
+// Reconnects given connection apart from the writing thread. Connection is neither read nor discarded until the attempt finishes
+static void* AsyncReconnect( void* args )
+{
+  unsigned long connectionID = (unsigned long) (uintptr_t) args;
   
-  if( TSQ_GetItemsCount( connection->writeQueue ) >= QUEUE_MAX_ITEMS )
-    fprintf( stderr, "connection index %lu write queue is full", connectionID );
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return NULL;
+  IPConnection baseConnection = connection->baseConnection;
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
   
-  TSQ_Enqueue( connection->writeQueue, (void*) message, TSQUEUE_NOWAIT );
+  bool isReconnected = IP_Reconnect( baseConnection );
   
+  connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return NULL;
+  connection->reconnection->attemptState = isReconnected ? ATTEMPT_SUCCEEDED : ATTEMPT_FAILED;
+  connection->isBaseBusy = false;
   TSM_ReleaseItem( globalConnectionsList, connectionID );
   
-  return true;
+  // Result is handled on the next writing thread pass
+  ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+  
+  return NULL;
 }
 
-unsigned long AsyncIP_GetClient( unsigned long serverID )
+// Waits (not holding the connection) for other threads to stop using its base connection (and reconnection data).
+// Returns the connection acquired again, or NULL if it was discarded meanwhile
+static AsyncIPConnection WaitBaseConnection( unsigned long connectionID, AsyncIPConnection connection )
 {
-  unsigned long firstClient = (unsigned long) IP_CONNECTION_INVALID_ID;
-
-  AsyncIPConnection server = TSM_AcquireItem( globalConnectionsList, serverID );
-  if( server != NULL )
+  while( connection->isBaseBusy )
   {
-    if( IP_IsServer( server->baseConnection ) )
-    {
-      if( TSQ_GetItemsCount( server->readQueue ) > 0 ) TSQ_Dequeue( server->readQueue, &firstClient, TSQUEUE_WAIT );
-    }
-    else
-      fprintf( stderr, "connection index %d is not a server index", serverID );
-    
-    TSM_ReleaseItem( globalConnectionsList, serverID );
+    TSM_ReleaseItem( globalConnectionsList, connectionID );
+#ifdef _WIN32
+    Sleep( WRITE_POLL_INTERVAL_US / 1000 );
+#else
+    usleep( WRITE_POLL_INTERVAL_US );
+#endif
+    connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+    if( connection == NULL ) return NULL;
   }
   
-  return firstClient; 
+  return connection;
 }
 
+// Forward definitions
+static void DiscardConnection( unsigned long );
+static void StopNetworkIfIdle( void );
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////
-/////                                           ENDING                                                /////
-///////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-// Handle socket closing and structures destruction for the given index corresponding connection
-void AsyncIP_CloseConnection( unsigned long connectionID )
+// Starts reconnection attempt for lost connection, if its next attempt time was reached, and handles its result. Returns true if connected
+static bool UpdateReconnection( unsigned long connectionID, AsyncIPConnection connection )
 {
-  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
-  if( connection == NULL ) return;
+  ReconnectionData* reconnection = connection->reconnection;
+  AsyncIPEventHandler ref_HandleEvent = connection->ref_HandleEvent;
+  void* eventUserData = connection->eventUserData;
   
-  IP_CloseConnection( connection->baseConnection );
-  connection->baseConnection = NULL;
+  // Closed sockets are detected by the reading thread, even if there are no messages to be sent
+  if( !reconnection->isDisconnected )
+  {
+    if( IP_GetSocketDescriptor( connection->baseConnection ) != (intptr_t) -1 ) return true;
+    MarkDisconnected( reconnection );
+    TSM_ReleaseItem( globalConnectionsList, connectionID );
+    NotifyEvent( connectionID, ref_HandleEvent, eventUserData, ASYNC_IP_DISCONNECTED );
+    return false;
+  }
   
-  TSQ_Discard( connection->readQueue );
-  TSQ_Discard( connection->writeQueue );
+  if( reconnection->attemptState == ATTEMPT_NONE && System_GetTimeMilliseconds() >= reconnection->nextAttemptTime ) 
+  {
+    reconnection->attemptState = ATTEMPT_RUNNING;
+    connection->isBaseBusy = true;
+    if( Thread_Start( AsyncReconnect, (void*) (uintptr_t) connectionID, THREAD_DETACHED ) == THREAD_INVALID_HANDLE ) 
+    {
+      reconnection->attemptState = ATTEMPT_FAILED;
+      connection->isBaseBusy = false;
+    }
+  }
   
-  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  if( reconnection->attemptState == ATTEMPT_NONE || reconnection->attemptState == ATTEMPT_RUNNING ) 
+  {
+    TSM_ReleaseItem( globalConnectionsList, connectionID );
+    return false;
+  }
   
-  TSM_RemoveItem( globalConnectionsList, connectionID );
+  bool isReconnected = ( reconnection->attemptState == ATTEMPT_SUCCEEDED );
+  reconnection->attemptState = ATTEMPT_NONE;
   
-  if( TSM_GetItemsCount( globalConnectionsList ) == 0 )
+  if( isReconnected )
   {
-    isNetworkRunning = false;
-    
-    (void) Thread_WaitExit( globalReadThread, 5000 );   
-    (void) Thread_WaitExit( globalWriteThread, 5000 );
-    
-    TSM_Discard( globalConnectionsList );
-    globalConnectionsList = NULL;
+    reconnection->isDisconnected = false;
+    // Zero-copy completions of the previous socket are lost, but its buffers are not read anymore
+    ReleaseBuffers( connectionID, connection->sentBuffersList, connection->sentBuffersCount );
+    connection->sentBuffersCount = 0;
+    connection->currentBuffer.sendsCount = connection->currentBuffer.pendingCompletionsCount = 0;
+    connection->nextSendID = 0;
+    if( connection->zeroCopyMinLength > 0 && !IP_EnableZeroCopy( connection->baseConnection ) ) connection->zeroCopyMinLength = 0;
+    if( connection->priority != ASYNC_IP_PRIORITY_NORMAL ) 
+      IP_SetTrafficClass( connection->baseConnection, PRIORITY_DSCP_LIST[ connection->priority ], PRIORITY_SOCKET_LIST[ connection->priority ] );
+    if( connection->pacingRate > 0 ) IP_SetPacingRate( connection->baseConnection, connection->pacingRate );
+    TSM_ReleaseItem( globalConnectionsList, connectionID );
+    NotifyEvent( connectionID, ref_HandleEvent, eventUserData, ASYNC_IP_RECONNECTED );
+    return false;
   }
   
-  return;
+  reconnection->attemptsCount++;
+  if( reconnection->settings.maxAttempts > 0 && reconnection->attemptsCount >= reconnection->settings.maxAttempts )
+  {
+    IP_REPORT_ERROR( "connection index %lu: giving up after %u reconnection attempts", connectionID, reconnection->attemptsCount );
+    TSM_ReleaseItem( globalConnectionsList, connectionID );
+    DiscardConnection( connectionID );
+    NotifyEvent( connectionID, ref_HandleEvent, eventUserData, ASYNC_IP_RECONNECTION_FAILED );
+    StopNetworkIfIdle();
+    return false;
+  }
+  
+  reconnection->nextAttemptTime = System_GetTimeMilliseconds() + GetReconnectionDelay( reconnection );
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return false;
+}
+
+// Advances graceful closing once all writes are sent. Returns true while there are still messages to be sent
+static bool UpdateClosing( unsigned long connectionID, AsyncIPConnection connection )
+{
+  bool hasPendingWrites = ( CountQueuedMessages( connection ) > 0 || connection->hasHeldMessage || HasPendingTransfers( connection ) );
+  bool isExpired = ( System_GetTimeMilliseconds() >= connection->closingDeadline );
+  
+  if( connection->closingState == CONNECTION_FLUSHING && !isExpired )
+  {
+    if( hasPendingWrites ) return true;
+    // Without half-close, there is no end of remote data to be waited for
+    connection->closingState = CONNECTION_DRAINING;
+    if( !IP_ShutdownSending( connection->baseConnection ) ) isExpired = true;
+  }
+  
+  // Remote side closing is detected by the reading thread, after previous messages are read
+  if( IP_GetSocketDescriptor( connection->baseConnection ) != (intptr_t) -1 && !isExpired ) 
+  {
+    TSM_ReleaseItem( globalConnectionsList, connectionID );
+    return false;
+  }
+  
+  if( hasPendingWrites || connection->closingState == CONNECTION_FLUSHING ) 
+    IP_REPORT_ERROR( "connection index %lu: closing deadline expired with messages not sent", connectionID );
+  
+  AsyncIPEventHandler ref_HandleEvent = connection->ref_HandleEvent;
+  void* eventUserData = connection->eventUserData;
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  NotifyEvent( connectionID, ref_HandleEvent, eventUserData, ASYNC_IP_CLOSED );
+  DiscardConnection( connectionID );
+  StopNetworkIfIdle();
+  
+  return false;
+}
+
+// Holds given message for reconnection, or discards the connection, after failed sending (releasing the connection)
+static void HandleSendFailure( unsigned long connectionID, AsyncIPConnection connection, const char* failedMessage )
+{
+  ReconnectionData* reconnection = connection->reconnection;
+  if( reconnection != NULL )
+  {
+    memcpy( connection->heldMessage, failedMessage, IP_MAX_MESSAGE_LENGTH );
+    connection->hasHeldMessage = true;
+    MarkDisconnected( reconnection );
+    AsyncIPEventHandler ref_HandleEvent = connection->ref_HandleEvent;
+    void* eventUserData = connection->eventUserData;
+    TSM_ReleaseItem( globalConnectionsList, connectionID );
+    NotifyEvent( connectionID, ref_HandleEvent, eventUserData, ASYNC_IP_DISCONNECTED );
+    return;
+  }
+  
+  // Failed connection is torn down as closed, so that its socket, queued messages and accounting are released
+  AsyncIPEventHandler ref_HandleEvent = connection->ref_HandleEvent;
+  void* eventUserData = connection->eventUserData;
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  NotifyEvent( connectionID, ref_HandleEvent, eventUserData, ASYNC_IP_CLOSED );
+  DiscardConnection( connectionID );
+  StopNetworkIfIdle();
+}
+
+// Sends first held or queued message. Returns 1 if sent, 0 if there is none and -1 if sending failed (releasing the connection)
+static int SendNextMessage( unsigned long connectionID, AsyncIPConnection connection )
+{
+  char firstMessage[ IP_MAX_MESSAGE_LENGTH ];
+  
+  // Message held across reconnection (or full ring) is sent before queued ones
+  if( connection->hasHeldMessage )
+  {
+    memcpy( firstMessage, connection->heldMessage, IP_MAX_MESSAGE_LENGTH );
+    connection->hasHeldMessage = false;
+  }
+  else
+  {
+    if( !DequeueMessage( connectionID, connection, firstMessage ) ) return 0;
+  }
+  
+  int sendResult = IP_SendMessage( connection->baseConnection, firstMessage );
+  if( sendResult == -1 )
+  {
+    HandleSendFailure( connectionID, connection, firstMessage );
+    return -1;
+  }
+  // Shared memory rings may be full, until the remote side reads from them
+  else if( sendResult == 1 )
+  {
+    memcpy( connection->heldMessage, firstMessage, IP_MAX_MESSAGE_LENGTH );
+    connection->hasHeldMessage = true;
+    return 0;
+  }
+  
+  return 1;
+}
+
+// Sends queued messages at once (up to given number), as a train of datagrams. Returns false if sending failed (releasing the connection)
+static bool SendMessagesTrain( unsigned long connectionID, AsyncIPConnection connection, size_t maxMessagesNumber )
+{
+  char messagesData[ QUEUE_MAX_ITEMS ][ IP_MAX_MESSAGE_LENGTH ];
+  const char* messagesList[ QUEUE_MAX_ITEMS ];
+  
+  size_t messagesNumber = 0;
+  while( messagesNumber < QUEUE_MAX_ITEMS && messagesNumber < maxMessagesNumber && DequeueMessage( connectionID, connection, messagesData[ messagesNumber ] ) )
+  {
+    messagesList[ messagesNumber ] = messagesData[ messagesNumber ];
+    messagesNumber++;
+  }
+  
+  if( IP_SendMessages( connection->baseConnection, messagesList, messagesNumber ) == -1 )
+  {
+    HandleSendFailure( connectionID, connection, messagesList[ 0 ] );
+    return false;
+  }
+  connection->writeDeficit -= messagesNumber * IP_MAX_MESSAGE_LENGTH;
+  
+  // Messages left (beyond sending allowance or train length) for the next train
+  if( CountQueuedMessages( connection ) > 0 ) ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+  
+  return true;
+}
+
+// Sends queued messages (corked for coalescing connections). Returns false if sending failed (releasing the connection)
+static bool SendQueuedMessages( unsigned long connectionID, AsyncIPConnection connection )
+{
+  size_t messagesNumber = CountQueuedMessages( connection ) + ( connection->hasHeldMessage ? 1 : 0 );
+  if( messagesNumber == 0 ) return true;
+  
+  // Messages take whole queue slots from the sending allowance of the connection
+  size_t batchLength = ( connection->writeDeficit > 0 ) ? (size_t) ( connection->writeDeficit + IP_MAX_MESSAGE_LENGTH - 1 ) / IP_MAX_MESSAGE_LENGTH : 0;
+  if( batchLength > messagesNumber ) batchLength = messagesNumber;
+  
+  // Offloading UDP connections send all queued messages in a single call, segmented into datagrams by the kernel
+  if( connection->isSegmenting && batchLength > 1 && !connection->hasHeldMessage ) return SendMessagesTrain( connectionID, connection, batchLength );
+  
+  // Coalescing connections send messages as soon as they are queued, but corked, so that partial segments wait for more
+  if( connection->isCoalescing && !connection->isCorked && batchLength > 0 )
+  {
+    connection->isCorked = IP_CorkSending( connection->baseConnection, true );
+    connection->corkTime = System_GetTimeMilliseconds();
+  }
+  // Control messages are not held
+  TSQueue controlQueue = connection->writeQueuesList[ ASYNC_IP_PRIORITY_CONTROL ];
+  if( connection->isCorked && controlQueue != NULL && TSQ_GetItemsCount( controlQueue ) > 0 ) connection->isFlushRequested = true;
+  
+  for( size_t messageIndex = 0; messageIndex < batchLength; messageIndex++ )
+  {
+    int sendResult = SendNextMessage( connectionID, connection );
+    if( sendResult == -1 ) return false;
+    if( sendResult == 0 ) break;
+    connection->writeDeficit -= IP_MAX_MESSAGE_LENGTH;
+  }
+  
+  // Remaining messages are sent on the next pass (or poll interval, when blocked by a full ring)
+  if( CountQueuedMessages( connection ) > 0 && !connection->hasHeldMessage ) ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+  
+  return true;
+}
+
+// Uncorks coalescing connection socket when flushed (or closing), or when partial segments have been held for the update interval
+static void UpdateCorking( AsyncIPConnection connection )
+{
+  if( !connection->isCorked ) return;
+  
+  bool isFlushing = connection->isFlushRequested || !connection->isCoalescing || connection->closingState != CONNECTION_OPEN;
+  if( !isFlushing && System_GetTimeMilliseconds() - connection->corkTime < WRITE_UPDATE_INTERVAL_MS ) return;
+  
+  IP_CorkSending( connection->baseConnection, false );
+  connection->isCorked = false;
+  connection->isFlushRequested = false;
+}
+
+// Sends next chunk of current (or first queued) file transfer. Returns true when the transfer is finished, with the event to be notified
+static bool SendFileChunk( AsyncIPConnection connection, enum AsyncIPEvent* ref_event )
+{
+  if( !connection->hasCurrentFile )
+  {
+    if( connection->fileQueue == NULL || TSQ_GetItemsCount( connection->fileQueue ) == 0 ) return false;
+    TSQ_Dequeue( connection->fileQueue, (void*) &(connection->currentFile), TSQUEUE_WAIT );
+    connection->hasCurrentFile = true;
+  }
+  
+  // Allowance may have been used by messages in this pass
+  if( connection->writeDeficit <= 0 ) return false;
+  
+  FileTransfer* transfer = &(connection->currentFile);
+  size_t chunkLength = ( transfer->remainingLength < FILE_CHUNK_LENGTH ) ? transfer->remainingLength : FILE_CHUNK_LENGTH;
+  if( chunkLength > (size_t) connection->writeDeficit ) chunkLength = (size_t) connection->writeDeficit;
+  long bytesSent = IP_SendFile( connection->baseConnection, transfer->fileDescriptor, transfer->offset, chunkLength );
+  if( bytesSent == -1 ) *ref_event = ASYNC_IP_FILE_FAILED;
+  else
+  {
+    connection->writeDeficit -= bytesSent;
+    transfer->offset += bytesSent;
+    transfer->remainingLength -= bytesSent;
+    if( transfer->remainingLength > 0 ) 
+    {
+      // Without progress (socket buffer full), sending is retried after the writing thread poll interval
+      if( bytesSent > 0 ) ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+      return false;
+    }
+    *ref_event = ASYNC_IP_FILE_SENT;
+  }
+  
+  connection->hasCurrentFile = false;
+  
+  return true;
+}
+
+// Counts zero-copy sends of given buffer inside given range of finished send numbers
+static inline uint32_t CountCompletedSends( BufferTransfer* transfer, uint32_t firstID, uint32_t lastID )
+{
+  if( transfer->sendsCount == 0 ) return 0;
+  
+  uint32_t lastSendID = transfer->firstSendID + transfer->sendsCount - 1;
+  if( firstID < transfer->firstSendID ) firstID = transfer->firstSendID;
+  if( lastID > lastSendID ) lastID = lastSendID;
+  
+  return ( firstID <= lastID ) ? lastID - firstID + 1 : 0;
+}
+
+// Reads zero-copy completions from the kernel, adding buffers no longer referenced to the given list
+static void ReadBufferCompletions( AsyncIPConnection connection, BufferTransfer* releasedList, size_t* ref_releasedCount )
+{
+  if( connection->sentBuffersCount == 0 && !( connection->hasCurrentBuffer && connection->currentBuffer.sendsCount > 0 ) ) return;
+  
+  uint32_t firstID, lastID;
+  while( IP_ReadZeroCopyCompletion( connection->baseConnection, &firstID, &lastID ) > 0 )
+  {
+    if( connection->hasCurrentBuffer ) 
+      connection->currentBuffer.pendingCompletionsCount -= CountCompletedSends( &(connection->currentBuffer), firstID, lastID );
+    
+    size_t bufferIndex = 0;
+    while( bufferIndex < connection->sentBuffersCount )
+    {
+      BufferTransfer* transfer = &(connection->sentBuffersList[ bufferIndex ]);
+      transfer->pendingCompletionsCount -= CountCompletedSends( transfer, firstID, lastID );
+      if( transfer->pendingCompletionsCount > 0 ) 
+      {
+        bufferIndex++;
+        continue;
+      }
+      
+      releasedList[ (*ref_releasedCount)++ ] = *transfer;
+      connection->sentBuffersCount--;
+      memmove( transfer, transfer + 1, ( connection->sentBuffersCount - bufferIndex ) * sizeof(BufferTransfer) );
+    }
+  }
+}
+
+// Sends as much as possible of current (or first queued) buffer, adding it to the given list when finished and not referenced by the kernel
+static void SendBufferData( AsyncIPConnection connection, BufferTransfer* releasedList, size_t* ref_releasedCount )
+{
+  if( !connection->hasCurrentBuffer )
+  {
+    if( connection->bufferQueue == NULL || TSQ_GetItemsCount( connection->bufferQueue ) == 0 ) return;
+    // Limits number of buffers referenced by the kernel, waiting for their completions
+    if( connection->sentBuffersCount >= QUEUE_MAX_ITEMS ) return;
+    TSQ_Dequeue( connection->bufferQueue, (void*) &(connection->currentBuffer), TSQUEUE_WAIT );
+    connection->currentBuffer.isZeroCopy = ( connection->zeroCopyMinLength > 0 && connection->currentBuffer.length >= connection->zeroCopyMinLength );
+    connection->currentBuffer.firstSendID = connection->nextSendID;
+    connection->hasCurrentBuffer = true;
+  }
+  
+  // Allowance may have been used by messages and files in this pass
+  if( connection->writeDeficit <= 0 ) return;
+  
+  // Stream data is split to fit the allowance, while datagrams are sent whole (and repaid on the next passes)
+  BufferTransfer* transfer = &(connection->currentBuffer);
+  size_t sendLength = transfer->length - transfer->sentLength;
+  if( sendLength > (size_t) connection->writeDeficit && IP_IsStream( connection->baseConnection ) ) sendLength = (size_t) connection->writeDeficit;
+  long bytesSent = IP_SendBuffer( connection->baseConnection, transfer->buffer + transfer->sentLength, sendLength, transfer->isZeroCopy );
+  if( bytesSent == 0 ) return;    // Retried after the writing thread poll interval
+  else if( bytesSent > 0 )
+  {
+    connection->writeDeficit -= bytesSent;
+    if( transfer->isZeroCopy )
+    {
+      connection->nextSendID++;
+      transfer->sendsCount++;
+      transfer->pendingCompletionsCount++;
+    }
+    transfer->sentLength += bytesSent;
+    ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+    if( transfer->sentLength < transfer->length ) return;
+  }
+  
+  // Finished (or failed) buffers are released once the kernel is done with them
+  connection->hasCurrentBuffer = false;
+  if( transfer->pendingCompletionsCount > 0 ) connection->sentBuffersList[ connection->sentBuffersCount++ ] = *transfer;
+  else releasedList[ (*ref_releasedCount)++ ] = *transfer;
+}
+
+// Adds tokens accumulated since last pass at the connection rate, returning the part of its allowance not covered by them
+static int64_t UpdatePacing( AsyncIPConnection connection )
+{
+  if( connection->pacingRate == 0 ) return 0;
+  
+  // Idle time beyond one second would only fill the bucket (and overflow the calculation)
+  uint64_t currentTime = System_GetTimeNanoseconds();
+  if( currentTime - connection->pacingTime > 1000000000 ) connection->pacingTime = currentTime - 1000000000;
+  
+  // Time of fractions of bytes not added yet is kept for the next pass, so that slow rates are not rounded down to zero
+  uint64_t addedLength = ( currentTime - connection->pacingTime ) * connection->pacingRate / 1000000000;
+  connection->pacingTime += addedLength * 1000000000 / connection->pacingRate;
+  connection->pacingTokens += (int64_t) addedLength;
+  
+  int64_t burstLength = GetPacingBurstLength( connection->pacingRate );
+  if( connection->pacingTokens >= burstLength )
+  {
+    connection->pacingTokens = burstLength;
+    connection->pacingTime = currentTime;
+  }
+  
+  int64_t tokensLength = ( connection->pacingTokens > 0 ) ? connection->pacingTokens : 0;
+  return ( connection->writeDeficit > tokensLength ) ? connection->writeDeficit - tokensLength : 0;
+}
+
+// Lists given connection for the next poll interval pass. Without memory for it, the next pass runs over all connections
+static void RetryWriting( unsigned long connectionID )
+{
+  if( retriedConnectionsCount >= retriedConnectionsSize )
+  {
+    size_t newSize = ( retriedConnectionsSize > 0 ) ? 2 * retriedConnectionsSize : QUEUE_MAX_ITEMS;
+    unsigned long* newList = (unsigned long*) realloc( retriedConnectionsList, newSize * sizeof(unsigned long) );
+    if( newList == NULL )
+    {
+      IP_REPORT_ERROR( "connection index %lu: failed listing connection for writing retries", connectionID );
+      ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+      return;
+    }
+    retriedConnectionsList = newList;
+    retriedConnectionsSize = newSize;
+  }
+  
+  retriedConnectionsList[ retriedConnectionsCount++ ] = connectionID;
+}
+
+static void WriteFromQueue( unsigned long connectionID )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return;
+  
+  // Base connection in use by another thread is written on a later pass
+  if( connection->isBaseBusy )
+  {
+    TSM_ReleaseItem( globalConnectionsList, connectionID );
+    RetryWriting( connectionID );
+    return;
+  }
+  
+  // Filter handshakes of silent peers are not ended by the reading thread, only by their deadline
+  (void) IP_CheckStreamFilter( connection->baseConnection );
+  
+  // Connection is released when closed (or not connected)
+  if( connection->closingState != CONNECTION_OPEN && !UpdateClosing( connectionID, connection ) ) return;
+  
+  ReconnectionData* reconnection = connection->reconnection;
+  if( reconnection != NULL && !UpdateReconnection( connectionID, connection ) ) return;
+  
+  // Buffers allocated by the reading thread are charged on the next pass
+  UpdateBaseMemory( connection );
+  
+  // Deficit round robin: each pass grants connections an allowance proportional to their weight, so that busy ones do not 
+  // monopolize the writing thread. Unused allowance is kept (up to one quantum) only while there is data waiting to be sent
+  int64_t quantumLength = (int64_t) connection->writeWeight * WRITE_QUANTUM_LENGTH;
+  if( connection->writeDeficit > quantumLength ) connection->writeDeficit = quantumLength;
+  connection->writeDeficit += quantumLength;
+  
+  // Token bucket: paced connections only use the part of their allowance covered by the bytes accumulated at their rate, 
+  // keeping the rest for the next passes instead of bursting into the socket (and network) buffers
+  int64_t heldLength = UpdatePacing( connection );
+  connection->writeDeficit -= heldLength;
+  int64_t allowedLength = connection->writeDeficit;
+  
+  enum AsyncIPEvent fileEvent;
+  bool isFileFinished = false;
+  if( allowedLength > 0 )
+  {
+    if( !SendQueuedMessages( connectionID, connection ) ) return;    // Connection already released on failure
+    // File data and buffers are sent after messages, so that a long transfer does not delay them
+    isFileFinished = SendFileChunk( connection, &fileEvent );
+  }
+  
+  BufferTransfer releasedBuffersList[ QUEUE_MAX_ITEMS + 1 ];
+  size_t releasedBuffersCount = 0;
+  ReadBufferCompletions( connection, releasedBuffersList, &releasedBuffersCount );
+  SendBufferData( connection, releasedBuffersList, &releasedBuffersCount );
+  UpdateCorking( connection );
+  
+  if( connection->pacingRate > 0 )
+  {
+    connection->pacingTokens -= allowedLength - connection->writeDeficit;
+    connection->writeDeficit += heldLength;
+  }
+  
+  // Connections waiting only for allowance get it on the next pass, without waiting for the poll interval (except paced 
+  // ones, which wait for tokens, and transfers stopped by full socket buffers)
+  if( CountQueuedMessages( connection ) > 0 || connection->hasHeldMessage || HasPendingTransfers( connection ) )
+  {
+    if( connection->pacingRate > 0 || connection->hasHeldMessage ) RetryWriting( connectionID );
+    else if( connection->writeDeficit <= 0 ) ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+    else if( HasPendingTransfers( connection ) ) RetryWriting( connectionID );
+  }
+  else if( connection->writeDeficit > 0 ) connection->writeDeficit = 0;
+  
+  AsyncIPEventHandler ref_HandleEvent = connection->ref_HandleEvent;
+  void* eventUserData = connection->eventUserData;
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  if( isFileFinished ) NotifyEvent( connectionID, ref_HandleEvent, eventUserData, fileEvent );
+  ReleaseBuffers( connectionID, releasedBuffersList, releasedBuffersCount );
+}
+
+// Writes connections listed for retrying on the previous pass. Connections listed again are kept for the next one
+static void WriteRetriedConnections( void )
+{
+  size_t retriedNumber = retriedConnectionsCount;
+  for( size_t retryIndex = 0; retryIndex < retriedNumber; retryIndex++ )
+    WriteFromQueue( retriedConnectionsList[ retryIndex ] );
+  
+  retriedConnectionsCount -= retriedNumber;
+  memmove( retriedConnectionsList, retriedConnectionsList + retriedNumber, retriedConnectionsCount * sizeof(unsigned long) );
+}
+
+// Loop of message writing (removing in order from queue) to be called asyncronously for client connections
+static void* AsyncWriteQueues( void* args )
+{
+  uint64_t lastRequestsCount = 0;
+  uint64_t lastUpdateTime = 0;
+  
+  isNetworkThread = true;
+  
+  while( isNetworkRunning )
+  {
+    uint64_t requestsCount = ATOMIC_LOAD( &writeRequestsCount );
+    uint64_t currentTime = System_GetTimeMilliseconds();
+    if( requestsCount != lastRequestsCount || currentTime - lastUpdateTime >= WRITE_UPDATE_INTERVAL_MS )
+    {
+      lastRequestsCount = requestsCount;
+      lastUpdateTime = currentTime;
+      retriedConnectionsCount = 0;      // Listed again by the full pass
+      uint64_t passStartTime = System_GetTimeNanoseconds();
+      TSM_RunForAllKeys( globalConnectionsList, WriteFromQueue );
+      UpdateMaxLoopTime( passStartTime );
+      // New requests during the pass are handled without waiting
+      if( ATOMIC_LOAD( &writeRequestsCount ) != requestsCount ) continue;
+    }
+    // Between full passes, only connections waiting for tokens or socket buffers are visited
+    else if( retriedConnectionsCount > 0 )
+    {
+      uint64_t passStartTime = System_GetTimeNanoseconds();
+      WriteRetriedConnections();
+      UpdateMaxLoopTime( passStartTime );
+    }
+    
+#ifdef _WIN32
+    Sleep( WRITE_POLL_INTERVAL_US / 1000 );
+#else
+    usleep( WRITE_POLL_INTERVAL_US );
+#endif
+  }
+  
+  free( retriedConnectionsList );
+  retriedConnectionsList = NULL;
+  retriedConnectionsCount = retriedConnectionsSize = 0;
+  
+  return NULL;//(void*) 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                      SYNCRONOUS UPDATE                                          /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Get (and remove) message from the beginning (oldest) of the given index corresponding read queue, with its kernel receive time
+// Method to be called from the main thread
+char* AsyncIP_ReadTimestampedMessage( unsigned long clientID, uint64_t* ref_receiveTime )
+{
+  static QueuedMessage messageData;
+  char* firstMessage = NULL;
+  
+  AsyncIPConnection client = TSM_AcquireItem( globalConnectionsList, clientID );
+  if( client != NULL )
+  {
+    if( !IP_IsServer( client->baseConnection ) )
+    {
+      if( TSQ_GetItemsCount( client->readQueue ) > 0 )
+      {
+        TSQ_Dequeue( client->readQueue, (void*) &messageData, TSQUEUE_WAIT );
+        IP_TRACE( READ_DEQUEUE, clientID, IP_MAX_MESSAGE_LENGTH );
+        firstMessage = messageData.data;
+        if( ref_receiveTime != NULL ) *ref_receiveTime = messageData.receiveTime;
+      }
+    }
+    else
+      IP_REPORT_ERROR( "connection index %lu is not of a client connection", clientID );
+  }
+  TSM_ReleaseItem( globalConnectionsList, clientID );
+  
+  return firstMessage;
+}
+
+char* AsyncIP_ReadMessage( unsigned long clientID ) { return AsyncIP_ReadTimestampedMessage( clientID, NULL ); }
+
+bool AsyncIP_SetReceiveTimestamps( unsigned long connectionID, bool isEnabled )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  // Holding the connection keeps the read thread from receiving while the option changes
+  bool isSet = IP_SetReceiveTimestamps( connection->baseConnection, isEnabled );
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return isSet;
+}
+
+bool AsyncIP_SetBulkReceive( unsigned long connectionID, size_t windowLength )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  // New window is reserved within the memory budget while allocated, and then charged as base connection memory
+  bool isSet = false;
+  if( ChargeMemory( connection, windowLength ) )
+  {
+    isSet = IP_SetBulkReceive( connection->baseConnection, windowLength );
+    ReleaseMemory( connection, windowLength );
+    UpdateBaseMemory( connection );
+  }
+  else IP_REPORT_ERROR( "connection index %lu: memory budget reached, bulk window not allocated", connectionID );
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return isSet;
+}
+
+const void* AsyncIP_ReceiveBulk( unsigned long connectionID, size_t* ref_length, unsigned int timeout )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return NULL;
+  
+  IPConnection baseConnection = connection->baseConnection;
+  
+  // Connection is not held while waiting for data, so that its writes are not blocked
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return IP_ReceiveBulk( baseConnection, ref_length, timeout );
+}
+
+// Pushes given message to the write lane of given priority (NULL for the connection default) of connection with given identifier
+static bool EnqueueMessage( unsigned long connectionID, const char* message, const enum AsyncIPPriority* ref_priority )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  if( connection->closingState != CONNECTION_OPEN )
+  {
+    TSM_ReleaseItem( globalConnectionsList, connectionID );
+    IP_REPORT_ERROR( "connection index %lu is closing", connectionID );
+    return false;
+  }
+  
+  enum AsyncIPPriority priority = ( ref_priority != NULL ) ? *ref_priority : connection->priority;
+  if( !IsWriteAdmitted( priority, IP_MAX_MESSAGE_LENGTH ) )
+  {
+    TSM_ReleaseItem( globalConnectionsList, connectionID );
+    IP_REPORT_ERROR( "connection index %lu: message (priority %d) shed above queued bytes limit", connectionID, priority );
+    return false;
+  }
+  
+  // Lanes allocated beyond the memory budget would be the first to run out, so writes are refused instead
+  if( connection->writeQueuesList[ priority ] == NULL )
+  {
+    if( !ChargeMemory( connection, QUEUE_MAX_ITEMS * IP_MAX_MESSAGE_LENGTH ) )
+    {
+      TSM_ReleaseItem( globalConnectionsList, connectionID );
+      IP_REPORT_ERROR( "connection index %lu: memory budget reached, write lane (priority %d) not created", connectionID, priority );
+      return false;
+    }
+    connection->writeQueuesList[ priority ] = TSQ_Create( QUEUE_MAX_ITEMS, IP_MAX_MESSAGE_LENGTH );
+  }
+  TSQueue writeQueue = connection->writeQueuesList[ priority ];
+  
+  // Messages of full queues replace older ones, taking no more space
+  if( TSQ_GetItemsCount( writeQueue ) >= QUEUE_MAX_ITEMS )
+    IP_REPORT_ERROR( "connection index %lu write queue (priority %d) is full", connectionID, priority );
+  else
+    ATOMIC_FETCH_ADD( &queuedBytesCount, IP_MAX_MESSAGE_LENGTH );
+  
+  TSQ_Enqueue( writeQueue, (void*) message, TSQUEUE_NOWAIT );
+  IP_TRACE( WRITE_ENQUEUE, connectionID, IP_MAX_MESSAGE_LENGTH );
+  
+  ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return true;
+}
+
+bool AsyncIP_WriteMessage( unsigned long connectionID, const char* message )
+{
+  return EnqueueMessage( connectionID, message, NULL );
+}
+
+bool AsyncIP_WritePriorityMessage( unsigned long connectionID, const char* message, enum AsyncIPPriority priority )
+{
+  if( (int) priority < 0 || priority >= ASYNC_IP_PRIORITIES_NUMBER )
+  {
+    IP_REPORT_ERROR( "invalid message priority %d", priority );
+    return false;
+  }
+  
+  return EnqueueMessage( connectionID, message, &priority );
+}
+
+bool AsyncIP_SetPriority( unsigned long connectionID, enum AsyncIPPriority priority )
+{
+  if( (int) priority < 0 || priority >= ASYNC_IP_PRIORITIES_NUMBER )
+  {
+    IP_REPORT_ERROR( "invalid connection priority %d", priority );
+    return false;
+  }
+  
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  // Packets of a socket cannot be marked individually, so it gets the class of its default traffic
+  bool isSet = IP_SetTrafficClass( connection->baseConnection, PRIORITY_DSCP_LIST[ priority ], PRIORITY_SOCKET_LIST[ priority ] );
+  if( isSet ) connection->priority = priority;
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return isSet;
+}
+
+bool AsyncIP_SetCoalescing( unsigned long connectionID, bool isEnabled )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  bool isSet = false;
+  if( IP_IsServer( connection->baseConnection ) )
+    IP_REPORT_ERROR( "connection index %lu is not of a client connection", connectionID );
+  else
+  {
+    connection->isCoalescing = isEnabled;
+    isSet = true;
+  }
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  // Partial segment held so far is sent when coalescing is disabled
+  if( isSet && !isEnabled ) ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+  
+  return isSet;
+}
+
+bool AsyncIP_SetSegmentationOffload( unsigned long connectionID, bool isEnabled )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  bool isSet = IP_SetSegmentationOffload( connection->baseConnection, isEnabled );
+  if( isSet ) connection->isSegmenting = isEnabled;
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return isSet;
+}
+
+bool AsyncIP_SetWriteWeight( unsigned long connectionID, unsigned int weight )
+{
+  if( weight == 0 )
+  {
+    IP_REPORT_ERROR( "connection index %lu: write weight must be at least 1", connectionID );
+    return false;
+  }
+  
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  connection->writeWeight = weight;
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return true;
+}
+
+bool AsyncIP_SetPacingRate( unsigned long connectionID, uint64_t bytesPerSecond )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  // Kernel pacing spaces out packets inside the bursts allowed by the token bucket
+  bool isSet = IP_SetPacingRate( connection->baseConnection, bytesPerSecond );
+  if( isSet )
+  {
+    // Newly paced connections start with a full bucket, while rate changes keep the tokens accumulated so far
+    int64_t burstLength = GetPacingBurstLength( bytesPerSecond );
+    if( connection->pacingRate == 0 || connection->pacingTokens > burstLength ) connection->pacingTokens = burstLength;
+    connection->pacingTime = System_GetTimeNanoseconds();
+    connection->pacingRate = bytesPerSecond;
+  }
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  // Data held back by a previous rate is sent right away when pacing is removed
+  if( isSet ) ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+  
+  return isSet;
+}
+
+bool AsyncIP_SetMaxClients( unsigned long serverID, size_t maxClientsNumber )
+{
+  AsyncIPConnection server = TSM_AcquireItem( globalConnectionsList, serverID );
+  if( server == NULL ) return false;
+  
+  bool isSet = IP_SetMaxClients( server->baseConnection, maxClientsNumber );
+  
+  TSM_ReleaseItem( globalConnectionsList, serverID );
+  
+  return isSet;
+}
+
+void AsyncIP_SetAdmissionSettings( const AsyncIPAdmissionSettings* settings )
+{
+  if( settings == NULL ) return;
+  
+  admissionSettings = *settings;
+}
+
+bool AsyncIP_Flush( unsigned long connectionID )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  connection->isFlushRequested = true;
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+  
+  return true;
+}
+
+bool AsyncIP_SendFile( unsigned long connectionID, int fileDescriptor, uint64_t offset, size_t length )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  bool isQueued = false;
+  if( IP_IsServer( connection->baseConnection ) )
+    IP_REPORT_ERROR( "connection index %lu is not of a client connection", connectionID );
+  else if( connection->closingState != CONNECTION_OPEN )
+    IP_REPORT_ERROR( "connection index %lu is closing", connectionID );
+  else
+  {
+    if( connection->fileQueue == NULL && ChargeMemory( connection, QUEUE_MAX_ITEMS * sizeof(FileTransfer) ) ) 
+      connection->fileQueue = TSQ_Create( QUEUE_MAX_ITEMS, sizeof(FileTransfer) );
+    
+    if( connection->fileQueue == NULL )
+      IP_REPORT_ERROR( "connection index %lu: memory budget reached, file queue not created", connectionID );
+    else if( TSQ_GetItemsCount( connection->fileQueue ) >= QUEUE_MAX_ITEMS )
+      IP_REPORT_ERROR( "connection index %lu file queue is full", connectionID );
+    else
+    {
+      FileTransfer transfer = { .fileDescriptor = fileDescriptor, .offset = offset, .remainingLength = length };
+      TSQ_Enqueue( connection->fileQueue, (void*) &transfer, TSQUEUE_NOWAIT );
+      isQueued = true;
+    }
+  }
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  if( isQueued ) ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+  
+  return isQueued;
+}
+
+bool AsyncIP_SetZeroCopy( unsigned long connectionID, size_t minLength )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  bool isSet = ( minLength == 0 || IP_EnableZeroCopy( connection->baseConnection ) );
+  if( isSet ) connection->zeroCopyMinLength = minLength;
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  return isSet;
+}
+
+bool AsyncIP_WriteBuffer( unsigned long connectionID, const void* buffer, size_t length, AsyncIPBufferReleaser releaser, void* userData )
+{
+  if( buffer == NULL || length == 0 ) return false;
+  
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  bool isQueued = false;
+  if( IP_IsServer( connection->baseConnection ) )
+    IP_REPORT_ERROR( "connection index %lu is not of a client connection", connectionID );
+  else if( connection->closingState != CONNECTION_OPEN )
+    IP_REPORT_ERROR( "connection index %lu is closing", connectionID );
+  else
+  {
+    // Buffers sent with zero-copy wait in a list of the same capacity for their completions
+    if( connection->bufferQueue == NULL && ChargeMemory( connection, 2 * QUEUE_MAX_ITEMS * sizeof(BufferTransfer) ) ) 
+    {
+      connection->bufferQueue = TSQ_Create( QUEUE_MAX_ITEMS, sizeof(BufferTransfer) );
+      connection->sentBuffersList = (BufferTransfer*) calloc( QUEUE_MAX_ITEMS, sizeof(BufferTransfer) );
+      // Queued buffers are only sent with room for their completions
+      if( connection->bufferQueue == NULL || connection->sentBuffersList == NULL )
+      {
+        if( connection->bufferQueue != NULL ) TSQ_Discard( connection->bufferQueue );
+        connection->bufferQueue = NULL;
+        free( connection->sentBuffersList );
+        connection->sentBuffersList = NULL;
+        ReleaseMemory( connection, 2 * QUEUE_MAX_ITEMS * sizeof(BufferTransfer) );
+      }
+    }
+    
+    if( connection->bufferQueue == NULL )
+      IP_REPORT_ERROR( "connection index %lu: memory budget reached (or allocation failed), buffer queue not created", connectionID );
+    else if( TSQ_GetItemsCount( connection->bufferQueue ) >= QUEUE_MAX_ITEMS )
+      IP_REPORT_ERROR( "connection index %lu buffer queue is full", connectionID );
+    else if( !IsWriteAdmitted( connection->priority, length ) )
+      IP_REPORT_ERROR( "connection index %lu: buffer (priority %d) shed above queued bytes limit", connectionID, connection->priority );
+    else
+    {
+      BufferTransfer transfer = { .buffer = (const char*) buffer, .length = length, .ref_Release = releaser, .userData = userData };
+      TSQ_Enqueue( connection->bufferQueue, (void*) &transfer, TSQUEUE_NOWAIT );
+      ATOMIC_FETCH_ADD( &queuedBytesCount, length );
+      isQueued = true;
+    }
+  }
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  if( isQueued ) ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+  
+  return isQueued;
+}
+
+bool AsyncIP_WriteTypedMessage( unsigned long connectionID, uint8_t typeID, const void* payload, size_t payloadLength )
+{
+  char message[ IP_MAX_MESSAGE_LENGTH ] = { 0 };
+  
+  if( IPDispatch_BuildMessage( message, typeID, payload, payloadLength ) == 0 ) return false;
+  
+  return AsyncIP_WriteMessage( connectionID, message );
+}
+
+unsigned long AsyncIP_GetClient( unsigned long serverID )
+{
+  unsigned long firstClient = (unsigned long) IP_CONNECTION_INVALID_ID;
+
+  AsyncIPConnection server = TSM_AcquireItem( globalConnectionsList, serverID );
+  if( server != NULL )
+  {
+    if( IP_IsServer( server->baseConnection ) )
+    {
+      if( TSQ_GetItemsCount( server->readQueue ) > 0 ) 
+      {
+        TSQ_Dequeue( server->readQueue, &firstClient, TSQUEUE_WAIT );
+        IP_TRACE( READ_DEQUEUE, serverID, sizeof(unsigned long) );
+      }
+    }
+    else
+      IP_REPORT_ERROR( "connection index %lu is not a server index", serverID );
+    
+    TSM_ReleaseItem( globalConnectionsList, serverID );
+  }
+  
+  return firstClient; 
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                       CONNECTION POOL                                           /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Lazily creates pool lock, keeping the first one created if called concurrently
+static ThreadLock GetPoolLock( void )
+{
+  if( poolLock == NULL )
+  {
+    ThreadLock newLock = ThreadLock_Create();
+    if( !ATOMIC_COMPARE_EXCHANGE_POINTER( &poolLock, NULL, newLock ) ) ThreadLock_Discard( newLock );
+  }
+  
+  return poolLock;
+}
+
+static inline bool IsPoolDestination( PooledConnection* entry, uint8_t connectionType, const char* host, uint16_t port )
+{
+  return ( entry->connectionType == connectionType && entry->port == port && strcmp( entry->host, host ) == 0 );
+}
+
+// Pool lock should be held by the caller of the following methods
+
+static size_t FindPooledConnection( unsigned long connectionID )
+{
+  for( size_t entryIndex = 0; entryIndex < pooledConnectionsCount; entryIndex++ )
+  {
+    if( pooledConnectionsList[ entryIndex ].connectionID == connectionID ) return entryIndex;
+  }
+  
+  return pooledConnectionsCount;
+}
+
+static bool AddPooledConnection( uint8_t connectionType, const char* host, uint16_t port )
+{
+  PooledConnection* newList = (PooledConnection*) realloc( pooledConnectionsList, ( pooledConnectionsCount + 1 ) * sizeof(PooledConnection) );
+  if( newList == NULL ) return false;
+  
+  pooledConnectionsList = newList;
+  PooledConnection* entry = &(pooledConnectionsList[ pooledConnectionsCount++ ]);
+  entry->connectionID = (unsigned long) IP_CONNECTION_INVALID_ID;
+  entry->connectionType = connectionType;
+  strcpy( entry->host, host );
+  entry->port = port;
+  entry->isIdle = false;
+  
+  return true;
+}
+
+static void RemovePooledConnection( size_t entryIndex )
+{
+  pooledConnectionsList[ entryIndex ] = pooledConnectionsList[ --pooledConnectionsCount ];
+}
+
+// Removes idle connections past their timeout, returning their identifiers, to be closed once the lock is released
+static size_t ExpireIdleConnections( unsigned long* expiredIDsList )
+{
+  if( poolSettings.idleTimeout == 0 ) return 0;
+  
+  uint64_t currentTime = System_GetTimeMilliseconds();
+  size_t expiredCount = 0;
+  size_t entryIndex = 0;
+  while( entryIndex < pooledConnectionsCount && expiredCount < POOL_EXPIRED_MAX )
+  {
+    PooledConnection* entry = &(pooledConnectionsList[ entryIndex ]);
+    if( entry->isIdle && currentTime - entry->idleTime >= poolSettings.idleTimeout )
+    {
+      expiredIDsList[ expiredCount++ ] = entry->connectionID;
+      RemovePooledConnection( entryIndex );
+    }
+    else entryIndex++;
+  }
+  
+  return expiredCount;
+}
+
+// Discarded connections leave the pool, as their identifiers may be reused by new connections
+static void ForgetPooledConnection( unsigned long connectionID )
+{
+  if( poolLock == NULL ) return;
+  
+  ThreadLock_Aquire( poolLock );
+  size_t entryIndex = FindPooledConnection( connectionID );
+  if( entryIndex < pooledConnectionsCount ) RemovePooledConnection( entryIndex );
+  ThreadLock_Release( poolLock );
+}
+
+// Connections with unread messages would deliver stale data to the next user
+static bool IsPooledConnectionHealthy( unsigned long connectionID, bool isApplicationChecked )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  bool isHealthy = IP_IsConnected( connection->baseConnection ) && TSQ_GetItemsCount( connection->readQueue ) == 0;
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  bool (*ref_CheckHealth)( unsigned long ) = poolSettings.ref_CheckHealth;
+  if( isHealthy && isApplicationChecked && ref_CheckHealth != NULL ) isHealthy = ref_CheckHealth( connectionID );
+  
+  return isHealthy;
+}
+
+void AsyncIP_SetPoolSettings( const AsyncIPPoolSettings* settings )
+{
+  if( settings == NULL ) return;
+  
+  ThreadLock lock = GetPoolLock();
+  ThreadLock_Aquire( lock );
+  poolSettings = *settings;
+  ThreadLock_Release( lock );
+}
+
+unsigned long AsyncIP_AcquirePooledClient( uint8_t connectionType, const char* host, uint16_t port )
+{
+  if( ( connectionType & IP_SERVER ) || host == NULL || strlen( host ) >= POOL_HOST_LENGTH )
+  {
+    IP_REPORT_ERROR( "invalid pooled connection type %x or host %s", connectionType, ( host == NULL ) ? "(NULL)" : host );
+    return (unsigned long) IP_CONNECTION_INVALID_ID;
+  }
+  
+  ThreadLock lock = GetPoolLock();
+  
+  // Closing takes connection locks, never while holding the pool one
+  unsigned long expiredIDsList[ POOL_EXPIRED_MAX ];
+  ThreadLock_Aquire( lock );
+  size_t expiredCount = ExpireIdleConnections( expiredIDsList );
+  ThreadLock_Release( lock );
+  for( size_t expiredIndex = 0; expiredIndex < expiredCount; expiredIndex++ )
+    AsyncIP_CloseConnection( expiredIDsList[ expiredIndex ] );
+  
+  while( true )
+  {
+    ThreadLock_Aquire( lock );
+    
+    // Most recently released connection is the least likely to have been closed by the remote side
+    PooledConnection* idleEntry = NULL;
+    size_t destinationConnectionsCount = 0;
+    for( size_t entryIndex = 0; entryIndex < pooledConnectionsCount; entryIndex++ )
+    {
+      PooledConnection* entry = &(pooledConnectionsList[ entryIndex ]);
+      if( !IsPoolDestination( entry, connectionType, host, port ) ) continue;
+      destinationConnectionsCount++;
+      if( entry->isIdle && ( idleEntry == NULL || entry->idleTime > idleEntry->idleTime ) ) idleEntry = entry;
+    }
+    
+    if( idleEntry != NULL )
+    {
+      unsigned long connectionID = idleEntry->connectionID;
+      idleEntry->isIdle = false;
+      ThreadLock_Release( lock );
+      
+      if( IsPooledConnectionHealthy( connectionID, true ) ) return connectionID;
+      
+      ThreadLock_Aquire( lock );
+      size_t entryIndex = FindPooledConnection( connectionID );
+      if( entryIndex < pooledConnectionsCount ) RemovePooledConnection( entryIndex );
+      ThreadLock_Release( lock );
+      AsyncIP_CloseConnection( connectionID );
+      continue;
+    }
+    
+    if( poolSettings.maxConnections > 0 && destinationConnectionsCount >= poolSettings.maxConnections )
+    {
+      ThreadLock_Release( lock );
+      IP_REPORT_ERROR( "maximum number of pooled connections (%lu) to %s/%u reached", poolSettings.maxConnections, host, port );
+      return (unsigned long) IP_CONNECTION_INVALID_ID;
+    }
+    
+    // Placeholder entry counts for the limit while the connection is opened without holding the lock
+    bool isAdded = AddPooledConnection( connectionType, host, port );
+    ThreadLock_Release( lock );
+    if( !isAdded ) return (unsigned long) IP_CONNECTION_INVALID_ID;
+    break;
+  }
+  
+  unsigned long connectionID = AsyncIP_OpenConnection( connectionType, host, port );
+  
+  ThreadLock_Aquire( lock );
+  for( size_t entryIndex = 0; entryIndex < pooledConnectionsCount; entryIndex++ )
+  {
+    PooledConnection* entry = &(pooledConnectionsList[ entryIndex ]);
+    if( entry->connectionID == (unsigned long) IP_CONNECTION_INVALID_ID && IsPoolDestination( entry, connectionType, host, port ) )
+    {
+      if( connectionID == (unsigned long) IP_CONNECTION_INVALID_ID ) RemovePooledConnection( entryIndex );
+      else entry->connectionID = connectionID;
+      break;
+    }
+  }
+  ThreadLock_Release( lock );
+  
+  return connectionID;
+}
+
+void AsyncIP_ReleasePooledClient( unsigned long connectionID )
+{
+  bool isHealthy = IsPooledConnectionHealthy( connectionID, false );
+  
+  ThreadLock lock = GetPoolLock();
+  ThreadLock_Aquire( lock );
+  
+  size_t entryIndex = FindPooledConnection( connectionID );
+  if( entryIndex >= pooledConnectionsCount || pooledConnectionsList[ entryIndex ].isIdle )
+  {
+    ThreadLock_Release( lock );
+    // Discarded connections (e.g. closed by the remote side) have already left the pool
+    if( isHealthy ) IP_REPORT_ERROR( "connection index %lu is not a pooled connection in use", connectionID );
+    return;
+  }
+  
+  PooledConnection* releasedEntry = &(pooledConnectionsList[ entryIndex ]);
+  size_t idleConnectionsCount = 0;
+  for( size_t otherIndex = 0; otherIndex < pooledConnectionsCount; otherIndex++ )
+  {
+    PooledConnection* entry = &(pooledConnectionsList[ otherIndex ]);
+    if( entry->isIdle && IsPoolDestination( entry, releasedEntry->connectionType, releasedEntry->host, releasedEntry->port ) ) 
+      idleConnectionsCount++;
+  }
+  
+  if( isHealthy && idleConnectionsCount < poolSettings.maxIdleConnections )
+  {
+    releasedEntry->isIdle = true;
+    releasedEntry->idleTime = System_GetTimeMilliseconds();
+    ThreadLock_Release( lock );
+    return;
+  }
+  
+  RemovePooledConnection( entryIndex );
+  ThreadLock_Release( lock );
+  
+  AsyncIP_CloseConnection( connectionID );
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                           ENDING                                                /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Handle socket closing and structures destruction for the given index corresponding connection
+static void DiscardConnection( unsigned long connectionID )
+{
+  ForgetPooledConnection( connectionID );
+  
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return;
+  
+  connection = WaitBaseConnection( connectionID, connection );
+  if( connection == NULL ) return;
+  
+  // Orderly closing would keep the kernel sending from zero-copy buffers after they are given back to their owners
+  // (datagrams leave the socket when sent, so that only stream connections are reset)
+  if( HasReferencedBuffers( connection ) ) (void) IP_SetAbortiveClose( connection->baseConnection );
+  
+  IP_CloseConnection( connection->baseConnection );
+  connection->baseConnection = NULL;
+  
+  TSQ_Discard( connection->readQueue );
+  DiscardWriteQueues( connection );
+  DiscardTransfers( connectionID, connection );
+  free( connection->reconnection );
+  connection->reconnection = NULL;
+  ReleaseMemory( connection, connection->memoryLength );
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  TSM_RemoveItem( globalConnectionsList, connectionID );
+}
+
+// Waits for reading and writing threads to exit and discards the connections list
+static void* StopNetwork( void* args )
+{
+  (void) Thread_WaitExit( globalReadThread, 5000 );   
+  (void) Thread_WaitExit( globalWriteThread, 5000 );
+  
+  TSM_Discard( globalConnectionsList );
+  globalConnectionsList = NULL;
+  
+  return NULL;
+}
+
+// Stops the network after its last connection is closed. Closings requested from reading or writing threads 
+// (e.g. by message handlers or finished drains) leave the waiting for their exit to a separate thread
+static void StopNetworkIfIdle( void )
+{
+  if( globalConnectionsList == NULL || !isNetworkRunning ) return;
+  if( TSM_GetItemsCount( globalConnectionsList ) > 0 ) return;
+  
+  isNetworkRunning = false;
+  
+  if( isNetworkThread ) (void) Thread_Start( StopNetwork, NULL, THREAD_DETACHED );
+  else (void) StopNetwork( NULL );
+}
+
+void AsyncIP_CloseConnection( unsigned long connectionID )
+{
+  if( globalConnectionsList == NULL ) return;
+  
+  DiscardConnection( connectionID );
+  
+  StopNetworkIfIdle();
+  
+  return;
+}
+
+bool AsyncIP_DrainConnection( unsigned long connectionID, unsigned int timeout )
+{
+  AsyncIPConnection connection = TSM_AcquireItem( globalConnectionsList, connectionID );
+  if( connection == NULL ) return false;
+  
+  bool isStarted = false;
+  if( IP_IsServer( connection->baseConnection ) )
+    IP_REPORT_ERROR( "connection index %lu is not of a client connection", connectionID );
+  else if( connection->closingState == CONNECTION_OPEN )
+  {
+    connection->closingDeadline = System_GetTimeMilliseconds() + timeout;
+    connection->closingState = CONNECTION_FLUSHING;
+    isStarted = true;
+  }
+  
+  TSM_ReleaseItem( globalConnectionsList, connectionID );
+  
+  if( isStarted ) ATOMIC_FETCH_ADD( &writeRequestsCount, 1 );
+  
+  return isStarted;
 }
@@ -30,9 +30,64 @@
 #define ASYNC_IP_NETWORK_H
 
 #include "ip_network.h"
+#include "ip_dispatch.h"
 
 #define IP_CONNECTION_INVALID_ID -1      ///< Connection identifier to be returned on initialization errors
 
+/// Connection state changes notified to the application
+enum AsyncIPEvent 
+{ 
+  ASYNC_IP_DISCONNECTED,          ///< Connection lost, being reconnected (writes are held)
+  ASYNC_IP_RECONNECTED,           ///< Connection restored, held writes are sent
+  ASYNC_IP_RECONNECTION_FAILED,   ///< Maximum number of reconnection attempts reached, connection is no longer available
+  ASYNC_IP_CLOSED,                ///< Graceful closing finished, remaining read messages are available until the handler returns
+  ASYNC_IP_FILE_SENT,             ///< Oldest file transfer started with AsyncIP_SendFile() finished
+  ASYNC_IP_FILE_FAILED            ///< Oldest file transfer started with AsyncIP_SendFile() could not be finished (remaining ones continue)
+};
+
+/// Write queue lanes of connections, drained in order (messages of a lane are only sent while higher ones are empty)
+enum AsyncIPPriority
+{
+  ASYNC_IP_PRIORITY_CONTROL,      ///< Urgent (e.g. stop) commands, sent right away even on coalescing connections
+  ASYNC_IP_PRIORITY_NORMAL,       ///< Default lane of connections
+  ASYNC_IP_PRIORITY_BULK,         ///< Bulk data, sent when there is nothing else to be sent
+  ASYNC_IP_PRIORITIES_NUMBER
+};
+
+/// Handler of connection events, called from the writing thread
+typedef void (*AsyncIPEventHandler)( unsigned long connectionID, enum AsyncIPEvent event, void* userData );
+
+/// Handler of buffers written with AsyncIP_WriteBuffer(), called from the writing thread once the buffer is not used anymore (without using the connection)
+typedef void (*AsyncIPBufferReleaser)( unsigned long connectionID, const void* buffer, bool isSent, void* userData );
+
+/// Automatic reconnection of client connections (see AsyncIP_SetReconnection())
+typedef struct _AsyncIPReconnectionSettings
+{
+  unsigned int minDelay;                                ///< Maximum delay (in milliseconds) before the second attempt, doubled on each failure
+  unsigned int maxDelay;                                ///< Upper limit (in milliseconds) of delay between attempts
+  unsigned int maxAttempts;                             ///< Number of failed attempts before giving up (0 for no limit)
+}
+AsyncIPReconnectionSettings;
+
+/// Limits and checks of client connections reused through the pool (see AsyncIP_AcquirePooledClient())
+typedef struct _AsyncIPPoolSettings
+{
+  size_t maxConnections;                                ///< Maximum number of connections (idle or in use) per destination (0 for no limit)
+  size_t maxIdleConnections;                            ///< Maximum number of idle connections kept per destination
+  unsigned int idleTimeout;                             ///< Time (in milliseconds) after which idle connections are closed (0 for no expiration)
+  bool (*ref_CheckHealth)( unsigned long connectionID ); ///< Application check of idle connections before reuse (NULL for socket state only)
+}
+AsyncIPPoolSettings;
+
+/// Global limits beyond which new connections and queued data are refused (see AsyncIP_SetAdmissionSettings())
+typedef struct _AsyncIPAdmissionSettings
+{
+  size_t maxConnections;                                ///< Maximum number of connections (servers, clients and accepted clients) (0 for no limit)
+  size_t maxQueuedBytes;                                ///< Maximum length of messages and buffers waiting to be sent on all connections (0 for no limit)
+  size_t maxMemoryBytes;                                ///< Memory budget of queues and buffers allocated for all connections (0 for no limit)
+}
+AsyncIPAdmissionSettings;
+
 
 /// @brief Creates a new IP connection structure (with defined properties) and add it to the asynchronous connections list                              
 /// @param[in] connectionType flag defining connection as client or server, TCP or UDP (see ip_connection.h)                                   
@@ -44,6 +99,13 @@ unsigned long AsyncIP_OpenConnection( uint8_t connectionType, const char* host,
 /// @brief Handle termination of connection corresponding to given identifier                             
 /// @param[in] connectionID connection identifier
 void AsyncIP_CloseConnection( unsigned long connectionID );
+
+/// @brief Starts graceful termination of client connection corresponding to given identifier: new writes are rejected, queued ones are sent, 
+/// sending side is shut down and incoming messages are still read until the remote side closes, before resources are released (ASYNC_IP_CLOSED event)
+/// @param[in] connectionID client connection identifier
+/// @param[in] timeout maximum time (in milliseconds) for the whole process, after which connection is closed anyway
+/// @return true if closing was started, false on error
+bool AsyncIP_DrainConnection( unsigned long connectionID, unsigned int timeout );
                                                                             
 /// @brief Returns address string (host and port) for the connection of given identifier                                                
 /// @param[in] connectionID connection identifier                                         
@@ -58,6 +120,19 @@ size_t AsyncIP_GetActivesNumber( void );
 /// @param[in] serverID server connection identifier                                         
 /// @return number of clients (1 for client connection and 0 on error)  
 size_t AsyncIP_GetClientsNumber( unsigned long serverID );
+
+/// @brief Returns memory charged to connection of given identifier (its data, queues and buffers allocated by the library)
+/// @param[in] connectionID connection identifier
+/// @return length (in bytes) of charged memory (0 on error)
+size_t AsyncIP_GetMemoryUsage( unsigned long connectionID );
+
+/// @brief Returns memory charged to all connections, compared to the budget of AsyncIP_SetAdmissionSettings()
+/// @return length (in bytes) of charged memory
+uint64_t AsyncIP_GetTotalMemoryUsage( void );
+
+/// @brief Returns the longest pass of the reading or writing threads over all connections since the previous call (event loop stall indicator)
+/// @return duration (in nanoseconds) of the longest pass
+uint64_t AsyncIP_GetMaxLoopTime( void );
                                                                           
 /// @brief Defines fixed message length for connection of given identifier                                                
 /// @param[in] connectionID connection identifier                                
@@ -65,17 +140,170 @@ size_t AsyncIP_GetClientsNumber( unsigned long serverID );
 /// @return actual new length of connection messages 
 size_t AsyncIP_SetMessageLength( unsigned long connectionID, size_t messageLength );
 
+/// @brief Sets stream filter (e.g. TLS) of TCP connection corresponding to given identifier (see IP_SetStreamFilter())
+/// @param[in] connectionID connection identifier
+/// @param[in] filter stream filter methods and settings (copied)
+/// @return true on success, false on error
+bool AsyncIP_SetStreamFilter( unsigned long connectionID, const IPStreamFilter* filter );
+
+/// @brief Sets dispatch table for typed messages received by connection of given identifier (inherited by clients accepted afterwards, for servers)
+/// @param[in] connectionID connection identifier
+/// @param[in] table dispatch table reference, whose handlers are called from the reading thread (NULL to queue all messages)
+/// @return true on success, false on error
+bool AsyncIP_SetDispatchTable( unsigned long connectionID, IPDispatchTable table );
+
+/// @brief Sets handler of state change events of connection corresponding to given identifier
+/// @param[in] connectionID connection identifier
+/// @param[in] handler function called on connection events (NULL for none)
+/// @param[in] userData pointer passed to the handler
+/// @return true on success, false on error
+bool AsyncIP_SetEventHandler( unsigned long connectionID, AsyncIPEventHandler handler, void* userData );
+
+/// @brief Enables automatic reconnection, with exponential backoff and jitter, of stream client connection corresponding to given identifier
+/// @param[in] connectionID client connection identifier
+/// @param[in] settings reconnection delays and attempts (copied, NULL to disable)
+/// @return true on success, false on error
+bool AsyncIP_SetReconnection( unsigned long connectionID, const AsyncIPReconnectionSettings* settings );
+
 /// @brief Pops first (oldest) queued message from read queue of client connection corresponding to given identifier                      
 /// @param[in] clientID client connection identifier  
 /// @return pointer to message string, overwritten on next call to ReadMessage() (NULL on error or no message available)  
 char* AsyncIP_ReadMessage( unsigned long clientID );
+
+/// @brief Pops first (oldest) queued message from read queue of client connection corresponding to given identifier, with the time it was received by the kernel
+/// @param[in] clientID client connection identifier
+/// @param[out] ref_receiveTime pointer to wall clock time (in nanoseconds since the Unix epoch) of message arrival on the socket (0 if not available)
+/// @return pointer to message string, overwritten on next call to ReadMessage() (NULL on error or no message available)
+char* AsyncIP_ReadTimestampedMessage( unsigned long clientID, uint64_t* ref_receiveTime );
+
+/// @brief Enables kernel timestamping of messages received by connection corresponding to given identifier (SO_TIMESTAMPNS, where supported)
+/// @param[in] connectionID connection identifier (settings of servers are applied to clients accepted from then on)
+/// @param[in] isEnabled true to timestamp received messages, false to stop timestamping them
+/// @return true on success, false on error or where unsupported
+bool AsyncIP_SetReceiveTimestamps( unsigned long connectionID, bool isEnabled );
                                                                            
+/// @brief Enables bulk receiving mode of TCP client connection corresponding to given identifier, in which data is not queued by the reading thread, but received with AsyncIP_ReceiveBulk()
+/// @param[in] connectionID client connection identifier
+/// @param[in] windowLength maximum length (in bytes, rounded up to whole pages) of data received at once (0 to return to message queueing)
+/// @return true on success, false on error
+bool AsyncIP_SetBulkReceive( unsigned long connectionID, size_t windowLength );
+
+/// @brief Waits for and receives available stream data of bulk receiving connection corresponding to given identifier, mapping received pages to memory without copies where possible
+/// @param[in] connectionID client connection identifier
+/// @param[out] ref_length pointer to number of bytes received (0 on error, remote closing or timeout)
+/// @param[in] timeout maximum time (in milliseconds) waiting for data
+/// @return pointer to read-only received data, valid until the next call for the same connection (NULL on error, remote closing or timeout)
+const void* AsyncIP_ReceiveBulk( unsigned long connectionID, size_t* ref_length, unsigned int timeout );
+
 /// @brief Pushes given message string to write queue of connection corresponding to given identifier                                                
 /// @param[in] connectionID connection identifier   
 /// @param[in] message message string pointer  
 /// @return true on success, false on error  
 bool AsyncIP_WriteMessage( unsigned long connectionID, const char* message );
+
+/// @brief Enables coalescing of messages written to client connection corresponding to given identifier, sent through a corked socket, 
+/// which holds partial segments until flushed (or for 100 ms at most)
+/// @param[in] connectionID client connection identifier
+/// @param[in] isEnabled true to hold partial segments until AsyncIP_Flush(), false to send each message as soon as possible
+/// @return true on success, false on error
+bool AsyncIP_SetCoalescing( unsigned long connectionID, bool isEnabled );
+
+/// @brief Pushes given message string to the write queue lane of given priority of connection corresponding to given identifier
+/// @param[in] connectionID connection identifier
+/// @param[in] message message string pointer
+/// @param[in] priority write queue lane of the message
+/// @return true on success, false on error
+bool AsyncIP_WritePriorityMessage( unsigned long connectionID, const char* message, enum AsyncIPPriority priority );
+
+/// @brief Defines priority of messages written without explicit one to connection corresponding to given identifier, and marks its socket 
+/// with matching differentiated services code point and queueing priority (SO_PRIORITY, on Linux)
+/// @param[in] connectionID connection identifier (settings of servers are applied to clients accepted from then on)
+/// @param[in] priority default write queue lane and traffic class of the connection
+/// @return true on success, false on error (including clients accepted by UDP servers, marked as their server)
+bool AsyncIP_SetPriority( unsigned long connectionID, enum AsyncIPPriority priority );
+
+/// @brief Enables sending of queued messages as trains of datagrams, and receiving of coalesced ones, for UDP connection corresponding to given identifier (Linux only)
+/// @param[in] connectionID UDP server (also applied to clients accepted from then on) or client connection identifier
+/// @param[in] isEnabled true to send and receive trains (split back into queued messages), false to return to one datagram per call
+/// @return true on success, false on error or where unsupported
+bool AsyncIP_SetSegmentationOffload( unsigned long connectionID, bool isEnabled );
+
+/// @brief Defines share of the writing thread taken by connection corresponding to given identifier, relative to other ones with data waiting to be sent
+/// @param[in] connectionID connection identifier (settings of servers are applied to clients accepted from then on)
+/// @param[in] weight number of bytes sent per writing thread pass, in units of 8 KB (queued messages count as IP_MAX_MESSAGE_LENGTH bytes), default 1
+/// @return true on success, false on error
+bool AsyncIP_SetWriteWeight( unsigned long connectionID, unsigned int weight );
+
+/// @brief Limits sending rate of connection corresponding to given identifier with a token bucket (allowing bursts of 10 ms), 
+/// also applied to its socket for kernel pacing (SO_MAX_PACING_RATE, on Linux), and changeable at any time
+/// @param[in] connectionID connection identifier (settings of servers are applied to clients accepted from then on)
+/// @param[in] bytesPerSecond maximum sending rate (queued messages count as IP_MAX_MESSAGE_LENGTH bytes), or 0 to remove the limit
+/// @return true on success, false on error (including clients accepted by UDP servers, paced as their server)
+bool AsyncIP_SetPacingRate( unsigned long connectionID, uint64_t bytesPerSecond );
+
+/// @brief Sends partial segment of coalesced messages currently held by connection corresponding to given identifier, without waiting for more
+/// @param[in] connectionID connection identifier
+/// @return true on success, false on error
+bool AsyncIP_Flush( unsigned long connectionID );
+
+/// @brief Limits number of clients of server connection corresponding to given identifier, beyond which new ones are refused before being accepted
+/// @param[in] serverID server connection identifier
+/// @param[in] maxClientsNumber maximum number of clients (0 for no limit)
+/// @return true on success, false on error
+bool AsyncIP_SetMaxClients( unsigned long serverID, size_t maxClientsNumber );
+
+/// @brief Defines global limits of connections, queued data and memory. Servers refuse new clients while any is reached, and writes are shed 
+/// by priority above the queued bytes limit (bulk data from half of it, normal from the limit, control messages never). Queues that would
+/// exceed the memory budget are not created, refusing the writes (or settings) that need them
+/// @param[in] settings admission settings (copied)
+void AsyncIP_SetAdmissionSettings( const AsyncIPAdmissionSettings* settings );
+
+/// @brief Queues transfer of file data through stream client connection corresponding to given identifier, sent by the kernel (without user space copies) in chunks interleaved with messages
+/// @param[in] connectionID client connection identifier
+/// @param[in] fileDescriptor descriptor of file (or pipe) to be read, kept open by the caller until the transfer finishes
+/// @param[in] offset position (in bytes) of data to be sent in the file (ignored for pipes)
+/// @param[in] length number of bytes to be sent
+/// @return true on success (completion is notified with ASYNC_IP_FILE_SENT or ASYNC_IP_FILE_FAILED events, in transfer order), false on error
+bool AsyncIP_SendFile( unsigned long connectionID, int fileDescriptor, uint64_t offset, size_t length );
+
+/// @brief Enables sending of large buffers written to TCP or UDP client connection corresponding to given identifier without copies (MSG_ZEROCOPY)
+/// @param[in] connectionID client connection identifier
+/// @param[in] minLength minimum length (in bytes) of buffers sent without copies, as small ones are copied faster (0 to disable)
+/// @return true on success, false on error or where unsupported
+bool AsyncIP_SetZeroCopy( unsigned long connectionID, size_t minLength );
+
+/// @brief Queues caller buffer to be sent through TCP (as stream data) or UDP (as a single datagram) client connection corresponding to given identifier
+/// @param[in] connectionID client connection identifier
+/// @param[in] buffer pointer to data, which should not be changed or freed until released
+/// @param[in] length number of bytes to be sent
+/// @param[in] releaser function called when the buffer is sent (and not referenced by the kernel anymore) or dropped (NULL for none)
+/// @param[in] userData pointer passed to the releaser
+/// @return true on success, false on error
+bool AsyncIP_WriteBuffer( unsigned long connectionID, const void* buffer, size_t length, AsyncIPBufferReleaser releaser, void* userData );
+
+/// @brief Pushes typed message (header and given payload) to write queue of connection corresponding to given identifier
+/// @param[in] connectionID connection identifier
+/// @param[in] typeID message type identifier
+/// @param[in] payload pointer to payload data
+/// @param[in] payloadLength length (in bytes) of the payload, which should fit the connection message length along with the header
+/// @return true on success, false on error
+bool AsyncIP_WriteTypedMessage( unsigned long connectionID, uint8_t typeID, const void* payload, size_t payloadLength );
                                                                             
+/// @brief Defines limits and checks of pooled client connections
+/// @param[in] settings pool settings (copied)
+void AsyncIP_SetPoolSettings( const AsyncIPPoolSettings* settings );
+
+/// @brief Hands out idle (healthy) client connection to the given destination, or opens a new one if none is available
+/// @param[in] connectionType flag defining client transport (server role is not allowed)
+/// @param[in] host remote host string
+/// @param[in] port remote port number
+/// @return client connection identifier, to be returned with AsyncIP_ReleasePooledClient() (IP_CONNECTION_INVALID_ID on error or limit reached)
+unsigned long AsyncIP_AcquirePooledClient( uint8_t connectionType, const char* host, uint16_t port );
+
+/// @brief Returns pooled client connection, kept idle for reuse if healthy and within limits (closed otherwise)
+/// @param[in] connectionID client connection identifier, given by AsyncIP_AcquirePooledClient()
+void AsyncIP_ReleasePooledClient( unsigned long connectionID );
+
 /// @brief Pops first (oldest) queued client identifier from read queue of server connection corresponding to given identifier                                                
 /// @param[in] serverID server connection identifier        
 /// @return client connection identifier (IP_CONNECTION_INVALID_ID on error or no client available)  
@@ -0,0 +1,343 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+/////  Connection-scale soak benchmark: opens many concurrent TCP and UDP       /////
+/////  clients against local asynchronous servers, keeps a fraction of them    /////
+/////  active and samples memory, CPU and latency figures over time            /////
+/////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "async_ip_network.h"
+
+#define ACCEPT_TIMEOUT_MS 5000            // Maximum waiting time for a single client to be accepted
+
+typedef struct _BenchmarkConfig
+{
+  uint16_t port;                          // TCP server port (UDP server uses the next one)
+  size_t tcpClientsNumber;
+  size_t udpClientsNumber;
+  double activeFraction;                  // Fraction of clients sending one message per round
+  unsigned int durationSeconds;           // Steady state phase duration
+  unsigned int rampStep;                  // Number of opened clients between ramp samples
+}
+BenchmarkConfig;
+
+// Connections of a single transport (clients and their accepted server side counterparts)
+typedef struct _ClientsGroup
+{
+  const char* name;
+  unsigned long serverID;
+  unsigned long* clientIDsList;
+  unsigned long* acceptedIDsList;
+  double* openTimesList;
+  size_t openedNumber;
+  size_t acceptedNumber;
+  double acceptLatencySum;
+  double acceptLatencyMax;
+}
+ClientsGroup;
+
+
+static double GetTimeMilliseconds( void )
+{
+  struct timespec timeStamp;
+  clock_gettime( CLOCK_MONOTONIC, &timeStamp );
+  return timeStamp.tv_sec * 1000.0 + timeStamp.tv_nsec / 1000000.0;
+}
+
+static double GetProcessCPUMilliseconds( void )
+{
+  struct rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+  return ( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 1000.0 + ( usage.ru_utime.tv_usec + usage.ru_stime.tv_usec ) / 1000.0;
+}
+
+// Resident set size (in bytes) read from proc filesystem
+static size_t GetResidentMemory( void )
+{
+  unsigned long totalPages = 0, residentPages = 0;
+
+  FILE* statusFile = fopen( "/proc/self/statm", "r" );
+  if( statusFile == NULL ) return 0;
+  if( fscanf( statusFile, "%lu %lu", &totalPages, &residentPages ) != 2 ) residentPages = 0;
+  fclose( statusFile );
+
+  return (size_t) residentPages * (size_t) sysconf( _SC_PAGESIZE );
+}
+
+// Each client connection takes one file descriptor on both ends (TCP) or on the client end (UDP)
+static void RaiseDescriptorsLimit( void )
+{
+  struct rlimit descriptorsLimit;
+  if( getrlimit( RLIMIT_NOFILE, &descriptorsLimit ) != 0 ) return;
+  descriptorsLimit.rlim_cur = descriptorsLimit.rlim_max;
+  if( setrlimit( RLIMIT_NOFILE, &descriptorsLimit ) != 0 ) fprintf( stderr, "setrlimit: could not raise file descriptors limit\n" );
+}
+
+// Pops every client identifier available on the server read queue, measuring accept latency in FIFO order
+static void CollectAcceptedClients( ClientsGroup* group )
+{
+  unsigned long clientID;
+  while( (clientID = AsyncIP_GetClient( group->serverID )) != (unsigned long) IP_CONNECTION_INVALID_ID )
+  {
+    if( group->acceptedNumber >= group->openedNumber ) continue;
+
+    double acceptLatency = GetTimeMilliseconds() - group->openTimesList[ group->acceptedNumber ];
+    group->acceptLatencySum += acceptLatency;
+    if( acceptLatency > group->acceptLatencyMax ) group->acceptLatencyMax = acceptLatency;
+
+    group->acceptedIDsList[ group->acceptedNumber++ ] = clientID;
+  }
+}
+
+static bool OpenClient( ClientsGroup* group, uint8_t transportType, uint16_t port )
+{
+  group->openTimesList[ group->openedNumber ] = GetTimeMilliseconds();
+
+  unsigned long clientID = AsyncIP_OpenConnection( IP_CLIENT | transportType, "127.0.0.1", port );
+  if( clientID == (unsigned long) IP_CONNECTION_INVALID_ID ) return false;
+
+  // UDP clients are only accepted after their first datagram arrives
+  if( transportType == IP_UDP ) AsyncIP_WriteMessage( clientID, "hello" );
+
+  group->clientIDsList[ group->openedNumber++ ] = clientID;
+
+  return true;
+}
+
+static void PrintRampSample( ClientsGroup* group, size_t totalConnections, size_t baseMemory, double startTime )
+{
+  size_t residentMemory = GetResidentMemory();
+  if( residentMemory < baseMemory ) residentMemory = baseMemory;
+  double memoryPerConnection = ( totalConnections > 0 ) ? (double) ( residentMemory - baseMemory ) / totalConnections : 0.0;
+  double meanAcceptLatency = ( group->acceptedNumber > 0 ) ? group->acceptLatencySum / group->acceptedNumber : 0.0;
+
+  printf( "ramp,%.0f,%s,%zu,%zu,%zu,%.1f,%.3f,%.3f\n", GetTimeMilliseconds() - startTime, group->name, group->openedNumber, group->acceptedNumber,
+                                                       residentMemory, memoryPerConnection, meanAcceptLatency, group->acceptLatencyMax );
+  fflush( stdout );
+}
+
+static void RampClients( ClientsGroup* group, uint8_t transportType, uint16_t port, size_t clientsNumber,
+                         const BenchmarkConfig* config, size_t* ref_totalConnections, size_t baseMemory, double startTime )
+{
+  while( group->openedNumber < clientsNumber )
+  {
+    if( !OpenClient( group, transportType, port ) )
+    {
+      fprintf( stderr, "%s client %zu: failed to connect, stopping ramp\n", group->name, group->openedNumber );
+      break;
+    }
+
+    CollectAcceptedClients( group );
+
+    if( group->openedNumber % config->rampStep == 0 ) PrintRampSample( group, *ref_totalConnections + group->acceptedNumber, baseMemory, startTime );
+  }
+
+  // Wait for the remaining accepts, bounded by the timeout of the last opened client
+  double waitStartTime = GetTimeMilliseconds();
+  while( group->acceptedNumber < group->openedNumber && GetTimeMilliseconds() - waitStartTime < ACCEPT_TIMEOUT_MS )
+  {
+    CollectAcceptedClients( group );
+    usleep( 1000 );
+  }
+
+  *ref_totalConnections += group->acceptedNumber;
+  PrintRampSample( group, *ref_totalConnections, baseMemory, startTime );
+}
+
+// Reads every message available on the server side of the given group, flagging probe message arrival
+static size_t DrainServerMessages( ClientsGroup* group, bool* ref_isProbeReceived )
+{
+  size_t messagesNumber = 0;
+
+  for( size_t clientIndex = 0; clientIndex < group->acceptedNumber; clientIndex++ )
+  {
+    char* message;
+    while( (message = AsyncIP_ReadMessage( group->acceptedIDsList[ clientIndex ] )) != NULL )
+    {
+      if( strcmp( message, "probe" ) == 0 ) *ref_isProbeReceived = true;
+      messagesNumber++;
+    }
+  }
+
+  return messagesNumber;
+}
+
+static void WriteActiveMessages( ClientsGroup* group, double activeFraction, unsigned long round )
+{
+  char message[ IP_MAX_MESSAGE_LENGTH ];
+  size_t activesNumber = (size_t) ( activeFraction * group->openedNumber );
+
+  for( size_t clientIndex = 0; clientIndex < activesNumber; clientIndex++ )
+  {
+    snprintf( message, IP_MAX_MESSAGE_LENGTH, "%s %zu %lu", group->name, clientIndex, round );
+    AsyncIP_WriteMessage( group->clientIDsList[ clientIndex ], message );
+  }
+}
+
+// Steady state: active clients write one message per round while the server side is drained continuously.
+// Delivery latency is measured with a probe message and includes one write and one read loop iteration,
+// while stalls of the event loop itself show up as its longest pass over all connections during the round
+static void RunSteadyState( ClientsGroup* groupsList, size_t groupsNumber, const BenchmarkConfig* config, size_t totalConnections, size_t baseMemory, double startTime )
+{
+  const double ROUND_INTERVAL_MS = 1000.0;
+
+  double endTime = GetTimeMilliseconds() + config->durationSeconds * 1000.0;
+  unsigned long round = 0;
+
+  while( GetTimeMilliseconds() < endTime )
+  {
+    double roundStartTime = GetTimeMilliseconds();
+    double roundStartCPUTime = GetProcessCPUMilliseconds();
+    (void) AsyncIP_GetMaxLoopTime();
+
+    for( size_t groupIndex = 0; groupIndex < groupsNumber; groupIndex++ )
+      WriteActiveMessages( &(groupsList[ groupIndex ]), config->activeFraction, round );
+
+    // Probe with the first TCP connection, if any
+    ClientsGroup* probeGroup = &(groupsList[ 0 ]);
+    double probeLatency = -1.0;
+    bool isProbeActive = ( probeGroup->acceptedNumber > 0 && AsyncIP_WriteMessage( probeGroup->clientIDsList[ 0 ], "probe" ) );
+    double probeStartTime = GetTimeMilliseconds();
+
+    size_t messagesNumber = 0;
+    while( GetTimeMilliseconds() - roundStartTime < ROUND_INTERVAL_MS )
+    {
+      bool isProbeReceived = false;
+      for( size_t groupIndex = 0; groupIndex < groupsNumber; groupIndex++ )
+        messagesNumber += DrainServerMessages( &(groupsList[ groupIndex ]), &isProbeReceived );
+
+      if( isProbeActive && isProbeReceived && probeLatency < 0.0 ) probeLatency = GetTimeMilliseconds() - probeStartTime;
+
+      usleep( 1000 );
+    }
+
+    double roundCPUTime = GetProcessCPUMilliseconds() - roundStartCPUTime;
+    double cpuPerMessage = ( messagesNumber > 0 ) ? roundCPUTime * 1000.0 / messagesNumber : 0.0;
+    size_t residentMemory = GetResidentMemory();
+    if( residentMemory < baseMemory ) residentMemory = baseMemory;
+
+    double maxLoopTime = AsyncIP_GetMaxLoopTime() / 1000000.0;
+
+    printf( "steady,%.0f,%lu,%zu,%zu,%.1f,%.3f,%.3f,%.3f,%.3f\n", GetTimeMilliseconds() - startTime, round, totalConnections, messagesNumber,
+                                                                (double) ( residentMemory - baseMemory ) / ( totalConnections > 0 ? totalConnections : 1 ),
+                                                                roundCPUTime, cpuPerMessage, probeLatency, maxLoopTime );
+    fflush( stdout );
+
+    round++;
+  }
+}
+
+static void PrintUsage( const char* programName )
+{
+  fprintf( stderr, "usage: %s [-p port] [-t tcp_clients] [-u udp_clients] [-a active_fraction] [-d duration_s] [-s ramp_step]\n", programName );
+}
+
+int main( int argc, char* argv[] )
+{
+  BenchmarkConfig config = { .port = 50000, .tcpClientsNumber = 10000, .udpClientsNumber = 10000,
+                             .activeFraction = 0.1, .durationSeconds = 60, .rampStep = 1000 };
+
+  int option;
+  while( (option = getopt( argc, argv, "p:t:u:a:d:s:h" )) != -1 )
+  {
+    switch( option )
+    {
+      case 'p': config.port = (uint16_t) strtoul( optarg, NULL, 0 ); break;
+      case 't': config.tcpClientsNumber = strtoul( optarg, NULL, 0 ); break;
+      case 'u': config.udpClientsNumber = strtoul( optarg, NULL, 0 ); break;
+      case 'a': config.activeFraction = strtod( optarg, NULL ); break;
+      case 'd': config.durationSeconds = (unsigned int) strtoul( optarg, NULL, 0 ); break;
+      case 's': config.rampStep = (unsigned int) strtoul( optarg, NULL, 0 ); break;
+      default: PrintUsage( argv[ 0 ] ); return ( option == 'h' ) ? 0 : 1;
+    }
+  }
+  if( config.rampStep == 0 ) config.rampStep = 1;
+  if( config.activeFraction < 0.0 ) config.activeFraction = 0.0;
+  else if( config.activeFraction > 1.0 ) config.activeFraction = 1.0;
+
+  RaiseDescriptorsLimit();
+
+  size_t baseMemory = GetResidentMemory();
+  double startTime = GetTimeMilliseconds();
+
+  ClientsGroup groupsList[ 2 ] = { { .name = "tcp" }, { .name = "udp" } };
+  size_t clientsNumbersList[ 2 ] = { config.tcpClientsNumber, config.udpClientsNumber };
+  uint8_t transportTypesList[ 2 ] = { IP_TCP, IP_UDP };
+
+  for( size_t groupIndex = 0; groupIndex < 2; groupIndex++ )
+  {
+    ClientsGroup* group = &(groupsList[ groupIndex ]);
+    uint16_t serverPort = config.port + groupIndex;
+    group->serverID = AsyncIP_OpenConnection( IP_SERVER | transportTypesList[ groupIndex ], NULL, serverPort );
+    if( group->serverID == (unsigned long) IP_CONNECTION_INVALID_ID )
+    {
+      fprintf( stderr, "failed to open %s server on port %u\n", group->name, serverPort );
+      return 1;
+    }
+
+    size_t clientsNumber = clientsNumbersList[ groupIndex ];
+    group->clientIDsList = (unsigned long*) calloc( clientsNumber + 1, sizeof(unsigned long) );
+    group->acceptedIDsList = (unsigned long*) calloc( clientsNumber + 1, sizeof(unsigned long) );
+    group->openTimesList = (double*) calloc( clientsNumber + 1, sizeof(double) );
+    if( group->clientIDsList == NULL || group->acceptedIDsList == NULL || group->openTimesList == NULL )
+    {
+      fprintf( stderr, "failed to allocate lists for %zu %s clients\n", clientsNumber, group->name );
+      return 1;
+    }
+  }
+
+  printf( "ramp,time_ms,transport,opened,accepted,rss_bytes,rss_per_connection,accept_latency_mean_ms,accept_latency_max_ms\n" );
+  size_t totalConnections = 0;
+  for( size_t groupIndex = 0; groupIndex < 2; groupIndex++ )
+    RampClients( &(groupsList[ groupIndex ]), transportTypesList[ groupIndex ], config.port + groupIndex, clientsNumbersList[ groupIndex ],
+                 &config, &totalConnections, baseMemory, startTime );
+
+  printf( "steady,time_ms,round,connections,messages,rss_per_connection,cpu_ms,cpu_us_per_message,probe_latency_ms,loop_max_ms\n" );
+  RunSteadyState( groupsList, 2, &config, totalConnections, baseMemory, startTime );
+
+  for( size_t groupIndex = 0; groupIndex < 2; groupIndex++ )
+  {
+    ClientsGroup* group = &(groupsList[ groupIndex ]);
+    for( size_t clientIndex = 0; clientIndex < group->acceptedNumber; clientIndex++ )
+      AsyncIP_CloseConnection( group->acceptedIDsList[ clientIndex ] );
+    for( size_t clientIndex = 0; clientIndex < group->openedNumber; clientIndex++ )
+      AsyncIP_CloseConnection( group->clientIDsList[ clientIndex ] );
+    AsyncIP_CloseConnection( group->serverID );
+
+    free( group->clientIDsList );
+    free( group->acceptedIDsList );
+    free( group->openTimesList );
+  }
+
+  return 0;
+}
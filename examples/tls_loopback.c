@@ -0,0 +1,122 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+/////  TLS loopback example: asynchronous server and client in the same        /////
+/////  process exchanging messages through the TLS stream filter, with a       /////
+/////  self-signed certificate for "localhost" created beforehand by:          /////
+/////                                                                          /////
+/////  openssl req -x509 -newkey rsa:2048 -nodes -days 365 -subj /CN=localhost /////
+/////          -addext subjectAltName=DNS:localhost -keyout key.pem            /////
+/////          -out cert.pem                                                   /////
+/////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "async_ip_network.h"
+#include "ip_tls.h"
+
+#define WAIT_STEPS_NUMBER 50              // Checks for accepted clients and received messages, before giving up
+#define WAIT_STEP_US 100000
+
+
+// Copies first message read from given connection (returned buffers are reused by later reads). Returns false if none arrived
+static bool WaitMessage( unsigned long connectionID, char* message )
+{
+  for( size_t stepIndex = 0; stepIndex < WAIT_STEPS_NUMBER; stepIndex++ )
+  {
+    usleep( WAIT_STEP_US );
+    char* lastMessage = AsyncIP_ReadMessage( connectionID );
+    if( lastMessage == NULL ) continue;
+    strncpy( message, lastMessage, IP_MAX_MESSAGE_LENGTH - 1 );
+    return true;
+  }
+  
+  return false;
+}
+
+int main( int argc, char* argv[] )
+{
+  const char* certificateFile = ( argc > 1 ) ? argv[ 1 ] : "cert.pem";
+  const char* keyFile = ( argc > 2 ) ? argv[ 2 ] : "key.pem";
+  uint16_t port = ( argc > 3 ) ? (uint16_t) strtoul( argv[ 3 ], NULL, 0 ) : 50000;
+  
+  // Self-signed certificate is its own trusted issuer
+  IPTLSContext serverContext = IPTLS_CreateContext( true, certificateFile, keyFile, NULL );
+  IPTLSContext clientContext = IPTLS_CreateContext( false, NULL, NULL, certificateFile );
+  if( serverContext == NULL || clientContext == NULL )
+  {
+    fprintf( stderr, "failed to load certificate %s and key %s\n", certificateFile, keyFile );
+    return 1;
+  }
+  IPStreamFilter serverFilter = IPTLS_GetFilter( serverContext );
+  IPStreamFilter clientFilter = IPTLS_GetFilter( clientContext );
+  
+  unsigned long serverID = AsyncIP_OpenConnection( IP_SERVER | IP_TCP, NULL, port );
+  if( serverID == (unsigned long) IP_CONNECTION_INVALID_ID || !AsyncIP_SetStreamFilter( serverID, &serverFilter ) )
+  {
+    fprintf( stderr, "failed to open TLS server on port %u\n", port );
+    return 1;
+  }
+  
+  // Certificate is verified against the host name given here
+  unsigned long clientID = AsyncIP_OpenConnection( IP_CLIENT | IP_TCP, "localhost", port );
+  if( clientID == (unsigned long) IP_CONNECTION_INVALID_ID || !AsyncIP_SetStreamFilter( clientID, &clientFilter ) )
+  {
+    fprintf( stderr, "failed to connect TLS client to localhost/%u\n", port );
+    return 1;
+  }
+  
+  unsigned long acceptedID = (unsigned long) IP_CONNECTION_INVALID_ID;
+  for( size_t stepIndex = 0; stepIndex < WAIT_STEPS_NUMBER && acceptedID == (unsigned long) IP_CONNECTION_INVALID_ID; stepIndex++ )
+  {
+    usleep( WAIT_STEP_US );
+    acceptedID = AsyncIP_GetClient( serverID );
+  }
+  
+  char message[ IP_MAX_MESSAGE_LENGTH ] = "ping";
+  char request[ IP_MAX_MESSAGE_LENGTH ] = "(none)", reply[ IP_MAX_MESSAGE_LENGTH ] = "(none)";
+  AsyncIP_WriteMessage( clientID, message );
+  if( acceptedID != (unsigned long) IP_CONNECTION_INVALID_ID && WaitMessage( acceptedID, request ) )
+  {
+    strcpy( message, "pong" );
+    AsyncIP_WriteMessage( acceptedID, message );
+    (void) WaitMessage( clientID, reply );
+  }
+  
+  bool isSuccess = ( strcmp( request, "ping" ) == 0 && strcmp( reply, "pong" ) == 0 );
+  printf( "request: %s, reply: %s, kernel offloaded connections: %lu\n", request, reply, 
+          (unsigned long) ( IPTLS_GetOffloadedNumber( serverContext ) + IPTLS_GetOffloadedNumber( clientContext ) ) );
+  
+  AsyncIP_CloseConnection( clientID );
+  if( acceptedID != (unsigned long) IP_CONNECTION_INVALID_ID ) AsyncIP_CloseConnection( acceptedID );
+  AsyncIP_CloseConnection( serverID );
+  
+  IPTLS_DiscardContext( serverContext );
+  IPTLS_DiscardContext( clientContext );
+  
+  return isSuccess ? 0 : 1;
+}
@@ -0,0 +1,536 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+  #include <winsock2.h>
+  #define poll WSAPoll
+  #define IS_WOULD_BLOCK_ERROR() ( WSAGetLastError() == WSAEWOULDBLOCK )
+#else
+  #include <errno.h>
+  #include <poll.h>
+  #include <fcntl.h>
+  #include <sys/socket.h>
+  #define IS_WOULD_BLOCK_ERROR() ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+#endif
+
+#ifdef IP_NETWORK_COMPRESSION_ZSTD
+  #include <zstd.h>
+#endif
+#ifdef IP_NETWORK_COMPRESSION_LZ4
+  #include <lz4.h>
+#endif
+
+#include "ip_compression.h"
+#include "ip_error.h"
+#include "ip_system.h"
+
+
+#define FRAME_HEADER_LENGTH 2             // Big-endian: compressed flag bit and 15 bits of payload length
+#define FRAME_COMPRESSED_FLAG 0x80
+#define HELLO_LENGTH 8                    // Magic string, algorithm and big-endian dictionary identifier
+#define FRAME_TIMEOUT_MS 1000             // Maximum wait for socket send space while writing a frame
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                      DATA STRUCTURES                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct _IPCompressionContextData
+{
+  enum IPCompressionAlgorithm algorithm;
+  int level;
+  size_t threshold;
+  char* dictionary;
+  size_t dictionaryLength;
+  uint32_t dictionaryID;
+  IPStreamFilter transportFilter;
+  #ifdef IP_NETWORK_COMPRESSION_ZSTD
+  ZSTD_CDict* zstdCompressionDictionary;
+  ZSTD_DDict* zstdDecompressionDictionary;
+  #endif
+  #ifdef IP_NETWORK_COMPRESSION_LZ4
+  LZ4_stream_t* lz4Dictionary;
+  #endif
+  size_t messageBytes;
+  size_t transmittedBytes;
+};
+
+// Per connection state. Sending and receiving happen on different threads, so they do not share buffers or codecs
+typedef struct _CompressionState
+{
+  IPCompressionContext context;
+  intptr_t socketFD;
+  void* transportState;
+  volatile bool isCompressionEnabled;     // Set by the receiving side, once the remote configuration arrives
+  bool isHelloReceived;
+  uint64_t helloDeadline;
+  #ifdef IP_NETWORK_COMPRESSION_ZSTD
+  ZSTD_CCtx* zstdCompressor;
+  ZSTD_DCtx* zstdDecompressor;
+  #endif
+  #ifdef IP_NETWORK_COMPRESSION_LZ4
+  LZ4_stream_t* lz4Stream;
+  #endif
+  char sendBuffer[ FRAME_HEADER_LENGTH + IP_MAX_MESSAGE_LENGTH ];
+  char receiveBuffer[ FRAME_HEADER_LENGTH + IP_MAX_MESSAGE_LENGTH ];   // Partially received hello or frame
+  size_t receivedLength;
+}
+CompressionState;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                        CONFIGURATION                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Announced configuration: magic string, algorithm and dictionary identifier
+static void GetHello( IPCompressionContext context, char* hello )
+{
+  uint32_t dictionaryID = context->dictionaryID;
+  char localHello[ HELLO_LENGTH ] = { 'I', 'P', 'Z', (char) context->algorithm, 
+                                      (char) ( dictionaryID >> 24 ), (char) ( dictionaryID >> 16 ), (char) ( dictionaryID >> 8 ), (char) dictionaryID };
+  memcpy( hello, localHello, HELLO_LENGTH );
+}
+
+// FNV-1a hash, identifying the dictionary on configuration exchange
+static uint32_t GetDictionaryID( const char* dictionary, size_t dictionaryLength )
+{
+  uint32_t hash = 2166136261u;
+  for( size_t byteIndex = 0; byteIndex < dictionaryLength; byteIndex++ )
+    hash = ( hash ^ (uint8_t) dictionary[ byteIndex ] ) * 16777619u;
+  
+  return ( dictionaryLength > 0 ) ? hash : 0;
+}
+
+IPCompressionContext IPCompression_CreateContext( enum IPCompressionAlgorithm algorithm, int level, size_t threshold, 
+                                                  const void* dictionary, size_t dictionaryLength, const IPStreamFilter* transportFilter )
+{
+  bool isAvailable = false;
+  #ifdef IP_NETWORK_COMPRESSION_ZSTD
+  if( algorithm == IP_COMPRESSION_ZSTD ) isAvailable = true;
+  #endif
+  #ifdef IP_NETWORK_COMPRESSION_LZ4
+  if( algorithm == IP_COMPRESSION_LZ4 ) isAvailable = true;
+  #endif
+  if( !isAvailable )
+  {
+    IP_REPORT_ERROR( "compression algorithm %d not available in this build", (int) algorithm );
+    return NULL;
+  }
+  
+  if( dictionary == NULL ) dictionaryLength = 0;
+  
+  IPCompressionContext context = (IPCompressionContext) calloc( 1, sizeof(struct _IPCompressionContextData) );
+  if( context == NULL )
+  {
+    IP_REPORT_ERROR( "compression: failed allocating context" );
+    return NULL;
+  }
+  context->algorithm = algorithm;
+  context->level = level;
+  context->threshold = threshold;
+  if( transportFilter != NULL ) context->transportFilter = *transportFilter;
+  
+  if( dictionaryLength > 0 )
+  {
+    context->dictionary = (char*) malloc( dictionaryLength );
+    if( context->dictionary == NULL )
+    {
+      IP_REPORT_ERROR( "compression: failed allocating %lu bytes dictionary", (unsigned long) dictionaryLength );
+      IPCompression_DiscardContext( context );
+      return NULL;
+    }
+    memcpy( context->dictionary, dictionary, dictionaryLength );
+    context->dictionaryLength = dictionaryLength;
+    context->dictionaryID = GetDictionaryID( context->dictionary, dictionaryLength );
+    
+    // Dictionaries are digested once and shared (read-only) by all connections
+    #ifdef IP_NETWORK_COMPRESSION_ZSTD
+    if( algorithm == IP_COMPRESSION_ZSTD )
+    {
+      context->zstdCompressionDictionary = ZSTD_createCDict( context->dictionary, dictionaryLength, level );
+      context->zstdDecompressionDictionary = ZSTD_createDDict( context->dictionary, dictionaryLength );
+      if( context->zstdCompressionDictionary == NULL || context->zstdDecompressionDictionary == NULL )
+      {
+        IP_REPORT_ERROR( "ZSTD_createCDict: failed loading compression dictionary" );
+        IPCompression_DiscardContext( context );
+        return NULL;
+      }
+    }
+    #endif
+    #ifdef IP_NETWORK_COMPRESSION_LZ4
+    if( algorithm == IP_COMPRESSION_LZ4 )
+    {
+      context->lz4Dictionary = LZ4_createStream();
+      if( context->lz4Dictionary == NULL )
+      {
+        IP_REPORT_ERROR( "LZ4_createStream: failed allocating dictionary stream" );
+        IPCompression_DiscardContext( context );
+        return NULL;
+      }
+      LZ4_loadDict( context->lz4Dictionary, context->dictionary, (int) dictionaryLength );
+    }
+    #endif
+  }
+  
+  return context;
+}
+
+void IPCompression_DiscardContext( IPCompressionContext context )
+{
+  if( context == NULL ) return;
+  
+  #ifdef IP_NETWORK_COMPRESSION_ZSTD
+  ZSTD_freeCDict( context->zstdCompressionDictionary );
+  ZSTD_freeDDict( context->zstdDecompressionDictionary );
+  #endif
+  #ifdef IP_NETWORK_COMPRESSION_LZ4
+  if( context->lz4Dictionary != NULL ) LZ4_freeStream( context->lz4Dictionary );
+  #endif
+  free( context->dictionary );
+  free( context );
+}
+
+void IPCompression_GetStatistics( IPCompressionContext context, size_t* ref_messageBytes, size_t* ref_transmittedBytes )
+{
+  if( context == NULL ) return;
+  
+  if( ref_messageBytes != NULL ) *ref_messageBytes = (size_t) ATOMIC_LOAD( &(context->messageBytes) );
+  if( ref_transmittedBytes != NULL ) *ref_transmittedBytes = (size_t) ATOMIC_LOAD( &(context->transmittedBytes) );
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                         CODECS                                                  /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns compressed length, or 0 if data could not be compressed into less than the given capacity
+static size_t CompressData( CompressionState* state, const char* data, size_t length, char* output, size_t capacity )
+{
+  IPCompressionContext context = state->context;
+  
+  #ifdef IP_NETWORK_COMPRESSION_ZSTD
+  if( context->algorithm == IP_COMPRESSION_ZSTD )
+  {
+    size_t result;
+    if( context->zstdCompressionDictionary != NULL ) 
+      result = ZSTD_compress_usingCDict( state->zstdCompressor, output, capacity, data, length, context->zstdCompressionDictionary );
+    else
+      result = ZSTD_compressCCtx( state->zstdCompressor, output, capacity, data, length, context->level );
+    return ZSTD_isError( result ) ? 0 : result;
+  }
+  #endif
+  #ifdef IP_NETWORK_COMPRESSION_LZ4
+  if( context->algorithm == IP_COMPRESSION_LZ4 )
+  {
+    if( context->lz4Dictionary == NULL ) 
+      return (size_t) LZ4_compress_fast( data, output, (int) length, (int) capacity, context->level );
+    // Restart from the preloaded dictionary state, so that every message is independently decodable
+    memcpy( state->lz4Stream, context->lz4Dictionary, sizeof(LZ4_stream_t) );
+    return (size_t) LZ4_compress_fast_continue( state->lz4Stream, data, output, (int) length, (int) capacity, context->level );
+  }
+  #endif
+  
+  return 0;
+}
+
+// Returns decompressed length, or -1 on corrupted data
+static int DecompressData( CompressionState* state, const char* data, size_t length, char* output, size_t capacity )
+{
+  IPCompressionContext context = state->context;
+  
+  #ifdef IP_NETWORK_COMPRESSION_ZSTD
+  if( context->algorithm == IP_COMPRESSION_ZSTD )
+  {
+    size_t result;
+    if( context->zstdDecompressionDictionary != NULL ) 
+      result = ZSTD_decompress_usingDDict( state->zstdDecompressor, output, capacity, data, length, context->zstdDecompressionDictionary );
+    else
+      result = ZSTD_decompressDCtx( state->zstdDecompressor, output, capacity, data, length );
+    return ZSTD_isError( result ) ? -1 : (int) result;
+  }
+  #endif
+  #ifdef IP_NETWORK_COMPRESSION_LZ4
+  if( context->algorithm == IP_COMPRESSION_LZ4 )
+  {
+    if( context->lz4Dictionary == NULL ) 
+      return LZ4_decompress_safe( data, output, (int) length, (int) capacity );
+    return LZ4_decompress_safe_usingDict( data, output, (int) length, (int) capacity, context->dictionary, (int) context->dictionaryLength );
+  }
+  #endif
+  
+  return -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                      TRANSPORT I/O                                              /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Writes all given data to the socket (or transport filter), waiting if needed
+static bool WriteData( CompressionState* state, const char* data, size_t length )
+{
+  IPStreamFilter* transport = &(state->context->transportFilter);
+  if( state->transportState != NULL ) return ( transport->ref_Send( state->transportState, data, length ) == (int) length );
+  
+  size_t bytesSent = 0;
+  while( bytesSent < length )
+  {
+    int result = (int) send( (int) state->socketFD, data + bytesSent, length - bytesSent, 0 );
+    if( result > 0 ) bytesSent += (size_t) result;
+    else if( result < 0 && IS_WOULD_BLOCK_ERROR() )
+    {
+      struct pollfd socketPoller = { .fd = (int) state->socketFD, .events = POLLOUT };
+      if( poll( &socketPoller, 1, FRAME_TIMEOUT_MS ) <= 0 ) return false;
+    }
+    else return false;
+  }
+  
+  return true;
+}
+
+// Appends data available on the socket (or transport filter) to the partially received hello or frame, without waiting, 
+// until it reaches the given length. Returns 1 when complete, 0 on connection closing or stream error, or -1 if data is still missing
+static int ReadFrameData( CompressionState* state, size_t length )
+{
+  IPStreamFilter* transport = &(state->context->transportFilter);
+  
+  while( state->receivedLength < length )
+  {
+    char* buffer = state->receiveBuffer + state->receivedLength;
+    size_t missingLength = length - state->receivedLength;
+    int result;
+    if( state->transportState != NULL ) result = transport->ref_Receive( state->transportState, buffer, missingLength );
+    else 
+    {
+      result = (int) recv( (int) state->socketFD, buffer, missingLength, 0 );
+      if( result < 0 && !IS_WOULD_BLOCK_ERROR() ) return 0;
+    }
+    
+    if( result <= 0 ) return result;
+    state->receivedLength += (size_t) result;
+  }
+  
+  return 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                        STREAM FILTER                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void CloseCompressionFilter( void* stateData )
+{
+  CompressionState* state = (CompressionState*) stateData;
+  
+  #ifdef IP_NETWORK_COMPRESSION_ZSTD
+  ZSTD_freeCCtx( state->zstdCompressor );
+  ZSTD_freeDCtx( state->zstdDecompressor );
+  #endif
+  #ifdef IP_NETWORK_COMPRESSION_LZ4
+  if( state->lz4Stream != NULL ) LZ4_freeStream( state->lz4Stream );
+  #endif
+  if( state->transportState != NULL ) state->context->transportFilter.ref_Close( state->transportState );
+  
+  free( state );
+}
+
+static void* OpenCompressionFilter( void* settings, intptr_t socketFD, bool isServerSide, const char* host )
+{
+  IPCompressionContext context = (IPCompressionContext) settings;
+  
+  if( context == NULL ) return NULL;
+  
+  CompressionState* state = (CompressionState*) calloc( 1, sizeof(CompressionState) );
+  if( state == NULL )
+  {
+    IP_REPORT_ERROR( "compression: failed allocating state for socket %ld", (long) socketFD );
+    return NULL;
+  }
+  state->context = context;
+  state->socketFD = socketFD;
+  
+  if( context->transportFilter.ref_Open != NULL )
+  {
+    state->transportState = context->transportFilter.ref_Open( context->transportFilter.settings, socketFD, isServerSide, host );
+    if( state->transportState == NULL )
+    {
+      free( state );
+      return NULL;
+    }
+  }
+  
+  #ifdef IP_NETWORK_COMPRESSION_ZSTD
+  if( context->algorithm == IP_COMPRESSION_ZSTD )
+  {
+    state->zstdCompressor = ZSTD_createCCtx();
+    state->zstdDecompressor = ZSTD_createDCtx();
+    if( state->zstdCompressor == NULL || state->zstdDecompressor == NULL )
+    {
+      IP_REPORT_ERROR( "ZSTD_createCCtx: failed allocating codecs for socket %ld", (long) socketFD );
+      CloseCompressionFilter( state );
+      return NULL;
+    }
+  }
+  #endif
+  #ifdef IP_NETWORK_COMPRESSION_LZ4
+  if( context->algorithm == IP_COMPRESSION_LZ4 && ( state->lz4Stream = LZ4_createStream() ) == NULL )
+  {
+    IP_REPORT_ERROR( "LZ4_createStream: failed allocating stream for socket %ld", (long) socketFD );
+    CloseCompressionFilter( state );
+    return NULL;
+  }
+  #endif
+  
+  // Frames are read as data arrives, without stalling the polling thread
+  if( state->transportState == NULL )
+  {
+    #ifdef WIN32
+    u_long nonBlocking = 1;
+    (void) ioctlsocket( (SOCKET) socketFD, FIONBIO, &nonBlocking );
+    #else
+    (void) fcntl( (int) socketFD, F_SETFL, fcntl( (int) socketFD, F_GETFL ) | O_NONBLOCK );
+    #endif
+  }
+  
+  // Both sides announce their configuration and only compress if the remote one can decode it. 
+  // The remote one is checked on reception, and messages go uncompressed until then
+  char localHello[ HELLO_LENGTH ];
+  GetHello( context, localHello );
+  if( !WriteData( state, localHello, HELLO_LENGTH ) )
+  {
+    IP_REPORT_ERROR( "compression: failed sending configuration on socket %ld", (long) socketFD );
+    CloseCompressionFilter( state );
+    return NULL;
+  }
+  state->helloDeadline = System_GetTimeMilliseconds() + IP_COMPRESSION_HANDSHAKE_TIMEOUT;
+  
+  return state;
+}
+
+static int SendCompressedData( void* stateData, const char* data, size_t length )
+{
+  CompressionState* state = (CompressionState*) stateData;
+  IPCompressionContext context = state->context;
+  
+  if( length > IP_MAX_MESSAGE_LENGTH ) return -1;
+  
+  char* payload = state->sendBuffer + FRAME_HEADER_LENGTH;
+  size_t payloadLength = 0;
+  uint8_t flags = 0;
+  // Compressed payload is only used when smaller than the message itself, which also bounds frame size
+  if( state->isCompressionEnabled && length >= context->threshold && length > 1 ) 
+    payloadLength = CompressData( state, data, length, payload, length - 1 );
+  if( payloadLength > 0 ) flags = FRAME_COMPRESSED_FLAG;
+  else
+  {
+    memcpy( payload, data, length );
+    payloadLength = length;
+  }
+  
+  state->sendBuffer[ 0 ] = (char) ( flags | ( payloadLength >> 8 ) );
+  state->sendBuffer[ 1 ] = (char) ( payloadLength & 0xFF );
+  // Header and payload are written at once, keeping frames inside single transport (e.g. TLS) records
+  if( !WriteData( state, state->sendBuffer, FRAME_HEADER_LENGTH + payloadLength ) ) return -1;
+  
+  ATOMIC_FETCH_ADD( &(context->messageBytes), length );
+  ATOMIC_FETCH_ADD( &(context->transmittedBytes), FRAME_HEADER_LENGTH + payloadLength );
+  
+  return (int) length;
+}
+
+// Reads and checks the remote configuration. Returns 1 when done, 0 on failure, or -1 if data is still missing
+static int ReceiveHello( CompressionState* state )
+{
+  int result = ReadFrameData( state, HELLO_LENGTH );
+  if( result < 0 && System_GetTimeMilliseconds() > state->helloDeadline )
+  {
+    IP_REPORT_ERROR( "compression: timed out waiting for configuration on socket %ld", (long) state->socketFD );
+    return 0;
+  }
+  if( result <= 0 ) return result;
+  
+  char localHello[ HELLO_LENGTH ];
+  GetHello( state->context, localHello );
+  if( memcmp( state->receiveBuffer, localHello, 3 ) != 0 )
+  {
+    IP_REPORT_ERROR( "compression: remote side of socket %ld does not use compression filter", (long) state->socketFD );
+    return 0;
+  }
+  
+  state->isCompressionEnabled = ( memcmp( state->receiveBuffer + 3, localHello + 3, HELLO_LENGTH - 3 ) == 0 );
+  state->isHelloReceived = true;
+  state->receivedLength = 0;
+  
+  return 1;
+}
+
+// Partial frames are kept on the connection state, returning -1 (no data) until complete
+static int ReceiveCompressedData( void* stateData, char* buffer, size_t length )
+{
+  CompressionState* state = (CompressionState*) stateData;
+  
+  int result = state->isHelloReceived ? 1 : ReceiveHello( state );
+  if( result <= 0 ) return result;
+  
+  if( ( result = ReadFrameData( state, FRAME_HEADER_LENGTH ) ) <= 0 ) return result;
+  
+  uint8_t* header = (uint8_t*) state->receiveBuffer;
+  size_t payloadLength = ( (size_t) ( header[ 0 ] & ~FRAME_COMPRESSED_FLAG ) << 8 ) | header[ 1 ];
+  if( payloadLength == 0 || payloadLength > IP_MAX_MESSAGE_LENGTH )
+  {
+    // Stream is out of sync: close the connection
+    IP_REPORT_ERROR( "compression: invalid frame on socket %ld", (long) state->socketFD );
+    return 0;
+  }
+  
+  if( ( result = ReadFrameData( state, FRAME_HEADER_LENGTH + payloadLength ) ) <= 0 ) return result;
+  state->receivedLength = 0;
+  
+  const char* payload = state->receiveBuffer + FRAME_HEADER_LENGTH;
+  if( header[ 0 ] & FRAME_COMPRESSED_FLAG )
+  {
+    result = DecompressData( state, payload, payloadLength, buffer, length );
+    if( result < 0 )
+    {
+      // Corrupted frame (or dictionary out of sync): close the connection instead of polling it again for data
+      IP_REPORT_ERROR( "compression: failed decompressing message from socket %ld", (long) state->socketFD );
+      return 0;
+    }
+    return result;
+  }
+  
+  if( payloadLength > length ) payloadLength = length;
+  memcpy( buffer, payload, payloadLength );
+  
+  return (int) payloadLength;
+}
+
+IPStreamFilter IPCompression_GetFilter( IPCompressionContext context )
+{
+  IPStreamFilter filter = { .ref_Open = OpenCompressionFilter, .ref_Send = SendCompressedData, .ref_Receive = ReceiveCompressedData, 
+                            .ref_Close = CloseCompressionFilter, .maxSendLength = IP_MAX_MESSAGE_LENGTH, .settings = context };
+  
+  return filter;
+}
@@ -0,0 +1,78 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+/// @file ip_compression.h
+/// @brief Per-message compression stream filter for TCP connections, based on LZ4 or Zstandard.
+///
+/// Messages at least as long as a configured threshold are compressed individually before sending 
+/// and decompressed after receiving, through the stream filter interface (see IP_SetStreamFilter()). 
+/// Both sides exchange their algorithm and dictionary identifier when the connection is opened, and 
+/// messages are only sent compressed if they match, so that peers with different configurations still 
+/// communicate (uncompressed). Shorter messages, and the ones that do not shrink, are sent as they are
+
+#ifndef IP_COMPRESSION_H
+#define IP_COMPRESSION_H
+
+#include "ip_network.h"
+
+
+#define IP_COMPRESSION_HANDSHAKE_TIMEOUT 5000   ///< Maximum time (in milliseconds) for remote configuration arrival after connection opening
+
+/// Available compression algorithms (depending on libraries found at build time)
+enum IPCompressionAlgorithm 
+{ 
+  IP_COMPRESSION_LZ4 = 1,     ///< LZ4: fastest, lower compression ratio
+  IP_COMPRESSION_ZSTD = 2     ///< Zstandard: higher compression ratio, specially with dictionaries
+};
+
+/// Opaque type to reference encapsulated compression configuration (algorithm, dictionary and statistics)
+typedef struct _IPCompressionContextData* IPCompressionContext;
+
+
+/// @brief Creates compression configuration shared by multiple connections
+/// @param[in] algorithm compression algorithm (IP_COMPRESSION_LZ4 or IP_COMPRESSION_ZSTD)
+/// @param[in] level algorithm specific level (Zstandard compression level, LZ4 acceleration factor, 0 for default)
+/// @param[in] threshold minimum message length (in bytes) for compression to be attempted
+/// @param[in] dictionary data trained or chosen from typical messages, identical on both sides (NULL for none, copied)
+/// @param[in] dictionaryLength length (in bytes) of the dictionary data
+/// @param[in] transportFilter optional filter (e.g. TLS) applied to the compressed stream (NULL for plain TCP, copied)
+/// @return reference to newly created configuration (NULL on error or algorithm not available)
+IPCompressionContext IPCompression_CreateContext( enum IPCompressionAlgorithm algorithm, int level, size_t threshold, 
+                                                  const void* dictionary, size_t dictionaryLength, const IPStreamFilter* transportFilter );
+
+/// @brief Releases given compression configuration, after all connections using it are closed
+/// @param[in] context compression configuration reference
+void IPCompression_DiscardContext( IPCompressionContext context );
+
+/// @brief Returns stream filter that compresses messages of connections with the given configuration
+/// @param[in] context compression configuration reference
+/// @return stream filter data, to be passed to IP_SetStreamFilter()
+IPStreamFilter IPCompression_GetFilter( IPCompressionContext context );
+
+/// @brief Returns amount of data sent by connections of the given configuration, before and after compression
+/// @param[in] context compression configuration reference
+/// @param[out] ref_messageBytes pointer to total length of sent messages
+/// @param[out] ref_transmittedBytes pointer to total length of data written to sockets (including framing)
+void IPCompression_GetStatistics( IPCompressionContext context, size_t* ref_messageBytes, size_t* ref_transmittedBytes );
+
+
+#endif // IP_COMPRESSION_H
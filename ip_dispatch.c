@@ -0,0 +1,167 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ip_dispatch.h"
+#include "ip_error.h"
+#include "ip_system.h"
+
+
+// Header layout: zero marker byte, type identifier, big-endian payload length and big-endian tag
+#define HEADER_MARKER_INDEX 0
+#define HEADER_TYPE_INDEX 1
+#define HEADER_LENGTH_INDEX 2
+#define HEADER_TAG_INDEX 4
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                      DATA STRUCTURES                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _HandlerEntry
+{
+  IPMessageHandler ref_Handle;
+  size_t payloadSize;
+  void* userData;
+}
+HandlerEntry;
+
+// Indexed directly by message type identifier, so that lookup costs a single memory access
+struct _IPDispatchTableData
+{
+  HandlerEntry handlersList[ IP_DISPATCH_TYPES_NUMBER ];
+  size_t rejectedNumber;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                        CONFIGURATION                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+IPDispatchTable IPDispatch_CreateTable( void )
+{
+  IPDispatchTable table = (IPDispatchTable) calloc( 1, sizeof(struct _IPDispatchTableData) );
+  if( table == NULL ) IP_REPORT_ERROR( "failed allocating dispatch table" );
+  
+  return table;
+}
+
+void IPDispatch_DiscardTable( IPDispatchTable table )
+{
+  free( table );
+}
+
+bool IPDispatch_RegisterHandler( IPDispatchTable table, uint8_t typeID, size_t payloadSize, IPMessageHandler handler, void* userData )
+{
+  if( table == NULL ) return false;
+  
+  if( payloadSize != IP_DISPATCH_VARIABLE_SIZE && payloadSize > IP_DISPATCH_MAX_PAYLOAD_LENGTH )
+  {
+    IP_REPORT_ERROR( "message type %u: payload size %lu exceeds maximum of %lu bytes", typeID, payloadSize, (size_t) IP_DISPATCH_MAX_PAYLOAD_LENGTH );
+    return false;
+  }
+  
+  table->handlersList[ typeID ].ref_Handle = handler;
+  table->handlersList[ typeID ].payloadSize = payloadSize;
+  table->handlersList[ typeID ].userData = userData;
+  
+  return true;
+}
+
+size_t IPDispatch_GetRejectedNumber( IPDispatchTable table )
+{
+  if( table == NULL ) return 0;
+  
+  return (size_t) ATOMIC_LOAD( &(table->rejectedNumber) );
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                     MESSAGE HANDLING                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+size_t IPDispatch_BuildMessage( char* buffer, uint8_t typeID, const void* payload, size_t payloadLength )
+{
+  if( buffer == NULL ) return 0;
+  
+  if( payloadLength > IP_DISPATCH_MAX_PAYLOAD_LENGTH )
+  {
+    IP_REPORT_ERROR( "message type %u: payload too long (%lu bytes for %lu max)", typeID, payloadLength, (size_t) IP_DISPATCH_MAX_PAYLOAD_LENGTH );
+    return 0;
+  }
+  
+  memset( buffer, 0, IP_DISPATCH_HEADER_LENGTH );
+  buffer[ HEADER_TYPE_INDEX ] = (char) typeID;
+  buffer[ HEADER_LENGTH_INDEX ] = (char) ( payloadLength >> 8 );
+  buffer[ HEADER_LENGTH_INDEX + 1 ] = (char) ( payloadLength & 0xFF );
+  if( payloadLength > 0 ) memcpy( buffer + IP_DISPATCH_HEADER_LENGTH, payload, payloadLength );
+  
+  return IP_DISPATCH_HEADER_LENGTH + payloadLength;
+}
+
+void IPDispatch_SetMessageTag( char* message, uint32_t tag )
+{
+  if( message == NULL ) return;
+  
+  for( size_t byteIndex = 0; byteIndex < sizeof(uint32_t); byteIndex++ )
+    message[ HEADER_TAG_INDEX + byteIndex ] = (char) ( tag >> ( 8 * ( sizeof(uint32_t) - 1 - byteIndex ) ) );
+}
+
+uint32_t IPDispatch_GetMessageTag( const void* payload )
+{
+  if( payload == NULL ) return 0;
+  
+  const uint8_t* header = (const uint8_t*) payload - IP_DISPATCH_HEADER_LENGTH;
+  uint32_t tag = 0;
+  for( size_t byteIndex = 0; byteIndex < sizeof(uint32_t); byteIndex++ )
+    tag = ( tag << 8 ) | header[ HEADER_TAG_INDEX + byteIndex ];
+  
+  return tag;
+}
+
+int IPDispatch_HandleMessage( IPDispatchTable table, unsigned long connectionID, const char* message, size_t messageLength )
+{
+  if( table == NULL || message == NULL ) return 0;
+  
+  // String messages (not starting with the zero marker) are left for the generic read path
+  if( messageLength < IP_DISPATCH_HEADER_LENGTH || message[ HEADER_MARKER_INDEX ] != 0 ) return 0;
+  
+  uint8_t typeID = (uint8_t) message[ HEADER_TYPE_INDEX ];
+  HandlerEntry* entry = &(table->handlersList[ typeID ]);
+  if( entry->ref_Handle == NULL ) return 0;
+  
+  size_t payloadLength = ( (size_t) (uint8_t) message[ HEADER_LENGTH_INDEX ] << 8 ) | (uint8_t) message[ HEADER_LENGTH_INDEX + 1 ];
+  if( payloadLength > messageLength - IP_DISPATCH_HEADER_LENGTH 
+      || ( entry->payloadSize != IP_DISPATCH_VARIABLE_SIZE && payloadLength != entry->payloadSize ) )
+  {
+    ATOMIC_FETCH_ADD( &(table->rejectedNumber), 1 );
+    IP_REPORT_ERROR( "connection %lu: message type %u with invalid payload length %lu", connectionID, typeID, payloadLength );
+    return -1;
+  }
+  
+  entry->ref_Handle( connectionID, message + IP_DISPATCH_HEADER_LENGTH, payloadLength, entry->userData );
+  
+  return 1;
+}
@@ -0,0 +1,104 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+
+/// @file ip_dispatch.h
+/// @brief Typed message layer, dispatching received messages to handlers registered by message type.
+///
+/// Typed messages start with a small header carrying a message type identifier and the payload length. 
+/// Applications register a handler (and the expected payload size) for each type in a dispatch table, 
+/// and the asynchronous layer calls them directly from the receive buffer (see AsyncIP_SetDispatchTable()), 
+/// instead of queueing messages to be read and parsed again by the application. 
+/// The header starts with a zero byte, so that typed messages read as empty strings by string based code
+
+#ifndef IP_DISPATCH_H
+#define IP_DISPATCH_H
+
+#include "ip_network.h"
+
+
+#define IP_DISPATCH_HEADER_LENGTH 8                                                 ///< Length (in bytes) of the typed message header, preceding the payload
+#define IP_DISPATCH_MAX_PAYLOAD_LENGTH ( IP_MAX_MESSAGE_LENGTH - IP_DISPATCH_HEADER_LENGTH )   ///< Maximum length (in bytes) of a typed message payload
+#define IP_DISPATCH_TYPES_NUMBER 256                                                ///< Number of available message type identifiers
+#define IP_DISPATCH_VARIABLE_SIZE ( (size_t) -1 )                                   ///< Expected payload size for types of variable length
+
+/// Handler of received messages of a given type
+/// @param[in] connectionID identifier of the (client) connection that received the message
+/// @param[in] payload pointer to message payload (valid only during the call, aligned to IP_DISPATCH_HEADER_LENGTH bytes)
+/// @param[in] payloadLength length (in bytes) of the message payload
+/// @param[in] userData pointer given on handler registration
+typedef void (*IPMessageHandler)( unsigned long connectionID, const void* payload, size_t payloadLength, void* userData );
+
+/// Opaque type to reference encapsulated dispatch table (handlers and expected payload sizes by message type)
+typedef struct _IPDispatchTableData* IPDispatchTable;
+
+
+/// @brief Creates empty dispatch table, shareable by multiple connections
+/// @return reference to newly created table (NULL on error)
+IPDispatchTable IPDispatch_CreateTable( void );
+
+/// @brief Releases given dispatch table, after all connections using it are closed
+/// @param[in] table dispatch table reference
+void IPDispatch_DiscardTable( IPDispatchTable table );
+
+/// @brief Registers (or replaces) handler for messages of the given type. Should be called before the table is used by any connection
+/// @param[in] table dispatch table reference
+/// @param[in] typeID message type identifier
+/// @param[in] payloadSize exact expected payload length, messages of other lengths are rejected (IP_DISPATCH_VARIABLE_SIZE for any length)
+/// @param[in] handler function called for received messages of the given type (NULL to remove registration)
+/// @param[in] userData pointer passed to the handler on every call
+/// @return true on success, false on error
+bool IPDispatch_RegisterHandler( IPDispatchTable table, uint8_t typeID, size_t payloadSize, IPMessageHandler handler, void* userData );
+
+/// @brief Writes header and payload of a typed message to the given buffer
+/// @param[out] buffer message buffer, at least IP_DISPATCH_HEADER_LENGTH + payloadLength bytes long
+/// @param[in] typeID message type identifier
+/// @param[in] payload pointer to payload data (may be NULL for empty payloads)
+/// @param[in] payloadLength length (in bytes) of the payload, limited by IP_DISPATCH_MAX_PAYLOAD_LENGTH
+/// @return total message length (0 on error)
+size_t IPDispatch_BuildMessage( char* buffer, uint8_t typeID, const void* payload, size_t payloadLength );
+
+/// @brief Sets tag of given typed message, carried along without interpretation (e.g. RPC call identifiers)
+/// @param[in,out] message pointer to typed message data (see IPDispatch_BuildMessage())
+/// @param[in] tag value stored in the message header (0 by default)
+void IPDispatch_SetMessageTag( char* message, uint32_t tag );
+
+/// @brief Returns tag of the typed message whose payload is given, when called from message handlers
+/// @param[in] payload payload pointer passed to the handler
+/// @return tag value stored in the message header
+uint32_t IPDispatch_GetMessageTag( const void* payload );
+
+/// @brief Validates given message and calls the handler registered for its type
+/// @param[in] table dispatch table reference
+/// @param[in] connectionID identifier passed to the handler
+/// @param[in] message pointer to received message data
+/// @param[in] messageLength length (in bytes) of the received message data
+/// @return 1 if the message was handled, 0 if it is not typed or its type has no handler, -1 if it was rejected as invalid
+int IPDispatch_HandleMessage( IPDispatchTable table, unsigned long connectionID, const char* message, size_t messageLength );
+
+/// @brief Returns number of typed messages rejected by the given table for not matching the expected payload size
+/// @param[in] table dispatch table reference
+/// @return number of rejected messages
+size_t IPDispatch_GetRejectedNumber( IPDispatchTable table );
+
+
+#endif // IP_DISPATCH_H
@@ -0,0 +1,233 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "ip_error.h"
+#include "ip_system.h"
+
+#include "threads/threads.h"
+#include "threads/thread_safe_queues.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                      DATA STRUCTURES                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+const size_t LOG_QUEUE_MAX_ITEMS = 64;
+
+enum { LOGGER_STOPPED, LOGGER_STARTING, LOGGER_RUNNING, LOGGER_STOPPING };
+
+static uint64_t loggerState = LOGGER_STOPPED;
+static volatile bool isLoggerRunning = false;
+static Thread loggerThread = THREAD_INVALID_HANDLE;
+static TSQueue logQueue = NULL;
+
+static volatile IPErrorSink errorSink = NULL;
+
+static volatile size_t rateLimitMessagesNumber = 10;
+static volatile unsigned int rateLimitInterval = 1000;
+
+// Lock-free list of sites with at least one reported error
+static IPErrorSite* volatile sitesList = NULL;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                        LOGGING THREAD                                           /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void WriteDefaultSink( const char* message )
+{
+  fprintf( stderr, "%s\n", message );
+}
+
+static void DeliverMessage( const char* message )
+{
+  IPErrorSink sink = errorSink;
+  if( sink == NULL ) sink = WriteDefaultSink;
+  sink( message );
+}
+
+// Loop of error messages delivery (removing in order from queue) to the current sink, until stopped with the queue empty
+static void* AsyncLogMessages( void* args )
+{
+  char message[ IP_ERROR_MESSAGE_LENGTH ];
+  
+  while( isLoggerRunning || TSQ_GetItemsCount( logQueue ) > 0 )
+  {
+    TSQ_Dequeue( logQueue, message, TSQUEUE_WAIT );
+    // Empty messages are only queued to wake the thread up for stopping
+    if( message[ 0 ] != '\0' ) DeliverMessage( message );
+  }
+  
+  return NULL;
+}
+
+// Lazily starts logging thread. Returns false while it is still being started or stopped by another thread
+static bool StartLogger( void )
+{
+  static bool isExitHandlerSet = false;
+  
+  if( ATOMIC_LOAD( &loggerState ) == LOGGER_RUNNING ) return true;
+  
+  if( !ATOMIC_COMPARE_EXCHANGE( &loggerState, LOGGER_STOPPED, LOGGER_STARTING ) ) return false;
+  
+  // Queue is kept after stopping, as late reports may still be enqueued there (delivered on the next start)
+  if( logQueue == NULL ) logQueue = TSQ_Create( LOG_QUEUE_MAX_ITEMS, IP_ERROR_MESSAGE_LENGTH );
+  isLoggerRunning = true;
+  loggerThread = Thread_Start( AsyncLogMessages, NULL, THREAD_JOINABLE );
+  
+  // Queued messages are still delivered on normal process exit
+  if( !isExitHandlerSet ) isExitHandlerSet = ( atexit( IPError_StopLogging ) == 0 );
+  
+  ATOMIC_STORE( &loggerState, LOGGER_RUNNING );
+  
+  return true;
+}
+
+void IPError_StopLogging( void )
+{
+  char wakeMessage[ IP_ERROR_MESSAGE_LENGTH ] = { 0 };
+  
+  if( !ATOMIC_COMPARE_EXCHANGE( &loggerState, LOGGER_RUNNING, LOGGER_STOPPING ) ) return;
+  
+  isLoggerRunning = false;
+  TSQ_Enqueue( logQueue, wakeMessage, TSQUEUE_NOWAIT );
+  
+  (void) Thread_WaitExit( loggerThread, 5000 );
+  loggerThread = THREAD_INVALID_HANDLE;
+  
+  ATOMIC_STORE( &loggerState, LOGGER_STOPPED );
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                          REPORTING                                              /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static inline void RegisterSite( IPErrorSite* site )
+{
+  IPErrorSite* firstSite;
+  do 
+  {
+    firstSite = sitesList;
+    site->next = firstSite;
+  }
+  while( !ATOMIC_COMPARE_EXCHANGE_POINTER( &sitesList, firstSite, site ) );
+}
+
+// Check (and update) site rate limiting interval. Concurrent reports on the same site may slightly exceed the limit
+static inline bool IsRateLimited( IPErrorSite* site, uint64_t currentTime )
+{
+  uint64_t windowStartTime = ATOMIC_LOAD( &(site->windowStartTime) );
+  if( currentTime - windowStartTime >= rateLimitInterval )
+  {
+    if( ATOMIC_COMPARE_EXCHANGE( &(site->windowStartTime), windowStartTime, currentTime ) ) 
+      ATOMIC_STORE( &(site->windowErrorsCount), 0 );
+  }
+  
+  return ( ATOMIC_FETCH_ADD( &(site->windowErrorsCount), 1 ) >= rateLimitMessagesNumber );
+}
+
+void IPError_Report( IPErrorSite* site, const char* format, ... )
+{
+  char message[ IP_ERROR_MESSAGE_LENGTH ];
+  
+  if( site == NULL || format == NULL ) return;
+  
+  if( ATOMIC_FETCH_ADD( &(site->errorsCount), 1 ) == 0 ) RegisterSite( site );
+  
+  if( IsRateLimited( site, System_GetTimeMilliseconds() ) )
+  {
+    ATOMIC_FETCH_ADD( &(site->suppressedCount), 1 );
+    ATOMIC_FETCH_ADD( &(site->pendingSuppressedCount), 1 );
+    return;
+  }
+  
+  int messageLength = snprintf( message, IP_ERROR_MESSAGE_LENGTH / 2, "%s: ", site->location );
+  if( messageLength >= IP_ERROR_MESSAGE_LENGTH / 2 ) messageLength = IP_ERROR_MESSAGE_LENGTH / 2 - 1;
+  va_list arguments;
+  va_start( arguments, format );
+  messageLength += vsnprintf( message + messageLength, IP_ERROR_MESSAGE_LENGTH - messageLength, format, arguments );
+  va_end( arguments );
+  
+  // Take (and reset) suppressed errors count since last delivered message
+  uint64_t pendingSuppressedCount = ATOMIC_LOAD( &(site->pendingSuppressedCount) );
+  if( pendingSuppressedCount > 0 && messageLength < IP_ERROR_MESSAGE_LENGTH )
+  {
+    ATOMIC_FETCH_SUB( &(site->pendingSuppressedCount), pendingSuppressedCount );
+    snprintf( message + messageLength, IP_ERROR_MESSAGE_LENGTH - messageLength, " (%llu similar errors suppressed)", (unsigned long long) pendingSuppressedCount );
+  }
+  
+  // Deliver directly only while the logging thread is being started
+  if( !StartLogger() ) 
+  {
+    DeliverMessage( message );
+    return;
+  }
+  
+  // Never block the reporting thread: drop message if the logging thread is behind
+  if( TSQ_GetItemsCount( logQueue ) >= LOG_QUEUE_MAX_ITEMS ) 
+  {
+    ATOMIC_FETCH_ADD( &(site->suppressedCount), 1 );
+    ATOMIC_FETCH_ADD( &(site->pendingSuppressedCount), 1 );
+    return;
+  }
+  
+  TSQ_Enqueue( logQueue, message, TSQUEUE_NOWAIT );
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                        CONFIGURATION                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void IPError_SetSink( IPErrorSink sink )
+{
+  errorSink = sink;
+}
+
+void IPError_SetRateLimit( size_t maxMessagesNumber, unsigned int intervalMilliseconds )
+{
+  rateLimitMessagesNumber = maxMessagesNumber;
+  rateLimitInterval = intervalMilliseconds;
+}
+
+size_t IPError_GetCounters( IPErrorCounters* countersList, size_t maxSitesNumber )
+{
+  size_t sitesNumber = 0;
+  
+  if( countersList == NULL ) return 0;
+  
+  for( IPErrorSite* site = sitesList; site != NULL && sitesNumber < maxSitesNumber; site = site->next )
+  {
+    countersList[ sitesNumber ].location = site->location;
+    countersList[ sitesNumber ].errorsCount = ATOMIC_LOAD( &(site->errorsCount) );
+    countersList[ sitesNumber ].suppressedCount = ATOMIC_LOAD( &(site->suppressedCount) );
+    sitesNumber++;
+  }
+  
+  return sitesNumber;
+}
@@ -0,0 +1,97 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+/// @file ip_error.h
+/// @brief Rate-limited and non-blocking error reporting.
+///
+/// Errors are counted per reporting site (source code location) and, up to a rate limit, formatted 
+/// and handed off to a background thread, that delivers them to a pluggable sink (standard error by default).
+/// Reporting threads never block on sink output, and errors above the rate limit only increment counters
+
+#ifndef IP_ERROR_H
+#define IP_ERROR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define IP_ERROR_MESSAGE_LENGTH 256     ///< Maximum length of formatted error messages (longer ones are truncated)
+
+/// Error reporting site data (one static instance per IP_REPORT_ERROR call)
+typedef struct _IPErrorSite
+{
+  const char* location;                 ///< Source code location string ("<file>:<line>")
+  uint64_t errorsCount;                 ///< Total number of errors reported on this site
+  uint64_t suppressedCount;             ///< Number of errors not delivered to the sink (rate limited or dropped)
+  uint64_t windowStartTime;             ///< Start (in milliseconds) of the current rate limiting interval
+  uint64_t windowErrorsCount;           ///< Number of errors reported on the current rate limiting interval
+  uint64_t pendingSuppressedCount;      ///< Errors suppressed since last delivered message
+  struct _IPErrorSite* next;            ///< Next site in the list of sites with reported errors
+}
+IPErrorSite;
+
+/// Error counters of a single reporting site
+typedef struct _IPErrorCounters
+{
+  const char* location;                 ///< Source code location string ("<file>:<line>")
+  uint64_t errorsCount;                 ///< Total number of errors reported
+  uint64_t suppressedCount;             ///< Number of errors not delivered to the sink
+}
+IPErrorCounters;
+
+/// Error messages sink, called from the background logging thread
+typedef void (*IPErrorSink)( const char* message );
+
+
+#define IP_ERROR_STRINGIFY( value ) #value
+#define IP_ERROR_LOCATION( file, line ) file ":" IP_ERROR_STRINGIFY( line )
+
+/// Reports error with printf-like formatted message, counted on its own static site
+#define IP_REPORT_ERROR( ... ) do { static IPErrorSite errorSite = { .location = IP_ERROR_LOCATION( __FILE__, __LINE__ ) }; \
+                                    IPError_Report( &errorSite, __VA_ARGS__ ); } while( 0 )
+
+
+/// @brief Counts error on given site and, if allowed by the rate limit, queues formatted message for the sink (used through IP_REPORT_ERROR macro)
+/// @param[in] site reporting site data reference
+/// @param[in] format printf-like message format string
+void IPError_Report( IPErrorSite* site, const char* format, ... );
+
+/// @brief Defines the sink that receives the delivered error messages
+/// @param[in] sink error messages sink function (NULL for default standard error output)
+void IPError_SetSink( IPErrorSink sink );
+
+/// @brief Defines the per-site rate limit of delivered error messages
+/// @param[in] maxMessagesNumber maximum number of messages delivered per interval for each site (0 suppresses all messages)
+/// @param[in] intervalMilliseconds rate limiting interval (in milliseconds)
+void IPError_SetRateLimit( size_t maxMessagesNumber, unsigned int intervalMilliseconds );
+
+/// @brief Copies error counters of the sites with reported errors
+/// @param[out] countersList array where counters are copied to
+/// @param[in] maxSitesNumber maximum number of sites to be copied
+/// @return number of sites copied
+size_t IPError_GetCounters( IPErrorCounters* countersList, size_t maxSitesNumber );
+
+/// @brief Delivers already queued messages and stops the background logging thread (restarted on the next report). Also called on normal process exit
+void IPError_StopLogging( void );
+
+
+#endif // IP_ERROR_H
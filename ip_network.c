@@ -25,6 +25,10 @@
 ///// as server or client, using TCP or UDP protocols                           /////
 /////////////////////////////////////////////////////////////////////////////////////
 
+#ifdef __linux__
+  #define _GNU_SOURCE                                           // For splice()
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +43,7 @@
   #pragma comment(lib, "Ws2_32.lib")
   
   #define SHUT_RDWR SD_BOTH
+  #define SHUT_WR SD_SEND
   #define close( i ) closesocket( i )
   #define poll WSAPoll
   
@@ -48,13 +53,22 @@
   #include <unistd.h>
   #include <errno.h>
   #include <sys/types.h>
+  #include <sys/stat.h>
   #include <sys/socket.h>
   #include <sys/time.h>
   #include <stropts.h>
   #include <poll.h>
   #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <netinet/udp.h>
   #include <arpa/inet.h>
   #include <netdb.h>
+  #include <sys/un.h>
+  #ifdef __linux__
+    #include <sys/sendfile.h>
+    #include <linux/errqueue.h>
+    #include <sys/mman.h>
+  #endif
 
   const int SOCKET_ERROR = -1;
   const int INVALID_SOCKET = -1;
@@ -62,7 +76,14 @@
   typedef int Socket;
 #endif
 
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0                                        // Writes to remotely closed sockets do not raise signals
+#endif
+
 #define PORT_LENGTH 6                                           // Maximum length of short integer string representation
+#define HOST_NAME_LENGTH 256                                    // Maximum length of (DNS) host name string
+#define TRAIN_BUFFER_LENGTH 65536                               // Maximum length of datagrams received at once, when coalesced (UDP_GRO)
+#define MAX_TRAIN_SEGMENTS 64                                   // Maximum number of datagrams sent at once, when segmented (UDP_SEGMENT)
   
 #ifndef IP_NETWORK_LEGACY
   typedef struct pollfd SocketPoller;
@@ -87,14 +108,63 @@ typedef struct sockaddr* IPAddress;                             // Opaque IP add
 #define IS_IP_MULTICAST_ADDRESS( address ) ( IS_IPV4_MULTICAST_ADDRESS( address ) || IS_IPV6_MULTICAST_ADDRESS( address ) )
 #define ARE_EQUAL_IP_ADDRESSES( address_1, address_2 ) ( ARE_EQUAL_IPV4_ADDRESSES( address_1, address_2 ) || ARE_EQUAL_IPV6_ADDRESSES( address_1, address_2 ) )
 
+#ifndef WIN32
+  typedef union { IPAddressData ip; struct sockaddr_un local; } SocketAddressData;    // Storage for both IP and Unix domain (local) addresses
+  #define LOCAL_PATH_LENGTH sizeof(((struct sockaddr_un*) 0)->sun_path)
+  #define ARE_EQUAL_LOCAL_ADDRESSES( address_1, address_2 ) ( ((struct sockaddr*) address_1)->sa_family == AF_UNIX && \
+                                                              memcmp( ((struct sockaddr_un*) address_1)->sun_path, ((struct sockaddr_un*) address_2)->sun_path, LOCAL_PATH_LENGTH ) == 0 )
+#else
+  typedef union { IPAddressData ip; } SocketAddressData;
+  #define LOCAL_PATH_LENGTH 0
+  #define ARE_EQUAL_LOCAL_ADDRESSES( address_1, address_2 ) false
+#endif
+#define ARE_EQUAL_ADDRESSES( address_1, address_2 ) ( ARE_EQUAL_IP_ADDRESSES( address_1, address_2 ) || ARE_EQUAL_LOCAL_ADDRESSES( address_1, address_2 ) )
+
+#define TRANSPORT_MASK 0xFC
+#define ROLE_MASK 0x03
+#define IS_STREAM_TRANSPORT( transport ) ( (transport) & ( IP_TCP | IP_UNIX_STREAM ) )
+#define IS_LOCAL_TRANSPORT( transport ) ( (transport) & ( IP_UNIX_STREAM | IP_UNIX_DGRAM | IP_SHM ) )
+
 #include "ip_network.h"
+#include "ip_trace.h"
+#include "ip_error.h"
+#include "ip_system.h"
+#include "ip_shm.h"
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
 /////                                      INTERFACE DEFINITION                                       /////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-// Generic structure to store methods and data of any connection type handled by the library
+// Rarely accessed data of any connection type (used on setup, clients handling and termination)
+typedef struct _IPConnectionInfo
+{
+  SocketAddressData addressData;                                // Remote address for clients, local address for servers
+  void (*ref_Close)( IPConnection );
+  union {
+    IPConnection* clientsList;
+    IPConnection server;                                        // Owner server of accepted clients (NULL otherwise)
+  };
+  size_t clientsCount;
+  size_t maxClientsCount;                                       // Limit of clients accepted by servers (0 if not limited)
+  IPStreamFilter filter;                                        // Stream filter of TCP connections (inherited by server clients)
+  void* filterState;                                            // Stream filter data of TCP clients (NULL if not filtered)
+  char hostName[ HOST_NAME_LENGTH ];                            // Remote host given to TCP clients, passed to their filter (empty otherwise)
+  IPShmChannel* sharedChannel;                                  // Shared memory rings of IP_SHM clients
+  char* bulkBuffer;                                             // Copy of data received in bulk mode by TCP clients (NULL if not enabled)
+  char* bulkWindow;                                             // Mapping of received pages in bulk mode (NULL where not supported)
+  size_t bulkLength;                                            // Length of bulk receiving buffer and window (whole pages)
+  bool isOffloading;                                            // Datagrams sent and received in trains by UDP socket owners
+  char* trainBuffer;                                            // Coalesced datagrams received by UDP clients (NULL if not used)
+  size_t trainLength;
+  size_t trainOffset;                                           // Position of next datagram to be taken from received train
+  size_t segmentLength;                                         // Length of all datagrams of received train, except the last one
+  uint64_t receiveTime;                                         // Kernel receive time of last received message (0 if not available)
+}
+IPConnectionInfo;
+
+// Generic structure to store methods and frequently accessed data of any connection type handled by the library.
+// Fits a single cache line, at the beginning of a memory block followed by the connection info (and message buffer, for clients)
 struct _IPConnectionData
 {
   SocketPoller* socket;
@@ -103,31 +173,46 @@ struct _IPConnectionData
     IPConnection (*ref_AcceptClient)( IPConnection );
   };
   int (*ref_SendMessage)( IPConnection, const char* );
-  void (*ref_Close)( IPConnection );
-  IPAddressData addressData;
+  char* buffer;
   size_t messageLength;
-  union {
-    char* buffer;
-    IPConnection* clientsList;
-  };
-  union {
-    size_t* ref_clientsCount;
-    IPConnection server;
-  };
+  IPConnectionInfo* info;
+  uint8_t type;                                                 // Transport and role flags, defined on creation
+  uint8_t receiveFlags;                                         // Receiving modes, checked before reading (colder) connection info
 };
 
+#define RECEIVE_BULK 0x01                                       // Data only taken by IP_ReceiveBulk() (info bulk buffer allocated)
+#define RECEIVE_TRAIN_PENDING 0x02                              // Datagrams left from received train (info train offset before its end)
+#define RECEIVE_TIMESTAMPING 0x04                               // Kernel receive time read with received data (inherited by server clients)
+#define RECEIVE_FILTER_PENDING 0x08                             // Received data left in stream filter state (e.g. rest of a decrypted record)
+
+// Compile time check of frequently accessed data size
+typedef char IPConnectionDataSizeCheck[ ( sizeof(IPConnectionData) <= CACHE_LINE_SIZE ) ? 1 : -1 ];
+
+#define CONNECTION_DATA_SIZE CACHE_LINE_SIZE
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
 /////                                        GLOBAL VARIABLES                                         /////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#ifndef IP_MAX_SOCKETS_NUMBER
+#define IP_MAX_SOCKETS_NUMBER 1024                              // Maximum number of sockets polled at the same time
+#endif
+
 #ifdef IP_NETWORK_LEGACY
 static fd_set polledSocketsSet = { 0 };
 static fd_set activeSocketsSet = { 0 };
 #else
-static SocketPoller polledSocketsList[ 1024 ] = { 0 };
+// Pollers keep their position while in use, as connections reference them. Released ones (with invalid descriptor) are ignored by poll()
+static SocketPoller polledSocketsList[ IP_MAX_SOCKETS_NUMBER ] = { 0 };
+static size_t freeSocketIndexesList[ IP_MAX_SOCKETS_NUMBER ];
+static size_t freeSocketsNumber = 0;
 #endif
 static size_t polledSocketsNumber = 0;
+// Connections with datagrams left from received trains, taken without waiting for socket events
+static uint64_t pendingTrainsCount = 0;
+// Connections with received data left in their stream filters, also taken without waiting for socket events
+static uint64_t pendingFiltersCount = 0;
 
 /////////////////////////////////////////////////////////////////////////////
 /////                        FORWARD DECLARATIONS                       /////
@@ -139,28 +224,67 @@ static char* ReceiveUDPMessage( IPConnection );
 static int SendTCPMessage( IPConnection, const char* );
 static int SendUDPMessage( IPConnection, const char* );
 static int SendMessageAll( IPConnection, const char* );
+static char* ReceiveFilteredMessage( IPConnection );
+static int SendFilteredMessage( IPConnection, const char* );
 static IPConnection AcceptTCPClient( IPConnection );
 static IPConnection AcceptUDPClient( IPConnection );
 static void CloseTCPServer( IPConnection );
 static void CloseUDPServer( IPConnection );
 static void CloseTCPClient( IPConnection );
 static void CloseUDPClient( IPConnection );
+static char* ReceiveShmMessage( IPConnection );
+static int SendShmMessage( IPConnection, const char* );
+static IPConnection AcceptShmClient( IPConnection );
+static void CloseShmClient( IPConnection );
+static void InvalidateSocket( SocketPoller* );
+static void UnmapBulkWindow( IPConnection );
+static void MapBulkWindow( IPConnection );
+static void SetSocketPolling( SocketPoller*, bool );
+static long ReceiveSocketData( IPConnection, char*, size_t );
 
 /////////////////////////////////////////////////////////////////////////////
 /////                         NETWORK UTILITIES                         /////
 /////////////////////////////////////////////////////////////////////////////
 
+// Returns actual length of the given socket address structure, as expected by system calls
+static socklen_t GetAddressLength( IPAddress address )
+{
+  #ifndef WIN32
+  if( address->sa_family == AF_UNIX )
+  {
+    // Abstract namespace names start with a null character and are not null terminated
+    const char* path = ((struct sockaddr_un*) address)->sun_path;
+    size_t pathLength = ( path[ 0 ] == '\0' ) ? 1 + strnlen( path + 1, LOCAL_PATH_LENGTH - 1 ) : strnlen( path, LOCAL_PATH_LENGTH - 1 ) + 1;
+    return (socklen_t) ( offsetof( struct sockaddr_un, sun_path ) + pathLength );
+  }
+  #endif
+  
+  return ( address->sa_family == AF_INET6 ) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
 // System calls for getting IP address strings
 char* GetAddressString( IPAddress address )
 {                                           
-  static char addressString[ ADDRESS_LENGTH ];
+  static char addressString[ ADDRESS_LENGTH + LOCAL_PATH_LENGTH ];
+  
+  #ifndef WIN32
+  // Local addresses are represented by their path (or "@" and abstract name) and no port
+  if( address->sa_family == AF_UNIX )
+  {
+    const char* path = ((struct sockaddr_un*) address)->sun_path;
+    if( path[ 0 ] != '\0' ) snprintf( addressString, sizeof(addressString), "%.*s/0", (int) LOCAL_PATH_LENGTH, path );
+    else if( path[ 1 ] != '\0' ) snprintf( addressString, sizeof(addressString), "@%.*s/0", (int) LOCAL_PATH_LENGTH - 1, path + 1 );
+    else snprintf( addressString, sizeof(addressString), "unnamed/0" );
+    return addressString;
+  }
+  #endif
   
   #ifndef IP_NETWORK_LEGACY
   int error = getnameinfo( address, sizeof(IPAddressData), addressString, ADDRESS_LENGTH - PORT_LENGTH, NULL, 0, NI_NUMERICHOST );
   error = getnameinfo( address, sizeof(IPAddressData), NULL, 0, addressString + strlen( addressString ) + 1, PORT_LENGTH, NI_NUMERICSERV );
   if( error != 0 )
   {
-    fprintf( stderr, "getnameinfo: failed getting address string: %s", gai_strerror( error ) );
+    IP_REPORT_ERROR( "getnameinfo: failed getting address string: %s", gai_strerror( error ) );
     return NULL;
   }
   #else
@@ -177,7 +301,7 @@ char* IP_GetAddress( IPConnection connection )
 {
   if( connection == NULL ) return NULL;
   
-  return GetAddressString( (IPAddress) &(connection->addressData) );
+  return GetAddressString( (IPAddress) &(connection->info->addressData) );
 }
 
 // Returns number of active clients for a connection 
@@ -186,110 +310,189 @@ size_t IP_GetClientsNumber( IPConnection connection )
   if( connection == NULL ) return 0;
   
   if( IP_IsServer( connection ) )
-    return *(connection->ref_clientsCount);
+    return connection->info->clientsCount;
   
   return 1;
 }
 
+size_t IP_GetMemoryUsage( IPConnection connection )
+{
+  if( connection == NULL ) return 0;
+  
+  IPConnectionInfo* info = connection->info;
+  size_t memoryLength = CONNECTION_DATA_SIZE + sizeof(IPConnectionInfo);
+  if( IP_IsServer( connection ) ) memoryLength += info->clientsCount * sizeof(IPConnection);
+  else
+  {
+    memoryLength += IP_MAX_MESSAGE_LENGTH;
+    if( info->trainBuffer != NULL ) memoryLength += TRAIN_BUFFER_LENGTH;
+    memoryLength += info->bulkLength;
+  }
+  
+  return memoryLength;
+}
+
 bool IP_IsServer( IPConnection connection )
 {
   if( connection == NULL ) return false;
   
-  if( connection->ref_Close == CloseTCPServer || connection->ref_Close == CloseUDPServer ) return true;
+  return ( connection->type & IP_SERVER );
+}
+
+bool IP_IsStream( IPConnection connection )
+{
+  if( connection == NULL ) return false;
   
-  return false;
+  return IS_STREAM_TRANSPORT( connection->type );
 }
 
+bool IP_IsAccepted( IPConnection connection )
+{
+  if( connection == NULL ) return false;
+  
+  return ( !( connection->type & IP_SERVER ) && connection->info->server != NULL );
+}
 
-//////////////////////////////////////////////////////////////////////////////////
-/////                             INITIALIZATION                             /////
-//////////////////////////////////////////////////////////////////////////////////
+intptr_t IP_GetSocketDescriptor( IPConnection connection )
+{
+  if( connection == NULL ) return (intptr_t) INVALID_SOCKET;
+  
+  return (intptr_t) connection->socket->fd;
+}
 
-#ifndef IP_NETWORK_LEGACY
-static int CompareSockets( const void* ref_socket_1, const void* ref_socket_2 )
+const void* IP_GetAddressData( IPConnection connection, size_t* ref_addressLength )
 {
-  return ( ((SocketPoller*) ref_socket_1)->fd - ((SocketPoller*) ref_socket_2)->fd );
+  if( connection == NULL ) return NULL;
+  
+  if( ref_addressLength != NULL ) *ref_addressLength = GetAddressLength( (IPAddress) &(connection->info->addressData) );
+  
+  return &(connection->info->addressData);
 }
-#endif
 
-// Handle construction of a IPConnection structure with the defined properties
-static IPConnection AddConnection( Socket socketFD, IPAddress address, uint8_t transportProtocol, uint8_t networkRole )
+
+//////////////////////////////////////////////////////////////////////////////////
+/////                             INITIALIZATION                             /////
+//////////////////////////////////////////////////////////////////////////////////
+
+// Handle construction of a IPConnection structure with the defined properties (polling the given socket, or sharing the given poller)
+static IPConnection AddConnection( Socket socketFD, IPAddress address, uint8_t transportProtocol, uint8_t networkRole, SocketPoller* sharedSocket )
 {
-  IPConnection connection = (IPConnection) malloc( sizeof(IPConnectionData) );
-  memset( connection, 0, sizeof(IPConnectionData) );
+  size_t connectionBlockSize = CONNECTION_DATA_SIZE + sizeof(IPConnectionInfo) + ( ( networkRole == IP_SERVER ) ? 0 : IP_MAX_MESSAGE_LENGTH );
+  IPConnection connection = (IPConnection) System_AllocateAligned( CACHE_LINE_SIZE, connectionBlockSize );
+  if( connection == NULL ) return NULL;
+  memset( connection, 0, connectionBlockSize );
+  connection->info = (IPConnectionInfo*) ( (char*) connection + CONNECTION_DATA_SIZE );
   
+  if( sharedSocket != NULL ) connection->socket = sharedSocket;
   #ifndef IP_NETWORK_LEGACY
-  SocketPoller cmpPoller = { .fd = socketFD };
-  connection->socket = (SocketPoller*) bsearch( &cmpPoller, polledSocketsList, polledSocketsNumber, sizeof(SocketPoller), CompareSockets );
-  if( connection->socket == NULL )
+  else
   {
-    connection->socket = &(polledSocketsList[ polledSocketsNumber ]);
+    if( freeSocketsNumber > 0 ) connection->socket = &(polledSocketsList[ freeSocketIndexesList[ --freeSocketsNumber ] ]);
+    else if( polledSocketsNumber < IP_MAX_SOCKETS_NUMBER ) connection->socket = &(polledSocketsList[ polledSocketsNumber++ ]);
+    else
+    {
+      IP_REPORT_ERROR( "socket %d: maximum number of polled sockets (%u) reached", socketFD, IP_MAX_SOCKETS_NUMBER );
+      close( socketFD );
+      System_FreeAligned( connection );
+      return NULL;
+    }
     connection->socket->fd = socketFD;
-    connection->socket->events = POLLRDNORM | POLLRDBAND;
-    polledSocketsNumber++;
-    qsort( polledSocketsList, polledSocketsNumber, sizeof(SocketPoller), CompareSockets );
+    connection->socket->events = POLLIN | POLLRDNORM | POLLRDBAND;          // Event descriptors (shared memory) only report POLLIN
+    connection->socket->revents = 0;
   }
   #else
-  connection->socket = (SocketPoller*) malloc( sizeof(SocketPoller) );
-  FD_SET( socketFD, &polledSocketsSet );
-  if( socketFD >= polledSocketsNumber ) polledSocketsNumber = socketFD + 1;
-  connection->socket->fd = socketFD;
+  else
+  {
+    connection->socket = (SocketPoller*) malloc( sizeof(SocketPoller) );
+    FD_SET( socketFD, &polledSocketsSet );
+    if( socketFD >= polledSocketsNumber ) polledSocketsNumber = socketFD + 1;
+    connection->socket->fd = socketFD;
+  }
   #endif
   
   connection->messageLength = IP_MAX_MESSAGE_LENGTH;
+  connection->type = transportProtocol | ( ( networkRole == IP_SERVER ) ? IP_SERVER : IP_CLIENT );
   
-  memcpy( &(connection->addressData), address, sizeof(IPAddressData) );
-  connection->ref_clientsCount = malloc( sizeof(size_t) );
+  memcpy( &(connection->info->addressData), address, sizeof(SocketAddressData) );
   
+  // Unix domain stream and datagram sockets are handled by the same methods as TCP and UDP ones
   if( networkRole == IP_SERVER ) // Server role connection
   {
-    connection->clientsList = NULL;
-    connection->ref_AcceptClient = ( transportProtocol == IP_TCP ) ? AcceptTCPClient : AcceptUDPClient;
+    connection->info->clientsList = NULL;
+    connection->ref_AcceptClient = IS_STREAM_TRANSPORT( transportProtocol ) ? AcceptTCPClient : AcceptUDPClient;
     connection->ref_SendMessage = SendMessageAll;
     if( transportProtocol == IP_UDP && IS_IP_MULTICAST_ADDRESS( address ) ) connection->ref_SendMessage = SendUDPMessage;
-    connection->ref_Close = ( transportProtocol == IP_TCP ) ? CloseTCPServer : CloseUDPServer;
-    *(connection->ref_clientsCount) = 0;
+    connection->info->ref_Close = IS_STREAM_TRANSPORT( transportProtocol ) ? CloseTCPServer : CloseUDPServer;
+    connection->info->clientsCount = 0;
   }
   else
   { 
-    //connection->address->sin6_family = AF_INET6;
-    connection->buffer = (char*) calloc( IP_MAX_MESSAGE_LENGTH, sizeof(char) );
-    connection->ref_ReceiveMessage = ( transportProtocol == IP_TCP ) ? ReceiveTCPMessage : ReceiveUDPMessage;
-    connection->ref_SendMessage = ( transportProtocol == IP_TCP ) ? SendTCPMessage : SendUDPMessage;
-    connection->ref_Close = ( transportProtocol == IP_TCP ) ? CloseTCPClient : CloseUDPClient;
-    connection->server = NULL;
+    connection->buffer = (char*) connection->info + sizeof(IPConnectionInfo);
+    connection->ref_ReceiveMessage = IS_STREAM_TRANSPORT( transportProtocol ) ? ReceiveTCPMessage : ReceiveUDPMessage;
+    connection->ref_SendMessage = IS_STREAM_TRANSPORT( transportProtocol ) ? SendTCPMessage : SendUDPMessage;
+    connection->info->ref_Close = IS_STREAM_TRANSPORT( transportProtocol ) ? CloseTCPClient : CloseUDPClient;
+    connection->info->server = NULL;
+  }
+  
+  // Shared memory connections are set up through a local stream socket, replaced by the rings wakeup event for clients
+  if( transportProtocol == IP_SHM )
+  {
+    if( networkRole == IP_SERVER ) 
+    {
+      connection->ref_AcceptClient = AcceptShmClient;
+      connection->info->ref_Close = CloseTCPServer;
+    }
+    else
+    {
+      connection->ref_ReceiveMessage = ReceiveShmMessage;
+      connection->ref_SendMessage = SendShmMessage;
+      connection->info->ref_Close = CloseShmClient;
+    }
   }
   
   return connection;
 }
 
+// Verifies if given address is of a client already added to the given server connection
+static inline bool IsClientAddress( IPConnection server, struct sockaddr_storage* address )
+{
+  size_t clientsNumber = server->info->clientsCount;
+  for( size_t clientIndex = 0; clientIndex < clientsNumber; clientIndex++ )
+  {
+    IPConnection client = server->info->clientsList[ clientIndex ];
+    if( client != NULL && ARE_EQUAL_ADDRESSES( &(client->info->addressData), address ) ) return true;
+  }
+  
+  return false;
+}
+
 // Add defined connection to the client list of the given server connection
 static inline void AddClient( IPConnection server, IPConnection client )
 {
   size_t clientIndex = 0, clientsListSize = 0;
   
-  client->server = server;
+  client->info->server = server;
   
-  size_t clientsNumber = *((size_t*) server->ref_clientsCount);
+  size_t clientsNumber = server->info->clientsCount;
   while( clientIndex < clientsNumber )
   {
     clientsListSize++;
-    if( server->clientsList[ clientIndex ] == NULL ) break;
+    if( server->info->clientsList[ clientIndex ] == NULL ) break;
     clientIndex++;      
   }
   
-  if( clientIndex == clientsListSize ) server->clientsList = (IPConnection*) realloc( server->clientsList, ( clientIndex + 1 ) * sizeof(IPConnection) );
+  if( clientIndex == clientsListSize ) server->info->clientsList = (IPConnection*) realloc( server->info->clientsList, ( clientIndex + 1 ) * sizeof(IPConnection) );
   
-  server->clientsList[ clientIndex ] = client;
+  server->info->clientsList[ clientIndex ] = client;
   
-  (*(server->ref_clientsCount))++;
+  server->info->clientsCount++;
 
   return;
 }
 
 IPAddress LoadAddressInfo( const char* host, const char* port, uint8_t networkRole )
 {
-  static IPAddressData addressData;
+  static SocketAddressData addressData;
   
   #ifdef WIN32
   static WSADATA wsa;
@@ -297,11 +500,11 @@ IPAddress LoadAddressInfo( const char* host, const char* port, uint8_t networkRo
   {
     if( WSAStartup( MAKEWORD( 2, 2 ), &wsa ) != 0 )
     {
-      fprintf( stderr, "%s: error initialiasing windows sockets: code: %d\n", __func__, WSAGetLastError() );
+      IP_REPORT_ERROR( "%s: error initialiasing windows sockets: code: %d", __func__, WSAGetLastError() );
       return NULL;
     }
     
-    fprintf( stderr, "%s: initialiasing windows sockets version: %d\n", __func__, wsa.wVersion );
+    IP_REPORT_ERROR( "%s: initialiasing windows sockets version: %d", __func__, wsa.wVersion );
   }
   #endif
   
@@ -324,7 +527,7 @@ IPAddress LoadAddressInfo( const char* host, const char* port, uint8_t networkRo
   int errorCode = 0;
   if( (errorCode = getaddrinfo( host, port, &hints, &hostsInfoList )) != 0 )
   {
-    fprintf( stderr, "getaddrinfo: error reading host info: %s", gai_strerror( errorCode ) );
+    IP_REPORT_ERROR( "getaddrinfo: error reading host info: %s", gai_strerror( errorCode ) );
     return NULL;
   }
   
@@ -343,15 +546,57 @@ IPAddress LoadAddressInfo( const char* host, const char* port, uint8_t networkRo
   
   if( hostInfo == NULL ) return NULL;
   #else
-  addressData.sin_family = AF_INET;   // IPv4 address
+  addressData.ip.sin_family = AF_INET;   // IPv4 address
   uint16_t portNumber = (uint16_t) strtoul( port, NULL, 0 );
-  addressData.sin_port = htons( portNumber );
-  if( host == NULL ) addressData.sin_addr.s_addr = INADDR_ANY;
-  else if( strcmp( host, "255.255.255.255" ) == 0 ) addressData.sin_addr.s_addr = INADDR_BROADCAST; 
-  else if ( (addressData.sin_addr.s_addr = inet_addr( host )) == INADDR_NONE ) return NULL;
+  addressData.ip.sin_port = htons( portNumber );
+  if( host == NULL ) addressData.ip.sin_addr.s_addr = INADDR_ANY;
+  else if( strcmp( host, "255.255.255.255" ) == 0 ) addressData.ip.sin_addr.s_addr = INADDR_BROADCAST; 
+  else if ( (addressData.ip.sin_addr.s_addr = inet_addr( host )) == INADDR_NONE ) return NULL;
+  #endif
+  
+  return (IPAddress) &addressData;
+}
+
+// Builds Unix domain socket address from a path, an abstract name ("@<name>", Linux only) or, for any other host string, the port number
+IPAddress LoadLocalAddress( const char* host, uint16_t port, uint8_t transportProtocol )
+{
+  const char* defaultName = ( transportProtocol == IP_SHM ) ? "async_ip_shm" : "async_ip";
+  
+  static SocketAddressData addressData;
+  
+  #ifndef WIN32
+  memset( &addressData, 0, sizeof(addressData) );
+  addressData.local.sun_family = AF_UNIX;
+  
+  if( host != NULL && ( host[ 0 ] == '/' || host[ 0 ] == '.' ) )
+  {
+    if( strlen( host ) >= LOCAL_PATH_LENGTH )
+    {
+      IP_REPORT_ERROR( "local socket path too long: %s", host );
+      return NULL;
+    }
+    strcpy( addressData.local.sun_path, host );
+  }
+  #ifdef __linux__
+  else if( host != NULL && host[ 0 ] == '@' )
+    strncpy( addressData.local.sun_path + 1, host + 1, LOCAL_PATH_LENGTH - 2 );
+  else // Default abstract name, so that IP hosts (e.g. "localhost") work unchanged
+    snprintf( addressData.local.sun_path + 1, LOCAL_PATH_LENGTH - 1, "%s.%u", defaultName, port );
+  #else
+  else if( host != NULL && host[ 0 ] == '@' )
+  {
+    IP_REPORT_ERROR( "abstract local socket names are not supported on this system: %s", host );
+    return NULL;
+  }
+  else // Default path, so that IP hosts (e.g. "localhost") work unchanged
+    snprintf( addressData.local.sun_path, LOCAL_PATH_LENGTH, "/tmp/%s.%u", defaultName, port );
   #endif
   
   return (IPAddress) &addressData;
+  #else
+  IP_REPORT_ERROR( "local (Unix domain) sockets are not supported on this system" );
+  return NULL;
+  #endif
 }
 
 int CreateSocket( uint8_t protocol, IPAddress address )
@@ -368,15 +613,23 @@ int CreateSocket( uint8_t protocol, IPAddress address )
     socketType = SOCK_DGRAM;
     transportProtocol = IPPROTO_UDP;
   }
+  else if( protocol == IP_UNIX_STREAM || protocol == IP_UNIX_DGRAM || protocol == IP_SHM ) 
+  {
+    socketType = ( protocol == IP_UNIX_DGRAM ) ? SOCK_DGRAM : SOCK_STREAM;
+    transportProtocol = 0;
+  }
   else
   {
     return INVALID_SOCKET;
   }
   
-  // Create IP socket
+  // Create IP or local socket
   int socketFD = socket( address->sa_family, socketType, transportProtocol );
   if( socketFD == INVALID_SOCKET )
-    fprintf( stderr, "socket: failed opening %s %s socket", ( protocol == IP_TCP ) ? "TCP" : "UDP", ( address->sa_family == AF_INET6 ) ? "IPv6" : "IPv4" );                                                              
+  {
+    if( IS_LOCAL_TRANSPORT( protocol ) ) IP_REPORT_ERROR( "socket: failed opening local %s socket", ( protocol == IP_UNIX_DGRAM ) ? "datagram" : "stream" );
+    else IP_REPORT_ERROR( "socket: failed opening %s %s socket", ( protocol == IP_TCP ) ? "TCP" : "UDP", ( address->sa_family == AF_INET6 ) ? "IPv6" : "IPv4" );
+  }
   
   return socketFD;
 }
@@ -390,7 +643,7 @@ bool SetSocketConfig( int socketFD )
   if( fcntl( socketFD, F_SETFL, O_NONBLOCK ) == SOCKET_ERROR )
   #endif
   {
-    fprintf( stderr, "failure setting socket %d to non-blocking state", socketFD );
+    IP_REPORT_ERROR( "failure setting socket %d to non-blocking state", socketFD );
     close( socketFD );
     return false;
   }
@@ -398,14 +651,38 @@ bool SetSocketConfig( int socketFD )
   int reuseAddress = 1; // Allow sockets to be binded to the same local port
   if( setsockopt( socketFD, SOL_SOCKET, SO_REUSEADDR, (const char*) &reuseAddress, sizeof(reuseAddress) ) == SOCKET_ERROR ) 
   {
-    fprintf( stderr, "setsockopt: failed setting socket %d option SO_REUSEADDR", socketFD );
+    IP_REPORT_ERROR( "setsockopt: failed setting socket %d option SO_REUSEADDR", socketFD );
     close( socketFD );
     return NULL;
   }
   
+  #ifdef SO_NOSIGPIPE
+  // Systems without MSG_NOSIGNAL (e.g. BSD) disable signals on writes to remotely closed sockets per socket (inherited by accepted ones)
+  int isSignalDisabled = 1;
+  if( setsockopt( socketFD, SOL_SOCKET, SO_NOSIGPIPE, (const char*) &isSignalDisabled, sizeof(isSignalDisabled) ) == SOCKET_ERROR ) 
+    IP_REPORT_ERROR( "setsockopt: failed setting socket %d option SO_NOSIGPIPE", socketFD );
+  #endif
+  
   return true;
 }
 
+#ifndef WIN32
+// Socket files are only replaced when left by a server no longer running, which refuses connections (live ones accept them or report busy)
+static bool IsStaleSocketFile( IPAddress address )
+{
+  struct stat fileInfo;
+  if( stat( ((struct sockaddr_un*) address)->sun_path, &fileInfo ) == -1 || !S_ISSOCK( fileInfo.st_mode ) ) return false;
+  
+  int testSocketFD = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if( testSocketFD == INVALID_SOCKET ) return false;
+  (void) fcntl( testSocketFD, F_SETFL, O_NONBLOCK );          // Full listening queues should not block the test
+  bool isStale = ( connect( testSocketFD, address, GetAddressLength( address ) ) == SOCKET_ERROR && errno == ECONNREFUSED );
+  close( testSocketFD );
+  
+  return isStale;
+}
+#endif
+
 bool BindServerSocket( int socketFD, IPAddress address )
 {
   if( address->sa_family == AF_INET6 )
@@ -413,17 +690,22 @@ bool BindServerSocket( int socketFD, IPAddress address )
     int ipv6Only = 0; // Let IPV6 servers accept IPV4 clients
     if( setsockopt( socketFD, IPPROTO_IPV6, IPV6_V6ONLY, (const char*) &ipv6Only, sizeof(ipv6Only) ) == SOCKET_ERROR )
     {
-      fprintf( stderr, "setsockopt: failed setting socket %d option IPV6_V6ONLY", socketFD );
+      IP_REPORT_ERROR( "setsockopt: failed setting socket %d option IPV6_V6ONLY", socketFD );
       close( socketFD );
       return false;
     }
   }
   
+  #ifndef WIN32
+  // Replace socket file left by a previous server on the same path (other files and running servers make binding fail)
+  if( address->sa_family == AF_UNIX && ((struct sockaddr_un*) address)->sun_path[ 0 ] != '\0' && IsStaleSocketFile( address ) ) 
+    unlink( ((struct sockaddr_un*) address)->sun_path );
+  #endif
+  
   // Bind server socket to the given local address
-  size_t addressLength = ( address->sa_family == AF_INET6 ) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
-  if( bind( socketFD, address, addressLength ) == SOCKET_ERROR )
+  if( bind( socketFD, address, GetAddressLength( address ) ) == SOCKET_ERROR )
   {
-    fprintf( stderr, "bind: failed on binding socket %d", socketFD );
+    IP_REPORT_ERROR( "bind: failed on binding socket %d", socketFD );
     close( socketFD );
     return false;
   }
@@ -440,7 +722,7 @@ bool BindTCPServerSocket( int socketFD, IPAddress address )
   // Set server socket to listen to remote connections
   if( listen( socketFD, QUEUE_SIZE ) == SOCKET_ERROR )
   {
-    fprintf( stderr, "listen: failed listening on socket %d", socketFD );
+    IP_REPORT_ERROR( "listen: failed listening on socket %d", socketFD );
     close( socketFD );
     return false;
   }
@@ -458,14 +740,14 @@ bool BindUDPServerSocket( int socketFD, IPAddress address )
   {
     if( setsockopt( socketFD, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (const char*) &multicastTTL, sizeof(multicastTTL)) != 0 ) 
     {
-      fprintf( stderr, "setsockopt: failed setting socket %d option IPV6_MULTICAST_HOPS", socketFD );
+      IP_REPORT_ERROR( "setsockopt: failed setting socket %d option IPV6_MULTICAST_HOPS", socketFD );
       close( socketFD );
       return false;
     }
     unsigned int interfaceIndex = 0; // 0 means default interface
     if( setsockopt( socketFD, IPPROTO_IPV6, IPV6_MULTICAST_IF, (const char*) &interfaceIndex, sizeof(interfaceIndex)) != 0 ) 
     {
-      fprintf( stderr, "setsockopt: failed setting socket %d option IPV6_MULTICAST_IF", socketFD );
+      IP_REPORT_ERROR( "setsockopt: failed setting socket %d option IPV6_MULTICAST_IF", socketFD );
       close( socketFD );
       return false;
     }
@@ -474,14 +756,14 @@ bool BindUDPServerSocket( int socketFD, IPAddress address )
   {
     if( setsockopt( socketFD, IPPROTO_IP, IP_MULTICAST_TTL, (const char*) &multicastTTL, sizeof(multicastTTL)) != 0 ) 
     {
-      fprintf( stderr, "setsockopt: failed setting socket %d option IP_MULTICAST_TTL", socketFD );
+      IP_REPORT_ERROR( "setsockopt: failed setting socket %d option IP_MULTICAST_TTL", socketFD );
       close( socketFD );
       return false;
     }
     in_addr_t interface = htonl( INADDR_ANY );
 	  if( setsockopt( socketFD, IPPROTO_IP, IP_MULTICAST_IF, (const char*) &interface, sizeof(interface)) != 0 ) 
     {
-      fprintf( stderr, "setsockopt: failed setting socket %d option IP_MULTICAST_IF", socketFD );
+      IP_REPORT_ERROR( "setsockopt: failed setting socket %d option IP_MULTICAST_IF", socketFD );
       close( socketFD );
       return false;
     }
@@ -490,7 +772,7 @@ bool BindUDPServerSocket( int socketFD, IPAddress address )
   int broadcast = 1; // Enable broadcast for IPv4 connections
   if( setsockopt( socketFD, SOL_SOCKET, SO_BROADCAST, (const char*) &broadcast, sizeof(broadcast) ) == SOCKET_ERROR )
   {
-    fprintf( stderr, "setsockopt: failed setting socket %d option SO_BROADCAST", socketFD );
+    IP_REPORT_ERROR( "setsockopt: failed setting socket %d option SO_BROADCAST", socketFD );
     close( socketFD );
     return false;
   }
@@ -499,13 +781,41 @@ bool BindUDPServerSocket( int socketFD, IPAddress address )
   return true;
 }
 
+// Wait for completion of a connection attempt started on a non-blocking socket
+static bool WaitSocketConnection( int socketFD )
+{
+  const int CONNECTION_TIMEOUT_MS = 5000;
+
+  #ifdef WIN32
+  if( WSAGetLastError() != WSAEWOULDBLOCK ) return false;
+  #else
+  if( errno != EINPROGRESS ) return false;
+  #endif
+
+  #ifndef IP_NETWORK_LEGACY
+  SocketPoller connectionPoller = { .fd = socketFD, .events = POLLOUT };
+  if( poll( &connectionPoller, 1, CONNECTION_TIMEOUT_MS ) <= 0 ) return false;
+  #else
+  fd_set connectionSet;
+  FD_ZERO( &connectionSet );
+  FD_SET( socketFD, &connectionSet );
+  struct timeval waitTime = { .tv_sec = CONNECTION_TIMEOUT_MS / 1000 };
+  if( select( socketFD + 1, NULL, &connectionSet, NULL, &waitTime ) <= 0 ) return false;
+  #endif
+
+  int connectionError = 0;
+  socklen_t errorLength = sizeof(connectionError);
+  if( getsockopt( socketFD, SOL_SOCKET, SO_ERROR, (char*) &connectionError, &errorLength ) == SOCKET_ERROR ) return false;
+
+  return ( connectionError == 0 );
+}
+
 bool ConnectTCPClientSocket( int socketFD, IPAddress address )
 {
-  // Connect TCP client socket to given remote address
-  size_t addressLength = ( address->sa_family == AF_INET6 ) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
-  if( connect( socketFD, address, addressLength ) == SOCKET_ERROR )
+  // Connect TCP (or local stream) client socket to given remote address (non-blocking sockets report completion later)
+  if( connect( socketFD, address, GetAddressLength( address ) ) == SOCKET_ERROR && !WaitSocketConnection( socketFD ) )
   {
-    fprintf( stderr, "connect: failed on connecting socket %d to remote address", socketFD );
+    IP_REPORT_ERROR( "connect: failed on connecting socket %d to remote address", socketFD );
     close( socketFD );
     return false;
   }
@@ -520,7 +830,7 @@ bool ConnectUDPClientSocket( int socketFD, IPAddress address )
   localAddress.ss_family = address->sa_family;
   if( bind( socketFD, (struct sockaddr*) &localAddress, sizeof(localAddress) ) == SOCKET_ERROR )
   {
-    fprintf( stderr, "bind: failed on binding socket %d to arbitrary local port", socketFD );
+    IP_REPORT_ERROR( "bind: failed on binding socket %d to arbitrary local port", socketFD );
     close( socketFD );
     return false;
   }
@@ -539,7 +849,7 @@ bool ConnectUDPClientSocket( int socketFD, IPAddress address )
       // Join the multicast address
       if ( setsockopt( socketFD, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, (char*) &multicastRequest, sizeof(multicastRequest) ) != 0 ) 
       {
-        fprintf( stderr, "setsockopt: failed setting socket %d option IPV6_ADD_MEMBERSHIP", socketFD );
+        IP_REPORT_ERROR( "setsockopt: failed setting socket %d option IPV6_ADD_MEMBERSHIP", socketFD );
         close( socketFD );
         return false;
       }
@@ -557,7 +867,7 @@ bool ConnectUDPClientSocket( int socketFD, IPAddress address )
       // Join the multicast address
       if( setsockopt( socketFD, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*) &multicastRequest, sizeof(multicastRequest)) != 0 ) 
       {
-        fprintf( stderr, "setsockopt: failed setting socket %d option IP_ADD_MEMBERSHIP", socketFD );
+        IP_REPORT_ERROR( "setsockopt: failed setting socket %d option IP_ADD_MEMBERSHIP", socketFD );
         close( socketFD );
         return false;
       }
@@ -568,21 +878,72 @@ bool ConnectUDPClientSocket( int socketFD, IPAddress address )
   return true;
 }
 
+bool ConnectLocalDatagramClientSocket( int socketFD, IPAddress address )
+{
+  #ifndef WIN32
+  // Bind local datagram client socket to an unique name, so that servers can tell clients apart and reply
+  struct sockaddr_un localAddress = { .sun_family = AF_UNIX };
+  #ifdef __linux__
+  socklen_t addressLength = sizeof(sa_family_t);      // Automatically chosen abstract name
+  #else
+  snprintf( localAddress.sun_path, LOCAL_PATH_LENGTH, "/tmp/async_ip.%d.%d", (int) getpid(), socketFD );
+  unlink( localAddress.sun_path );
+  socklen_t addressLength = GetAddressLength( (IPAddress) &localAddress );
+  #endif
+  if( bind( socketFD, (struct sockaddr*) &localAddress, addressLength ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "bind: failed on binding socket %d to arbitrary local name", socketFD );
+    close( socketFD );
+    return false;
+  }
+  #endif
+  
+  return true;
+}
+
+// Hands connected control socket of a shared memory client to its rings, polled through their wakeup descriptor
+static IPConnection AddShmClient( int controlSocketFD, IPAddress address )
+{
+  IPShmChannel* channel = IPShm_Connect( controlSocketFD );
+  if( channel == NULL )
+  {
+    close( controlSocketFD );
+    return NULL;
+  }
+  
+  IPConnection client = AddConnection( IPShm_GetEventDescriptor( channel ), address, IP_SHM, IP_CLIENT, NULL );
+  if( client == NULL )
+  {
+    IPShm_Close( channel );
+    return NULL;
+  }
+  client->info->sharedChannel = channel;
+  
+  return client;
+}
+
 // Generic method for opening a new socket and providing a corresponding IPConnection structure for use
 IPConnection IP_OpenConnection( uint8_t connectionType, const char* host, uint16_t port )
 {
-  const uint8_t TRANSPORT_MASK = 0xF0, ROLE_MASK = 0x0F;
   static char portString[ PORT_LENGTH ];
   
-  // Assure that the port number is in the Dynamic/Private range (49152-65535)
-  if( port < 49152 /*|| port > 65535*/ )
+  IPAddress address = NULL;
+  if( IS_LOCAL_TRANSPORT( connectionType & TRANSPORT_MASK ) )
   {
-    fprintf( stderr, "invalid port number value: %u", port );
-    return NULL;
+    address = LoadLocalAddress( host, port, ( connectionType & TRANSPORT_MASK ) );
+  }
+  else
+  {
+    // Assure that the port number is in the Dynamic/Private range (49152-65535)
+    if( port < 49152 /*|| port > 65535*/ )
+    {
+      IP_REPORT_ERROR( "invalid port number value: %u", port );
+      return NULL;
+    }
+    
+    sprintf( portString, "%u", port );
+    address = LoadAddressInfo( host, portString, (connectionType & ROLE_MASK) );
   }
-  
-  sprintf( portString, "%u", port );
-  IPAddress address = LoadAddressInfo( host, portString, (connectionType & ROLE_MASK) );
   if( address == NULL ) return NULL;
   
   Socket socketFD = CreateSocket( (connectionType & TRANSPORT_MASK), address );
@@ -600,110 +961,1041 @@ IPConnection IP_OpenConnection( uint8_t connectionType, const char* host, uint16
       break;
     case( IP_UDP | IP_CLIENT ): if( !ConnectUDPClientSocket( socketFD, address ) ) return NULL;
       break;
-    default: fprintf( stderr, "invalid connection type: %x", connectionType );
+    case( IP_UNIX_STREAM | IP_SERVER ): if( !BindTCPServerSocket( socketFD, address ) ) return NULL;
+      break;
+    case( IP_UNIX_DGRAM | IP_SERVER ): if( !BindServerSocket( socketFD, address ) ) return NULL;
+      break;
+    case( IP_UNIX_STREAM | IP_CLIENT ): if( !ConnectTCPClientSocket( socketFD, address ) ) return NULL;
+      break;
+    case( IP_UNIX_DGRAM | IP_CLIENT ): if( !ConnectLocalDatagramClientSocket( socketFD, address ) ) return NULL;
+      break;
+    case( IP_SHM | IP_SERVER ): if( !BindTCPServerSocket( socketFD, address ) ) return NULL;
+      break;
+    case( IP_SHM | IP_CLIENT ): if( !ConnectTCPClientSocket( socketFD, address ) ) return NULL;
+      return AddShmClient( socketFD, address );
+    default: IP_REPORT_ERROR( "invalid connection type: %x", connectionType );
       return NULL;
   } 
   
-  return AddConnection( socketFD, address, (connectionType & TRANSPORT_MASK), (connectionType & ROLE_MASK) ); // Build the IPConnection structure
-}
-
-size_t IP_SetMessageLength( IPConnection connection, size_t messageLength )
-{
-  if( connection == NULL ) return 0;
+  IPConnection connection = AddConnection( socketFD, address, (connectionType & TRANSPORT_MASK), (connectionType & ROLE_MASK), NULL ); // Build the IPConnection structure
+  if( connection == NULL ) return NULL;
   
-  connection->messageLength = ( messageLength > IP_MAX_MESSAGE_LENGTH ) ? IP_MAX_MESSAGE_LENGTH : (uint16_t) messageLength;
+  // Kept for filters verifying the remote peer (e.g. TLS certificate names)
+  if( connectionType == ( IP_TCP | IP_CLIENT ) && host != NULL ) 
+    strncpy( connection->info->hostName, host, HOST_NAME_LENGTH - 1 );
   
-  return (size_t) connection->messageLength;
+  return connection;
 }
 
+// Tells if the stream filter of the given connection holds received data not signaled by socket polling
+static inline bool IsFilterPending( IPConnectionInfo* info )
+{
+  return ( info->filter.ref_HasPending != NULL && info->filterState != NULL && info->filter.ref_HasPending( info->filterState ) );
+}
 
-/////////////////////////////////////////////////////////////////////////////////////////
-/////                             GENERIC COMMUNICATION                             /////
-/////////////////////////////////////////////////////////////////////////////////////////
+// Keeps count of connections with data left in their filters after receiving, so that polling does not wait for them
+static void UpdateFilterPending( IPConnection connection )
+{
+  bool wasPending = ( connection->receiveFlags & RECEIVE_FILTER_PENDING );
+  bool isPending = IsFilterPending( connection->info );
+  if( isPending && !wasPending ) ATOMIC_FETCH_ADD( &pendingFiltersCount, 1 );
+  else if( !isPending && wasPending ) ATOMIC_FETCH_SUB( &pendingFiltersCount, 1 );
+  if( isPending ) connection->receiveFlags |= RECEIVE_FILTER_PENDING;
+  else connection->receiveFlags &= ~RECEIVE_FILTER_PENDING;
+}
 
-char* IP_ReceiveMessage( IPConnection connection ) 
-{ 
-  memset( connection->buffer, 0, IP_MAX_MESSAGE_LENGTH );
+// Releases stream filter state of the given connection (if opened), dropping its data left
+static void CloseStreamFilter( IPConnection connection )
+{
+  if( connection->receiveFlags & RECEIVE_FILTER_PENDING ) ATOMIC_FETCH_SUB( &pendingFiltersCount, 1 );
+  connection->receiveFlags &= ~RECEIVE_FILTER_PENDING;
   
-  return connection->ref_ReceiveMessage( connection ); 
+  if( connection->info->filterState == NULL ) return;
+  
+  connection->info->filter.ref_Close( connection->info->filterState );
+  connection->info->filterState = NULL;
 }
 
-int IP_SendMessage( IPConnection connection, const char* message ) 
-{ 
-  if( strlen( message ) + 1 > connection->messageLength )
+// Creates stream filter state for the given TCP client connection, replacing its transmission methods
+static bool OpenStreamFilter( IPConnection connection, const IPStreamFilter* filter, bool isServerSide )
+{
+  const char* host = ( connection->info->hostName[ 0 ] != '\0' ) ? connection->info->hostName : NULL;
+  void* filterState = filter->ref_Open( filter->settings, (intptr_t) connection->socket->fd, isServerSide, host );
+  if( filterState == NULL )
   {
-    fprintf( stderr, "message too long (%lu bytes for %lu max) !", strlen( message ), connection->messageLength );
-    return 0;
+    IP_REPORT_ERROR( "failed opening stream filter on socket %d", connection->socket->fd );
+    return false;
   }
   
-  //DEBUG_PRINT( "connection socket %d sending message: %s", connection->socket->fd, message );
+  connection->info->filter = *filter;
+  connection->info->filterState = filterState;
   
-  return connection->ref_SendMessage( connection, message ); 
-}
-
-IPConnection IP_AcceptClient( IPConnection connection ) { return connection->ref_AcceptClient( connection ); }
-
-// Verify available incoming messages for the given connection, preventing unnecessary blocking calls (for syncronous networking)
-int IP_WaitEvent( unsigned int milliseconds )
-{
-  #ifndef IP_NETWORK_LEGACY
-  int eventsNumber = poll( polledSocketsList, polledSocketsNumber, milliseconds );
-  #else
-  struct timeval waitTime = { .tv_sec = milliseconds / 1000, .tv_usec = ( milliseconds % 1000 ) * 1000 };
-  activeSocketsSet = polledSocketsSet;
-  int eventsNumber = select( polledSocketsNumber, &activeSocketsSet, NULL, NULL, &waitTime );
-  #endif
-  if( eventsNumber == SOCKET_ERROR ) fprintf( stderr, "select: error waiting for events on %lu FDs", polledSocketsNumber );
+  connection->ref_ReceiveMessage = ReceiveFilteredMessage;
+  connection->ref_SendMessage = SendFilteredMessage;
   
-  return eventsNumber;
+  return true;
 }
 
-bool IP_IsDataAvailable( IPConnection connection )
+bool IP_CheckStreamFilter( IPConnection connection )
 {
   if( connection == NULL ) return false;
   
-  #ifndef IP_NETWORK_LEGACY
-  if( connection->socket->revents & POLLRDNORM ) return true;
-  else if( connection->socket->revents & POLLRDBAND ) return true;
-  #else
-  if( FD_ISSET( connection->socket->fd, &activeSocketsSet ) ) return true;
-  #endif
+  if( connection->socket->fd == INVALID_SOCKET ) return false;
+  
+  IPConnectionInfo* info = connection->info;
+  if( info->filter.ref_IsExpired == NULL || info->filterState == NULL ) return true;
+  if( !info->filter.ref_IsExpired( info->filterState ) ) return true;
+  
+  IP_REPORT_ERROR( "stream filter of socket %d expired, closing connection", connection->socket->fd );
+  InvalidateSocket( connection->socket );
   
   return false;
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////
-/////                      SPECIFIC TRANSPORT/ROLE COMMUNICATION                    /////
-/////////////////////////////////////////////////////////////////////////////////////////
-
-static inline void RemoveSocket( Socket );
-
-// Try to receive incoming message from the given TCP client connection and store it on its buffer
-static char* ReceiveTCPMessage( IPConnection connection )
+bool IP_SetStreamFilter( IPConnection connection, const IPStreamFilter* filter )
 {
-  int bytesReceived;
+  if( connection == NULL || filter == NULL ) return false;
   
-  if( connection->socket->fd == INVALID_SOCKET ) return NULL;
-
-  // Blocks until there is something to be read in the socket
-  bytesReceived = recv( connection->socket->fd, connection->buffer, connection->messageLength, 0 );
-
-  if( bytesReceived == SOCKET_ERROR )
+  if( !IS_STREAM_TRANSPORT( connection->type ) )
   {
-    fprintf( stderr, "recv: error reading from socket %d", connection->socket->fd );
-    //connection->socket->fd = INVALID_SOCKET;
-    //RemoveSocket( connection->socket->fd );
-    return NULL;
+    IP_REPORT_ERROR( "stream filters are only available for stream (TCP or local) connections (socket %d)", connection->socket->fd );
+    return false;
   }
-  else if( bytesReceived == 0 )
+  
+  if( connection->info->filter.ref_Open != NULL )
   {
-    fprintf( stderr, "recv: remote connection with socket %d closed", connection->socket->fd );
-    //connection->socket->fd = INVALID_SOCKET;
-    RemoveSocket( connection->socket->fd );
+    IP_REPORT_ERROR( "stream filter already defined for socket %d", connection->socket->fd );
+    return false;
+  }
+  
+  if( filter->ref_Open == NULL || filter->ref_Send == NULL || filter->ref_Receive == NULL || filter->ref_Close == NULL ) return false;
+  
+  // Server clients are filtered on acceptance
+  if( connection->type & IP_SERVER )
+  {
+    connection->info->filter = *filter;
+    return true;
+  }
+  
+  return OpenStreamFilter( connection, filter, false );
+}
+
+bool IP_ShutdownSending( IPConnection connection )
+{
+  if( connection == NULL ) return false;
+  
+  if( !IS_STREAM_TRANSPORT( connection->type ) || ( connection->type & IP_SERVER ) || connection->socket->fd == INVALID_SOCKET ) return false;
+  
+  if( shutdown( connection->socket->fd, SHUT_WR ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "shutdown: failed closing sending side of socket %d", connection->socket->fd );
+    return false;
+  }
+  
+  return true;
+}
+
+bool IP_CorkSending( IPConnection connection, bool isCorked )
+{
+  if( connection == NULL ) return false;
+  
+  if( ( connection->type & TRANSPORT_MASK ) != IP_TCP || ( connection->type & IP_SERVER ) || connection->socket->fd == INVALID_SOCKET ) return false;
+  
+  // Partial segments are held while corked, and sent right away when uncorked
+#if defined(TCP_CORK)
+  int corkOption = TCP_CORK;
+#elif defined(TCP_NOPUSH)
+  int corkOption = TCP_NOPUSH;
+#else
+  return false;
+#endif
+#if defined(TCP_CORK) || defined(TCP_NOPUSH)
+  int isEnabled = isCorked ? 1 : 0;
+  if( setsockopt( connection->socket->fd, IPPROTO_TCP, corkOption, (const char*) &isEnabled, sizeof(isEnabled) ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "setsockopt: failed setting cork option of socket %d", connection->socket->fd );
+    return false;
+  }
+  
+  return true;
+#endif
+}
+
+#define FILE_COPY_LENGTH 16384                                  // Maximum length of file data copied per call where kernel transfer is not available
+
+// Sends file data through the given connection socket (or filter) by reading it to user space first
+static long CopyFileData( IPConnection connection, int fileDescriptor, uint64_t offset, size_t length )
+{
+#ifdef WIN32
+  IP_REPORT_ERROR( "file sending is not supported on this platform" );
+  return -1;
+#else
+  char fileData[ FILE_COPY_LENGTH ];
+  
+  IPConnectionInfo* info = connection->info;
+  if( length > FILE_COPY_LENGTH ) length = FILE_COPY_LENGTH;
+  // Data is only read as far as the filter takes it in a single call
+  if( info->filter.ref_Send != NULL && info->filter.maxSendLength > 0 && length > info->filter.maxSendLength ) length = info->filter.maxSendLength;
+  
+  ssize_t bytesRead = pread( fileDescriptor, fileData, length, (off_t) offset );
+  if( bytesRead <= 0 )
+  {
+    IP_REPORT_ERROR( "pread: failed reading %lu bytes from file %d at offset %lu", (unsigned long) length, fileDescriptor, (unsigned long) offset );
+    return -1;
+  }
+  
+  if( info->filter.ref_Send != NULL )
+  {
+    if( info->filterState == NULL ) return -1;    // Filter not reopened after failed reconnection
+    // Filters send (and transform) the whole given data, once ready
+    int sendResult = info->filter.ref_Send( info->filterState, fileData, bytesRead );
+    if( sendResult == 0 ) return 0;
+    else if( sendResult < (int) bytesRead ) 
+    {
+      IP_REPORT_ERROR( "send: error writing filtered file data to socket %d", connection->socket->fd );
+      return -1;
+    }
+    return (long) bytesRead;
+  }
+  
+  ssize_t bytesSent = send( connection->socket->fd, fileData, bytesRead, MSG_NOSIGNAL );
+  if( bytesSent == SOCKET_ERROR )
+  {
+    if( errno == EAGAIN || errno == EWOULDBLOCK ) return 0;
+    IP_REPORT_ERROR( "send: error writing file data to socket %d", connection->socket->fd );
+    return -1;
+  }
+  
+  IP_TRACE( SEND, connection->socket->fd, (size_t) bytesSent );
+  
+  return (long) bytesSent;
+#endif
+}
+
+long IP_SendFile( IPConnection connection, int fileDescriptor, uint64_t offset, size_t length )
+{
+  if( connection == NULL ) return -1;
+  
+  if( !IS_STREAM_TRANSPORT( connection->type ) || ( connection->type & IP_SERVER ) )
+  {
+    IP_REPORT_ERROR( "file data can only be sent through stream client connections" );
+    return -1;
+  }
+  
+  if( connection->socket->fd == INVALID_SOCKET ) return -1;
+  
+  if( length == 0 ) return 0;
+  
+  // Filtered (encrypted or compressed) data has to pass through user space, unless the kernel transforms it (e.g. kTLS)
+  IPConnectionInfo* info = connection->info;
+  if( info->filter.ref_Send != NULL )
+  {
+    bool isOffloaded = ( info->filter.ref_IsOffloaded != NULL && info->filterState != NULL && info->filter.ref_IsOffloaded( info->filterState ) );
+    if( !isOffloaded ) return CopyFileData( connection, fileDescriptor, offset, length );
+  }
+  
+#ifdef __linux__
+  // Data is moved by the kernel from page cache to socket buffers, without user space copies
+  off_t fileOffset = (off_t) offset;
+  ssize_t bytesSent = sendfile( connection->socket->fd, fileDescriptor, &fileOffset, length );
+  // Pipes and other descriptors without page cache support are spliced instead (ignoring offset)
+  if( bytesSent == SOCKET_ERROR && errno == EINVAL )
+    bytesSent = splice( fileDescriptor, NULL, connection->socket->fd, NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+  
+  if( bytesSent == SOCKET_ERROR )
+  {
+    if( errno == EAGAIN || errno == EWOULDBLOCK ) return 0;
+    IP_REPORT_ERROR( "sendfile: error writing file %d data to socket %d", fileDescriptor, connection->socket->fd );
+    return -1;
+  }
+  else if( bytesSent == 0 )
+  {
+    IP_REPORT_ERROR( "sendfile: end of file %d reached before offset %lu", fileDescriptor, (unsigned long) offset );
+    return -1;
+  }
+  
+  IP_TRACE( SEND, connection->socket->fd, (size_t) bytesSent );
+  
+  return (long) bytesSent;
+#else
+  return CopyFileData( connection, fileDescriptor, offset, length );
+#endif
+}
+
+// Zero-copy sending is only defined for client connections with their own (unfiltered) TCP or UDP socket
+static inline bool IsZeroCopyAllowed( IPConnection connection )
+{
+  uint8_t transportProtocol = connection->type & TRANSPORT_MASK;
+  if( transportProtocol != IP_TCP && transportProtocol != IP_UDP ) return false;
+  if( ( connection->type & IP_SERVER ) || connection->info->filter.ref_Send != NULL ) return false;
+  if( transportProtocol == IP_UDP && connection->info->server != NULL ) return false;    // Socket shared with server
+  return ( connection->socket->fd != INVALID_SOCKET );
+}
+
+bool IP_EnableZeroCopy( IPConnection connection )
+{
+  if( connection == NULL ) return false;
+  
+  if( !IsZeroCopyAllowed( connection ) )
+  {
+    IP_REPORT_ERROR( "zero-copy sending is only available for unfiltered TCP or UDP client connections" );
+    return false;
+  }
+  
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  int isEnabled = 1;
+  if( setsockopt( connection->socket->fd, SOL_SOCKET, SO_ZEROCOPY, (const char*) &isEnabled, sizeof(isEnabled) ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "setsockopt: failed enabling zero-copy sending on socket %d", connection->socket->fd );
+    return false;
+  }
+  
+  return true;
+#else
+  IP_REPORT_ERROR( "zero-copy sending is not supported on this platform" );
+  return false;
+#endif
+}
+
+bool IP_SetAbortiveClose( IPConnection connection )
+{
+  if( connection == NULL ) return false;
+  
+  if( ( connection->type & IP_SERVER ) || !( connection->type & IP_TCP ) || connection->socket->fd == INVALID_SOCKET ) return false;
+  
+  // Closing with zero linger time resets the connection and purges its send queue, even after shutdown
+  struct linger lingerOption = { .l_onoff = 1, .l_linger = 0 };
+  if( setsockopt( connection->socket->fd, SOL_SOCKET, SO_LINGER, (const char*) &lingerOption, sizeof(lingerOption) ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "setsockopt: failed setting linger option of socket %d", connection->socket->fd );
+    return false;
+  }
+  
+  return true;
+}
+
+long IP_SendBuffer( IPConnection connection, const void* buffer, size_t length, bool isZeroCopy )
+{
+  if( connection == NULL || buffer == NULL ) return -1;
+  
+  uint8_t transportProtocol = connection->type & TRANSPORT_MASK;
+  if( ( connection->type & IP_SERVER ) || ( transportProtocol != IP_TCP && transportProtocol != IP_UDP ) )
+  {
+    IP_REPORT_ERROR( "buffers can only be sent through TCP or UDP client connections" );
+    return -1;
+  }
+  
+  if( connection->socket->fd == INVALID_SOCKET ) return -1;
+  
+  IPConnectionInfo* info = connection->info;
+  if( info->filter.ref_Send != NULL )
+  {
+    if( info->filterState == NULL ) return -1;    // Filter not reopened after failed reconnection
+    // Longer stream data is sent partially, as without filters
+    if( info->filter.maxSendLength > 0 && length > info->filter.maxSendLength ) length = info->filter.maxSendLength;
+    int sendResult = info->filter.ref_Send( info->filterState, (const char*) buffer, length );
+    if( sendResult == 0 ) return 0;
+    else if( sendResult < (int) length ) 
+    {
+      IP_REPORT_ERROR( "send: error writing filtered buffer to socket %d", connection->socket->fd );
+      return -1;
+    }
+    return (long) length;
+  }
+  
+  int sendFlags = MSG_NOSIGNAL;
+#ifdef MSG_ZEROCOPY
+  // Pages of the given buffer are referenced by the kernel until completion is read with IP_ReadZeroCopyCompletion()
+  if( isZeroCopy && IsZeroCopyAllowed( connection ) ) sendFlags |= MSG_ZEROCOPY;
+#endif
+  
+  ssize_t bytesSent;
+  if( transportProtocol == IP_TCP ) 
+    bytesSent = send( connection->socket->fd, buffer, length, sendFlags );
+  else
+    bytesSent = sendto( connection->socket->fd, buffer, length, sendFlags, (IPAddress) &(info->addressData), GetAddressLength( (IPAddress) &(info->addressData) ) );
+  
+  if( bytesSent == SOCKET_ERROR )
+  {
+#ifndef WIN32
+    // Zero-copy sends may also be refused while there are too many completions to be read
+    if( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ) return 0;
+#endif
+    IP_REPORT_ERROR( "send: error writing buffer to socket %d", connection->socket->fd );
+    return -1;
+  }
+  
+  IP_TRACE( SEND, connection->socket->fd, (size_t) bytesSent );
+  
+  return (long) bytesSent;
+}
+
+int IP_ReadZeroCopyCompletion( IPConnection connection, uint32_t* ref_firstID, uint32_t* ref_lastID )
+{
+  if( connection == NULL || connection->socket->fd == INVALID_SOCKET ) return -1;
+  
+#if defined(__linux__) && defined(SO_EE_ORIGIN_ZEROCOPY)
+  char controlData[ 128 ];
+  
+  while( true )
+  {
+    struct msghdr message = { .msg_control = controlData, .msg_controllen = sizeof(controlData) };
+    if( recvmsg( connection->socket->fd, &message, MSG_ERRQUEUE ) == SOCKET_ERROR )
+    {
+      if( errno == EAGAIN || errno == EWOULDBLOCK ) return 0;
+      IP_REPORT_ERROR( "recvmsg: error reading error queue of socket %d", connection->socket->fd );
+      return -1;
+    }
+    
+    // Other queued errors are skipped
+    for( struct cmsghdr* controlMessage = CMSG_FIRSTHDR( &message ); controlMessage != NULL; controlMessage = CMSG_NXTHDR( &message, controlMessage ) )
+    {
+      if( !( controlMessage->cmsg_level == SOL_IP && controlMessage->cmsg_type == IP_RECVERR ) &&
+          !( controlMessage->cmsg_level == SOL_IPV6 && controlMessage->cmsg_type == IPV6_RECVERR ) ) continue;
+      
+      struct sock_extended_err* error = (struct sock_extended_err*) CMSG_DATA( controlMessage );
+      if( error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY ) continue;
+      
+      // Completed sends are numbered in sending order, starting from 0, and notified in (possibly merged) ranges
+      *ref_firstID = error->ee_info;
+      *ref_lastID = error->ee_data;
+      return 1;
+    }
+  }
+#else
+  return 0;
+#endif
+}
+
+// Maps window of given bulk receiving connection to its socket, for received pages to be mapped there (if supported)
+static void MapBulkWindow( IPConnection connection )
+{
+  IPConnectionInfo* info = connection->info;
+#ifdef TCP_ZEROCOPY_RECEIVE
+  if( info->filter.ref_Receive != NULL || connection->socket->fd == INVALID_SOCKET ) return;
+  
+  void* window = mmap( NULL, info->bulkLength, PROT_READ, MAP_SHARED, connection->socket->fd, 0 );
+  info->bulkWindow = ( window != MAP_FAILED ) ? (char*) window : NULL;    // Data is only copied where sockets cannot be mapped
+#else
+  info->bulkWindow = NULL;
+#endif
+}
+
+static void UnmapBulkWindow( IPConnection connection )
+{
+  IPConnectionInfo* info = connection->info;
+#ifdef TCP_ZEROCOPY_RECEIVE
+  if( info->bulkWindow != NULL ) munmap( info->bulkWindow, info->bulkLength );
+#endif
+  info->bulkWindow = NULL;
+}
+
+bool IP_SetBulkReceive( IPConnection connection, size_t windowLength )
+{
+  if( connection == NULL ) return false;
+  
+  if( ( connection->type & TRANSPORT_MASK ) != IP_TCP || ( connection->type & IP_SERVER ) )
+  {
+    IP_REPORT_ERROR( "bulk receiving is only available for TCP client connections" );
+    return false;
+  }
+  
+  IPConnectionInfo* info = connection->info;
+  UnmapBulkWindow( connection );
+  free( info->bulkBuffer );
+  info->bulkBuffer = NULL;
+  info->bulkLength = 0;
+  connection->receiveFlags &= ~RECEIVE_BULK;
+  
+  if( windowLength == 0 )
+  {
+    SetSocketPolling( connection->socket, true );
+    return true;
+  }
+  
+  // Only whole pages can be mapped
+#ifndef WIN32
+  size_t pageLength = (size_t) sysconf( _SC_PAGESIZE );
+#else
+  size_t pageLength = 4096;
+#endif
+  info->bulkLength = ( ( windowLength + pageLength - 1 ) / pageLength ) * pageLength;
+  info->bulkBuffer = (char*) malloc( info->bulkLength );
+  if( info->bulkBuffer == NULL )
+  {
+    IP_REPORT_ERROR( "failed allocating %lu bytes for bulk receiving on socket %d", (unsigned long) info->bulkLength, connection->socket->fd );
+    info->bulkLength = 0;
+    return false;
+  }
+  
+  MapBulkWindow( connection );
+  connection->receiveFlags |= RECEIVE_BULK;
+  // Data is waited for and received by the application, instead of IP_WaitEvent() and IP_ReceiveMessage() callers
+  SetSocketPolling( connection->socket, false );
+  
+  return true;
+}
+
+const void* IP_ReceiveBulk( IPConnection connection, size_t* ref_length, unsigned int timeout )
+{
+  if( ref_length == NULL ) return NULL;
+  *ref_length = 0;
+  
+  if( connection == NULL ) return NULL;
+  
+  IPConnectionInfo* info = connection->info;
+  if( info->bulkBuffer == NULL )
+  {
+    IP_REPORT_ERROR( "bulk receiving is not enabled for socket %d", connection->socket->fd );
+    return NULL;
+  }
+  
+  Socket socketFD = connection->socket->fd;
+  if( socketFD == INVALID_SOCKET ) return NULL;
+  
+  // Data left in the filter is read without waiting for the socket
+  if( !IsFilterPending( info ) )
+  {
+    #ifndef IP_NETWORK_LEGACY
+    SocketPoller poller = { .fd = socketFD, .events = POLLIN };
+    if( poll( &poller, 1, timeout ) <= 0 ) return NULL;
+    #else
+    struct timeval waitTime = { .tv_sec = timeout / 1000, .tv_usec = ( timeout % 1000 ) * 1000 };
+    fd_set readSocketsSet;
+    FD_ZERO( &readSocketsSet );
+    FD_SET( socketFD, &readSocketsSet );
+    if( select( socketFD + 1, &readSocketsSet, NULL, NULL, &waitTime ) <= 0 ) return NULL;
+    #endif
+  }
+  
+  size_t copyLength = info->bulkLength;
+#ifdef TCP_ZEROCOPY_RECEIVE
+  if( info->bulkWindow != NULL )
+  {
+    // Previously mapped pages are replaced, and whole received pages are mapped to the window
+    struct tcp_zerocopy_receive zeroCopy = { .address = (uint64_t) (uintptr_t) info->bulkWindow, .length = (uint32_t) info->bulkLength };
+    socklen_t optionLength = sizeof(zeroCopy);
+    if( getsockopt( socketFD, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zeroCopy, &optionLength ) == SOCKET_ERROR ) 
+      UnmapBulkWindow( connection );    // Not supported by the kernel, always copying from now on
+    else if( zeroCopy.length > 0 )
+    {
+      IP_TRACE( RECEIVE, socketFD, zeroCopy.length );
+      *ref_length = zeroCopy.length;
+      return info->bulkWindow;
+    }
+    // Data not filling whole (aligned) pages is copied
+    else if( zeroCopy.recv_skip_hint > 0 && zeroCopy.recv_skip_hint < copyLength ) copyLength = zeroCopy.recv_skip_hint;
+  }
+#endif
+  
+  long bytesReceived;
+  if( info->filter.ref_Receive != NULL )
+    bytesReceived = ( info->filterState != NULL ) ? info->filter.ref_Receive( info->filterState, info->bulkBuffer, copyLength ) : -1;
+  else
+    bytesReceived = recv( socketFD, info->bulkBuffer, copyLength, 0 );
+  
+  if( bytesReceived == 0 )
+  {
+    IP_REPORT_ERROR( "recv: remote connection with socket %d closed", socketFD );
+    InvalidateSocket( connection->socket );
+    return NULL;
+  }
+  else if( bytesReceived < 0 ) return NULL;
+  
+  IP_TRACE( RECEIVE, socketFD, bytesReceived );
+  
+  *ref_length = (size_t) bytesReceived;
+  return info->bulkBuffer;
+}
+
+// Offloading is set by UDP socket owners, and also applies to clients accepted by servers (sharing their socket)
+static inline bool IsOffloading( IPConnection connection )
+{
+  if( connection->info->isOffloading ) return true;
+  return ( !( connection->type & IP_SERVER ) && connection->info->server != NULL && connection->info->server->info->isOffloading );
+}
+
+bool IP_SetSegmentationOffload( IPConnection connection, bool isEnabled )
+{
+  if( connection == NULL ) return false;
+  
+  if( ( connection->type & TRANSPORT_MASK ) != IP_UDP || ( !( connection->type & IP_SERVER ) && connection->info->server != NULL ) )
+  {
+    IP_REPORT_ERROR( "segmentation offload is only available for UDP servers and (not accepted) UDP clients" );
+    return false;
+  }
+  
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+  // Trains are segmented on each send, but received datagrams are only coalesced where the socket allows it
+  int isCoalesced = isEnabled ? 1 : 0;
+  if( setsockopt( connection->socket->fd, IPPROTO_UDP, UDP_GRO, (const char*) &isCoalesced, sizeof(isCoalesced) ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "setsockopt: failed setting socket %d option UDP_GRO", connection->socket->fd );
+    return false;
+  }
+  
+  connection->info->isOffloading = isEnabled;
+  
+  return true;
+#else
+  IP_REPORT_ERROR( "segmentation offload is not supported on this platform" );
+  return false;
+#endif
+}
+
+// Sends given messages as a single train of datagrams, segmented by the kernel (or device). Returns 0 where not supported
+static int SendUDPTrain( IPConnection connection, const char** messagesList, size_t messagesNumber )
+{
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+  struct iovec segmentsList[ MAX_TRAIN_SEGMENTS ];
+  for( size_t messageIndex = 0; messageIndex < messagesNumber; messageIndex++ )
+  {
+    segmentsList[ messageIndex ].iov_base = (void*) messagesList[ messageIndex ];
+    segmentsList[ messageIndex ].iov_len = connection->messageLength;
+  }
+  
+  union { char data[ CMSG_SPACE( sizeof(uint16_t) ) ]; struct cmsghdr header; } controlData = { 0 };
+  IPAddress address = (IPAddress) &(connection->info->addressData);
+  struct msghdr message = { .msg_name = address, .msg_namelen = GetAddressLength( address ), .msg_iov = segmentsList, .msg_iovlen = messagesNumber,
+                            .msg_control = controlData.data, .msg_controllen = sizeof(controlData.data) };
+  struct cmsghdr* controlMessage = CMSG_FIRSTHDR( &message );
+  controlMessage->cmsg_level = IPPROTO_UDP;
+  controlMessage->cmsg_type = UDP_SEGMENT;
+  controlMessage->cmsg_len = CMSG_LEN( sizeof(uint16_t) );
+  *((uint16_t*) CMSG_DATA( controlMessage )) = (uint16_t) connection->messageLength;
+  
+  if( sendmsg( connection->socket->fd, &message, MSG_NOSIGNAL ) == SOCKET_ERROR )
+  {
+    // Kernels or devices without segmentation offload refuse the whole train
+    if( errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP ) return 0;
+    IP_REPORT_ERROR( "sendmsg: error writing datagrams train to socket %d", connection->socket->fd );
+    return -1;
+  }
+  
+  IP_TRACE( SEND, connection->socket->fd, messagesNumber * connection->messageLength );
+  
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+int IP_SendMessages( IPConnection connection, const char** messagesList, size_t messagesNumber )
+{
+  if( connection == NULL || messagesList == NULL ) return -1;
+  
+  bool isOffloading = ( !( connection->type & IP_SERVER ) && IsOffloading( connection ) );
+  
+  const char* segmentsList[ MAX_TRAIN_SEGMENTS ];
+  size_t messageIndex = 0;
+  while( messageIndex < messagesNumber )
+  {
+    // Messages too long are skipped, as in IP_SendMessage(), so that errors are only reported for the socket
+    size_t segmentsNumber = 0;
+    for( ; messageIndex < messagesNumber && segmentsNumber < MAX_TRAIN_SEGMENTS; messageIndex++ )
+    {
+      if( strlen( messagesList[ messageIndex ] ) + 1 > connection->messageLength )
+      {
+        IP_REPORT_ERROR( "message too long (%lu bytes for %lu max) !", strlen( messagesList[ messageIndex ] ), connection->messageLength );
+        continue;
+      }
+      segmentsList[ segmentsNumber++ ] = messagesList[ messageIndex ];
+    }
+    
+    size_t sentSegmentsNumber = 0;
+    if( isOffloading && segmentsNumber > 1 )
+    {
+      int sendResult = SendUDPTrain( connection, segmentsList, segmentsNumber );
+      if( sendResult == -1 ) return -1;
+      if( sendResult == 0 ) isOffloading = false;
+      else sentSegmentsNumber = segmentsNumber;
+    }
+    
+    // Remaining messages (or all of them, without offloading) are sent one per call
+    for( ; sentSegmentsNumber < segmentsNumber; sentSegmentsNumber++ )
+    {
+      int sendResult = connection->ref_SendMessage( connection, segmentsList[ sentSegmentsNumber ] );
+      if( sendResult != 0 ) return sendResult;
+    }
+  }
+  
+  return 0;
+}
+
+// Enables or disables kernel timestamping (wall clock, in nanoseconds) of data received by the given socket
+static bool SetTimestampingOption( Socket socketFD, bool isEnabled )
+{
+#ifdef SO_TIMESTAMPNS
+  int isTimestamped = isEnabled ? 1 : 0;
+  if( setsockopt( socketFD, SOL_SOCKET, SO_TIMESTAMPNS, (const char*) &isTimestamped, sizeof(isTimestamped) ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "setsockopt: failed setting socket %d option SO_TIMESTAMPNS", socketFD );
+    return false;
+  }
+  
+  return true;
+#else
+  IP_REPORT_ERROR( "receive timestamps are not supported on this platform" );
+  return false;
+#endif
+}
+
+bool IP_SetReceiveTimestamps( IPConnection connection, bool isEnabled )
+{
+  if( connection == NULL ) return false;
+  
+  if( ( connection->type & TRANSPORT_MASK ) == IP_SHM )
+  {
+    IP_REPORT_ERROR( "receive timestamps are only available for socket connections" );
+    return false;
+  }
+  
+  if( connection->socket->fd != INVALID_SOCKET && !SetTimestampingOption( connection->socket->fd, isEnabled ) ) return false;
+  
+  if( isEnabled ) connection->receiveFlags |= RECEIVE_TIMESTAMPING;
+  else connection->receiveFlags &= ~RECEIVE_TIMESTAMPING;
+  connection->info->receiveTime = 0;
+  
+  return true;
+}
+
+uint64_t IP_GetReceiveTime( IPConnection connection )
+{
+  if( connection == NULL ) return 0;
+  
+  return connection->info->receiveTime;
+}
+
+// Clients accepted by UDP servers send through the server socket, whose options would affect all of them
+static inline bool IsSharingSocket( IPConnection connection )
+{
+  return ( ( connection->type & TRANSPORT_MASK ) == IP_UDP && !( connection->type & IP_SERVER ) && connection->info->server != NULL );
+}
+
+bool IP_SetTrafficClass( IPConnection connection, uint8_t dscp, int socketPriority )
+{
+  if( connection == NULL ) return false;
+  
+  // Local connections do not leave the host, and have nothing to be marked
+  if( IS_LOCAL_TRANSPORT( connection->type ) ) return true;
+  
+  if( IsSharingSocket( connection ) )
+  {
+    IP_REPORT_ERROR( "traffic class of UDP server clients is defined by their server socket" );
+    return false;
+  }
+  
+  Socket socketFD = connection->socket->fd;
+  if( socketFD == INVALID_SOCKET ) return false;
+  
+  // Code point takes the upper 6 bits of IPv4 type of service and IPv6 traffic class fields
+  int trafficClass = ( dscp & 0x3F ) << 2;
+  int addressFamily = ((struct sockaddr*) &(connection->info->addressData))->sa_family;
+  bool isMarked = ( setsockopt( socketFD, IPPROTO_IP, IP_TOS, (const char*) &trafficClass, sizeof(trafficClass) ) != SOCKET_ERROR );
+#ifdef IPV6_TCLASS
+  // IPv4 marking of IPv6 sockets only applies to mapped addresses
+  if( addressFamily == AF_INET6 ) isMarked = ( setsockopt( socketFD, IPPROTO_IPV6, IPV6_TCLASS, (const char*) &trafficClass, sizeof(trafficClass) ) != SOCKET_ERROR );
+#endif
+  if( !isMarked )
+  {
+    IP_REPORT_ERROR( "setsockopt: failed setting traffic class %d of socket %d (family %d)", trafficClass, socketFD, addressFamily );
+    return false;
+  }
+  
+#ifdef SO_PRIORITY
+  if( setsockopt( socketFD, SOL_SOCKET, SO_PRIORITY, (const char*) &socketPriority, sizeof(socketPriority) ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "setsockopt: failed setting socket %d option SO_PRIORITY to %d", socketFD, socketPriority );
+    return false;
+  }
+#endif
+  
+  return true;
+}
+
+bool IP_SetPacingRate( IPConnection connection, uint64_t bytesPerSecond )
+{
+  if( connection == NULL ) return false;
+  
+  // Local connections do not go through network queueing disciplines
+  if( IS_LOCAL_TRANSPORT( connection->type ) ) return true;
+  
+  if( IsSharingSocket( connection ) )
+  {
+    IP_REPORT_ERROR( "pacing rate of UDP server clients is defined by their server socket" );
+    return false;
+  }
+  
+  Socket socketFD = connection->socket->fd;
+  if( socketFD == INVALID_SOCKET ) return false;
+  
+#ifdef SO_MAX_PACING_RATE
+  // Rate is read as 32 bits by older kernels, where all bits set disables pacing
+  uint32_t pacingRate = ( bytesPerSecond == 0 || bytesPerSecond > UINT32_MAX ) ? UINT32_MAX : (uint32_t) bytesPerSecond;
+  if( setsockopt( socketFD, SOL_SOCKET, SO_MAX_PACING_RATE, (const char*) &pacingRate, sizeof(pacingRate) ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "setsockopt: failed setting socket %d option SO_MAX_PACING_RATE to %u", socketFD, pacingRate );
+    return false;
+  }
+#endif
+  
+  return true;
+}
+
+bool IP_Reconnect( IPConnection connection )
+{
+  if( connection == NULL ) return false;
+  
+  // Accepted clients are reconnected by the remote side
+  uint8_t transportProtocol = connection->type & TRANSPORT_MASK;
+  if( ( connection->type & IP_SERVER ) || connection->info->server != NULL || !( transportProtocol & ( IP_TCP | IP_UNIX_STREAM ) ) )
+  {
+    IP_REPORT_ERROR( "reconnection is only available for stream (TCP or local) client connections (socket %d)", connection->socket->fd );
+    return false;
+  }
+  
+  CloseStreamFilter( connection );
+  // Poller is kept, so that references to it remain valid
+  InvalidateSocket( connection->socket );
+  
+  IPAddress address = (IPAddress) &(connection->info->addressData);
+  Socket socketFD = CreateSocket( transportProtocol, address );
+  if( socketFD == INVALID_SOCKET ) return false;
+  
+  if( !SetSocketConfig( socketFD ) ) return false;
+  
+  if( !ConnectTCPClientSocket( socketFD, address ) ) return false;
+  
+  if( connection->receiveFlags & RECEIVE_TIMESTAMPING ) SetTimestampingOption( socketFD, true );
+  
+  #ifdef IP_NETWORK_LEGACY
+  FD_SET( socketFD, &polledSocketsSet );
+  if( socketFD >= (Socket) polledSocketsNumber ) polledSocketsNumber = socketFD + 1;
+  #endif
+  connection->socket->fd = socketFD;
+  
+  // Received pages are mapped from the new socket
+  if( connection->info->bulkBuffer != NULL )
+  {
+    UnmapBulkWindow( connection );
+    MapBulkWindow( connection );
+    SetSocketPolling( connection->socket, false );
+  }
+  
+  if( connection->info->filter.ref_Open != NULL )
+  {
+    const char* host = ( connection->info->hostName[ 0 ] != '\0' ) ? connection->info->hostName : NULL;
+    connection->info->filterState = connection->info->filter.ref_Open( connection->info->filter.settings, (intptr_t) socketFD, false, host );
+    if( connection->info->filterState == NULL )
+    {
+      IP_REPORT_ERROR( "failed reopening stream filter on socket %d", socketFD );
+      InvalidateSocket( connection->socket );
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+size_t IP_SetMessageLength( IPConnection connection, size_t messageLength )
+{
+  if( connection == NULL ) return 0;
+  
+  connection->messageLength = ( messageLength > IP_MAX_MESSAGE_LENGTH ) ? IP_MAX_MESSAGE_LENGTH : (uint16_t) messageLength;
+  
+  return (size_t) connection->messageLength;
+}
+
+size_t IP_GetMessageLength( IPConnection connection )
+{
+  if( connection == NULL ) return 0;
+  
+  return (size_t) connection->messageLength;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////
+/////                             GENERIC COMMUNICATION                             /////
+/////////////////////////////////////////////////////////////////////////////////////////
+
+char* IP_ReceiveMessage( IPConnection connection ) 
+{ 
+  // Data of bulk receiving connections is only taken by IP_ReceiveBulk(), even if polling started before
+  if( connection->receiveFlags & RECEIVE_BULK ) return NULL;
+  
+  memset( connection->buffer, 0, IP_MAX_MESSAGE_LENGTH );
+  
+  return connection->ref_ReceiveMessage( connection ); 
+}
+
+int IP_SendMessage( IPConnection connection, const char* message ) 
+{ 
+  if( strlen( message ) + 1 > connection->messageLength )
+  {
+    IP_REPORT_ERROR( "message too long (%lu bytes for %lu max) !", strlen( message ), connection->messageLength );
+    return 0;
+  }
+  
+  return connection->ref_SendMessage( connection, message ); 
+}
+
+IPConnection IP_AcceptClient( IPConnection connection ) 
+{ 
+  // Servers at their limit refuse new clients right away, without the cost (e.g. handshakes and buffers) of accepting them
+  if( connection->info->maxClientsCount > 0 && connection->info->clientsCount >= connection->info->maxClientsCount )
+  {
+    IP_RejectClient( connection );
+    return NULL;
+  }
+  
+  return connection->ref_AcceptClient( connection ); 
+}
+
+bool IP_RejectClient( IPConnection server )
+{
+  if( server == NULL ) return false;
+  
+  Socket serverSocketFD = server->socket->fd;
+  if( !( server->type & IP_SERVER ) )
+  {
+    IP_REPORT_ERROR( "socket %d is not of a server connection", serverSocketFD );
+    return false;
+  }
+  
+  if( server->type & ( IP_UDP | IP_UNIX_DGRAM ) )
+  {
+    // Datagram servers only refuse messages from unknown addresses (read by clients otherwise), discarding them
+    static char buffer[ IP_MAX_MESSAGE_LENGTH ];
+    struct sockaddr_storage clientAddress = { 0 };
+    socklen_t addressLength = sizeof(clientAddress);
+    if( recvfrom( serverSocketFD, buffer, IP_MAX_MESSAGE_LENGTH, MSG_PEEK, (IPAddress) &clientAddress, &addressLength ) == SOCKET_ERROR ) return false;
+    if( IsClientAddress( server, &clientAddress ) ) return false;
+    recv( serverSocketFD, buffer, IP_MAX_MESSAGE_LENGTH, 0 );
+  }
+  else
+  {
+    // Stream (and shared memory control) connections are closed as soon as taken from the listening backlog
+    Socket clientSocketFD = accept( serverSocketFD, NULL, NULL );
+    if( clientSocketFD == INVALID_SOCKET )
+    {
+      IP_REPORT_ERROR( "accept: failed taking connection to refuse on socket %d", serverSocketFD );
+      return false;
+    }
+    close( clientSocketFD );
+  }
+  
+  IP_TRACE( REJECT, serverSocketFD, 0 );
+  
+  return true;
+}
+
+bool IP_SetMaxClients( IPConnection server, size_t maxClientsNumber )
+{
+  if( server == NULL ) return false;
+  
+  if( !( server->type & IP_SERVER ) )
+  {
+    IP_REPORT_ERROR( "socket %d is not of a server connection", server->socket->fd );
+    return false;
+  }
+  
+  // Clients accepted beyond a lowered limit are kept
+  server->info->maxClientsCount = maxClientsNumber;
+  
+  return true;
+}
+
+// Verify available incoming messages for the given connection, preventing unnecessary blocking calls (for syncronous networking)
+int IP_WaitEvent( unsigned int milliseconds )
+{
+  // Datagrams left from received trains (and data left in filters) are available right away
+  uint64_t pendingReceivesNumber = ATOMIC_LOAD( &pendingTrainsCount ) + ATOMIC_LOAD( &pendingFiltersCount );
+  if( pendingReceivesNumber > 0 ) milliseconds = 0;
+  
+  #ifndef IP_NETWORK_LEGACY
+  int eventsNumber = poll( polledSocketsList, polledSocketsNumber, milliseconds );
+  #else
+  struct timeval waitTime = { .tv_sec = milliseconds / 1000, .tv_usec = ( milliseconds % 1000 ) * 1000 };
+  activeSocketsSet = polledSocketsSet;
+  int eventsNumber = select( polledSocketsNumber, &activeSocketsSet, NULL, NULL, &waitTime );
+  #endif
+  if( eventsNumber == SOCKET_ERROR ) IP_REPORT_ERROR( "select: error waiting for events on %lu FDs", polledSocketsNumber );
+  else eventsNumber += (int) pendingReceivesNumber;
+  
+  return eventsNumber;
+}
+
+bool IP_IsDataAvailable( IPConnection connection )
+{
+  if( connection == NULL ) return false;
+  
+  if( connection->receiveFlags & ( RECEIVE_TRAIN_PENDING | RECEIVE_FILTER_PENDING ) ) return true;
+  
+  #ifndef IP_NETWORK_LEGACY
+  if( connection->socket->revents & ( POLLIN | POLLRDNORM ) ) return true;
+  else if( connection->socket->revents & POLLRDBAND ) return true;
+  #else
+  if( connection->socket->fd != INVALID_SOCKET && FD_ISSET( connection->socket->fd, &activeSocketsSet ) ) return true;
+  #endif
+  
+  return false;
+}
+
+bool IP_IsConnected( IPConnection connection )
+{
+  if( connection == NULL ) return false;
+  
+  if( connection->socket->fd == INVALID_SOCKET ) return false;
+  
+  // Remotely closed stream sockets are readable and peek end of file, without consuming pending data
+  if( IS_STREAM_TRANSPORT( connection->type ) && !( connection->type & IP_SERVER ) )
+  {
+    char firstByte;
+    #ifndef IP_NETWORK_LEGACY
+    SocketPoller poller = { .fd = connection->socket->fd, .events = POLLIN };
+    bool isReadable = ( poll( &poller, 1, 0 ) > 0 );
+    #else
+    struct timeval waitTime = { 0 };
+    fd_set readSocketsSet;
+    FD_ZERO( &readSocketsSet );
+    FD_SET( connection->socket->fd, &readSocketsSet );
+    bool isReadable = ( select( connection->socket->fd + 1, &readSocketsSet, NULL, NULL, &waitTime ) > 0 );
+    #endif
+    if( isReadable && recv( connection->socket->fd, &firstByte, 1, MSG_PEEK ) <= 0 ) return false;
+  }
+  
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+/////                      SPECIFIC TRANSPORT/ROLE COMMUNICATION                    /////
+/////////////////////////////////////////////////////////////////////////////////////////
+
+// Try to receive incoming message from the given TCP client connection and store it on its buffer
+static char* ReceiveTCPMessage( IPConnection connection )
+{
+  int bytesReceived;
+  
+  if( connection->socket->fd == INVALID_SOCKET ) return NULL;
+
+  // Blocks until there is something to be read in the socket
+  bytesReceived = ReceiveSocketData( connection, connection->buffer, connection->messageLength );
+
+  if( bytesReceived == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "recv: error reading from socket %d", connection->socket->fd );
+    //connection->socket->fd = INVALID_SOCKET;
+    //RemoveSocket( connection->socket->fd );
+    return NULL;
+  }
+  else if( bytesReceived == 0 )
+  {
+    IP_REPORT_ERROR( "recv: remote connection with socket %d closed", connection->socket->fd );
+    InvalidateSocket( connection->socket );
     return NULL;
   }
   
-  //DEBUG_PRINT( "socket %d received message: %s", connection->socketFD, connection->buffer );
+  IP_TRACE( RECEIVE, connection->socket->fd, bytesReceived );
   
   return connection->buffer;
 }
@@ -711,20 +2003,166 @@ static char* ReceiveTCPMessage( IPConnection connection )
 // Send given message through the given TCP connection
 static int SendTCPMessage( IPConnection connection, const char* message )
 {
-  if( send( connection->socket->fd, message, connection->messageLength, 0 ) == SOCKET_ERROR )
+  if( send( connection->socket->fd, message, connection->messageLength, MSG_NOSIGNAL ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "send: error writing to socket %d", connection->socket->fd );
+    return -1;
+  }
+  
+  IP_TRACE( SEND, connection->socket->fd, connection->messageLength );
+  
+  return 0;
+}
+
+// Try to receive incoming message from the given filtered TCP client connection and store it on its buffer
+static char* ReceiveFilteredMessage( IPConnection connection )
+{
+  IPConnectionInfo* info = connection->info;
+  
+  if( info->filterState == NULL ) return NULL;
+  
+  int bytesReceived = info->filter.ref_Receive( info->filterState, connection->buffer, connection->messageLength );
+  UpdateFilterPending( connection );
+  if( bytesReceived < 0 ) return NULL;
+  else if( bytesReceived == 0 )
+  {
+    IP_REPORT_ERROR( "recv: remote connection with socket %d closed", connection->socket->fd );
+    InvalidateSocket( connection->socket );
+    return NULL;
+  }
+  
+  IP_TRACE( RECEIVE, connection->socket->fd, bytesReceived );
+  
+  return connection->buffer;
+}
+
+// Send given message through the given filtered TCP connection
+static int SendFilteredMessage( IPConnection connection, const char* message )
+{
+  IPConnectionInfo* info = connection->info;
+  
+  if( info->filterState == NULL ) return -1;    // Filter not reopened after failed reconnection
+  
+  // Messages written before the filter is ready (e.g. during handshakes) are retried by the caller
+  int sendResult = info->filter.ref_Send( info->filterState, message, connection->messageLength );
+  if( sendResult == 0 ) return 1;
+  else if( sendResult < (int) connection->messageLength )
   {
-    fprintf( stderr, "send: error writing to socket %d", connection->socket->fd );
+    IP_REPORT_ERROR( "send: error writing filtered data to socket %d", connection->socket->fd );
     return -1;
   }
   
+  IP_TRACE( SEND, connection->socket->fd, connection->messageLength );
+  
+  return 0;
+}
+
+#ifdef SO_TIMESTAMPNS
+// Returns kernel receive time (nanoseconds since epoch) of the given received message header, or 0 if not present
+static uint64_t ReadReceiveTime( struct msghdr* message )
+{
+  for( struct cmsghdr* controlMessage = CMSG_FIRSTHDR( message ); controlMessage != NULL; controlMessage = CMSG_NXTHDR( message, controlMessage ) )
+  {
+    if( controlMessage->cmsg_level == SOL_SOCKET && controlMessage->cmsg_type == SCM_TIMESTAMPNS )
+    {
+      struct timespec timeStamp;
+      memcpy( &timeStamp, CMSG_DATA( controlMessage ), sizeof(timeStamp) );
+      return (uint64_t) timeStamp.tv_sec * 1000000000 + (uint64_t) timeStamp.tv_nsec;
+    }
+  }
+  
   return 0;
 }
+#endif
+
+// Receives data from the socket of given connection, reading its kernel receive time as well for timestamping connections
+static long ReceiveSocketData( IPConnection connection, char* buffer, size_t length )
+{
+#ifdef SO_TIMESTAMPNS
+  if( connection->receiveFlags & RECEIVE_TIMESTAMPING )
+  {
+    struct iovec data = { .iov_base = buffer, .iov_len = length };
+    union { char data[ CMSG_SPACE( sizeof(struct timespec) ) ]; struct cmsghdr header; } controlData;
+    struct msghdr message = { .msg_iov = &data, .msg_iovlen = 1, .msg_control = controlData.data, .msg_controllen = sizeof(controlData.data) };
+    ssize_t bytesReceived = recvmsg( connection->socket->fd, &message, 0 );
+    if( bytesReceived > 0 ) connection->info->receiveTime = ReadReceiveTime( &message );
+    return (long) bytesReceived;
+  }
+#endif
+  
+  return (long) recv( connection->socket->fd, buffer, length, 0 );
+}
+
+// Takes next datagram from the train received by given UDP client connection, storing it on its buffer
+static char* TakeTrainSegment( IPConnection connection )
+{
+  IPConnectionInfo* info = connection->info;
+  
+  size_t segmentLength = info->trainLength - info->trainOffset;
+  if( segmentLength > info->segmentLength ) segmentLength = info->segmentLength;
+  memcpy( connection->buffer, info->trainBuffer + info->trainOffset, ( segmentLength < connection->messageLength ) ? segmentLength : connection->messageLength );
+  
+  bool wasPending = ( info->trainOffset > 0 );
+  info->trainOffset += segmentLength;
+  bool isPending = ( info->trainOffset < info->trainLength );
+  if( isPending && !wasPending ) ATOMIC_FETCH_ADD( &pendingTrainsCount, 1 );
+  else if( !isPending && wasPending ) ATOMIC_FETCH_SUB( &pendingTrainsCount, 1 );
+  if( isPending ) connection->receiveFlags |= RECEIVE_TRAIN_PENDING;
+  else connection->receiveFlags &= ~RECEIVE_TRAIN_PENDING;
+  
+  return connection->buffer;
+}
+
+// Receives datagrams coalesced by the kernel (UDP_GRO) into the train buffer of given UDP client connection, taking the first one
+static char* ReceiveUDPTrain( IPConnection connection )
+{
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+  IPConnectionInfo* info = connection->info;
+  if( info->trainBuffer == NULL ) info->trainBuffer = (char*) malloc( TRAIN_BUFFER_LENGTH );
+  if( info->trainBuffer == NULL )
+  {
+    IP_REPORT_ERROR( "failed allocating %u bytes for datagrams train on socket %d", TRAIN_BUFFER_LENGTH, connection->socket->fd );
+    return NULL;
+  }
+  
+  struct iovec trainData = { .iov_base = info->trainBuffer, .iov_len = TRAIN_BUFFER_LENGTH };
+  union { char data[ CMSG_SPACE( sizeof(int) ) + CMSG_SPACE( sizeof(struct timespec) ) ]; struct cmsghdr header; } controlData;
+  struct msghdr message = { .msg_iov = &trainData, .msg_iovlen = 1, .msg_control = controlData.data, .msg_controllen = sizeof(controlData.data) };
+  ssize_t bytesReceived = recvmsg( connection->socket->fd, &message, 0 );
+  if( bytesReceived == SOCKET_ERROR ) return NULL;
+  
+  IP_TRACE( RECEIVE, connection->socket->fd, bytesReceived );
+  
+  // Single (not coalesced) datagrams are received without segment length
+  info->segmentLength = (size_t) bytesReceived;
+  for( struct cmsghdr* controlMessage = CMSG_FIRSTHDR( &message ); controlMessage != NULL; controlMessage = CMSG_NXTHDR( &message, controlMessage ) )
+  {
+    if( controlMessage->cmsg_level == IPPROTO_UDP && controlMessage->cmsg_type == UDP_GRO ) 
+      info->segmentLength = (size_t) *((int*) CMSG_DATA( controlMessage ));
+  }
+  if( info->segmentLength == 0 ) info->segmentLength = TRAIN_BUFFER_LENGTH;
+  // All datagrams of the train were received at once
+#ifdef SO_TIMESTAMPNS
+  if( connection->receiveFlags & RECEIVE_TIMESTAMPING ) info->receiveTime = ReadReceiveTime( &message );
+#endif
+  
+  info->trainLength = (size_t) bytesReceived;
+  info->trainOffset = 0;
+  
+  return TakeTrainSegment( connection );
+#else
+  return NULL;
+#endif
+}
 
 // Try to receive incoming message from the given UDP client connection and store it on its buffer
 static char* ReceiveUDPMessage( IPConnection connection )
 {
   struct sockaddr_storage address = { 0 };
-  socklen_t addressLength;
+  socklen_t addressLength = sizeof(address);
+  
+  // Datagrams coalesced in a received train are taken one by one, before reading the socket again
+  if( connection->receiveFlags & RECEIVE_TRAIN_PENDING ) return TakeTrainSegment( connection );
   
   // Blocks until there is something to be read in the socket
   if( recvfrom( connection->socket->fd, connection->buffer, connection->messageLength, MSG_PEEK, (IPAddress) &address, &addressLength ) == SOCKET_ERROR )
@@ -733,14 +2171,14 @@ static char* ReceiveUDPMessage( IPConnection connection )
     return NULL;
   }
 
-  //DEBUG_PRINT( "socket %d received message: %s", connection->socket->fd, connection->buffer );
-  //DEBUG_PRINT( "comparing %u to %u", ntohs( ((struct sockaddr_in*) &(connection->addressData))->sin_port ), ntohs( ((struct sockaddr_in*) &address)->sin_port ) ); 
 
   // Verify if incoming message is destined to this connection (and returns the message if it is)
-  if( ARE_EQUAL_IP_ADDRESSES( &(connection->addressData), &address ) )
+  if( ARE_EQUAL_ADDRESSES( &(connection->info->addressData), &address ) )
   {
-    recv( connection->socket->fd, connection->buffer, connection->messageLength, 0 );  
-    //DEBUG_PRINT( "socket %d received right message: %s", connection->socket->fd, connection->buffer );
+    if( IsOffloading( connection ) ) return ReceiveUDPTrain( connection );
+    
+    long bytesReceived = ReceiveSocketData( connection, connection->buffer, connection->messageLength );
+    IP_TRACE( RECEIVE, connection->socket->fd, bytesReceived );
     return connection->buffer;
   }
   
@@ -751,11 +2189,46 @@ static char* ReceiveUDPMessage( IPConnection connection )
 // Send given message through the given UDP connection
 static int SendUDPMessage( IPConnection connection, const char* message )
 {
-  if( sendto( connection->socket->fd, message, connection->messageLength, 0, (IPAddress) &(connection->addressData), sizeof(IPAddressData) ) == SOCKET_ERROR )
+  if( sendto( connection->socket->fd, message, connection->messageLength, 0, (IPAddress) &(connection->info->addressData), GetAddressLength( (IPAddress) &(connection->info->addressData) ) ) == SOCKET_ERROR )
+  {
+    IP_REPORT_ERROR( "sendto: error writing to socket %d", connection->socket->fd );
+    return -1;
+  }
+  
+  IP_TRACE( SEND, connection->socket->fd, connection->messageLength );
+  
+  return 0;
+}
+
+// Try to receive incoming message from the given shared memory client connection and store it on its buffer
+static char* ReceiveShmMessage( IPConnection connection )
+{
+  int bytesReceived = IPShm_Receive( connection->info->sharedChannel, connection->buffer, connection->messageLength );
+  if( bytesReceived < 0 ) return NULL;
+  else if( bytesReceived == 0 )
+  {
+    IP_REPORT_ERROR( "shared memory: remote connection with event %d closed", connection->socket->fd );
+    InvalidateSocket( connection->socket );
+    return NULL;
+  }
+  
+  IP_TRACE( RECEIVE, connection->socket->fd, bytesReceived );
+  
+  return connection->buffer;
+}
+
+// Send given message through the given shared memory connection
+static int SendShmMessage( IPConnection connection, const char* message )
+{
+  int sendResult = IPShm_Send( connection->info->sharedChannel, message, connection->messageLength );
+  if( sendResult == -1 )
   {
-    fprintf( stderr, "sendto: error writing to socket %d", connection->socket->fd );
+    IP_REPORT_ERROR( "shared memory: error writing to ring of event %d", connection->socket->fd );
     return -1;
   }
+  else if( sendResult == 0 ) return 1;    // Full ring, to be retried by the caller
+  
+  IP_TRACE( SEND, connection->socket->fd, connection->messageLength );
   
   return 0;
 }
@@ -764,12 +2237,12 @@ static int SendUDPMessage( IPConnection connection, const char* message )
 static int SendMessageAll( IPConnection connection, const char* message )
 {
   size_t clientIndex = 0;
-  size_t clientsNumber = *((size_t*) connection->ref_clientsCount);
+  size_t clientsNumber = connection->info->clientsCount;
   while( clientIndex < clientsNumber )
   {
-    if( connection->clientsList[ clientIndex ] != NULL )
+    if( connection->info->clientsList[ clientIndex ] != NULL )
     {
-      IP_SendMessage( connection->clientsList[ clientIndex ], message );
+      IP_SendMessage( connection->info->clientsList[ clientIndex ], message );
       clientIndex++;
     }
   }
@@ -782,21 +2255,71 @@ static IPConnection AcceptTCPClient( IPConnection server )
 {
   IPConnection client;
   int clientSocketFD;
-  static struct sockaddr_storage clientAddress;
-  static socklen_t addressLength = sizeof(clientAddress);
+  struct sockaddr_storage clientAddress = { 0 };
+  socklen_t addressLength = sizeof(clientAddress);
   
   clientSocketFD = accept( server->socket->fd, (struct sockaddr *) &clientAddress, &addressLength );
 
   if( clientSocketFD == INVALID_SOCKET )
   {
-    fprintf( stderr, "accept: failed accepting connection on socket %d", server->socket->fd );
+    IP_REPORT_ERROR( "accept: failed accepting connection on socket %d", server->socket->fd );
     return NULL;
   }
   
-  client = AddConnection( clientSocketFD, (IPAddress) &clientAddress, IP_TCP, false );
+  client = AddConnection( clientSocketFD, (IPAddress) &clientAddress, ( server->type & TRANSPORT_MASK ), false, NULL );
+  if( client == NULL ) return NULL;
+  
+  // Accepted sockets keep the timestamping option of the listening one
+  client->receiveFlags |= ( server->receiveFlags & RECEIVE_TIMESTAMPING );
+  
+  if( server->info->filter.ref_Open != NULL )
+  {
+    if( !OpenStreamFilter( client, &(server->info->filter), true ) )
+    {
+      CloseTCPClient( client );
+      return NULL;
+    }
+  }
 
   AddClient( server, client );
+  
+  IP_TRACE( ACCEPT, clientSocketFD, 0 );
+
+  return client;
+}
 
+// Accepts local control connection and maps the shared memory rings it carries, adding a new client to the given server connection
+static IPConnection AcceptShmClient( IPConnection server )
+{
+  struct sockaddr_storage clientAddress = { 0 };
+  socklen_t addressLength = sizeof(clientAddress);
+  
+  int controlSocketFD = accept( server->socket->fd, (struct sockaddr *) &clientAddress, &addressLength );
+  if( controlSocketFD == INVALID_SOCKET )
+  {
+    IP_REPORT_ERROR( "accept: failed accepting connection on socket %d", server->socket->fd );
+    return NULL;
+  }
+  
+  IPShmChannel* channel = IPShm_Accept( controlSocketFD );
+  if( channel == NULL )
+  {
+    close( controlSocketFD );
+    return NULL;
+  }
+  
+  IPConnection client = AddConnection( IPShm_GetEventDescriptor( channel ), (IPAddress) &clientAddress, IP_SHM, IP_CLIENT, NULL );
+  if( client == NULL ) 
+  {
+    IPShm_Close( channel );
+    return NULL;
+  }
+  client->info->sharedChannel = channel;
+  
+  AddClient( server, client );
+  
+  IP_TRACE( ACCEPT, client->socket->fd, 0 );
+  
   return client;
 }
 
@@ -809,23 +2332,21 @@ static IPConnection AcceptUDPClient( IPConnection server )
   socklen_t addressLength = sizeof(clientAddress);
   if( recvfrom( server->socket->fd, buffer, IP_MAX_MESSAGE_LENGTH, MSG_PEEK, (IPAddress) &clientAddress, &addressLength ) == SOCKET_ERROR )
   {
-    fprintf( stderr, "recvfrom: error reading from socket %d", server->socket->fd );
+    IP_REPORT_ERROR( "recvfrom: error reading from socket %d", server->socket->fd );
     return NULL;
   }
   
   // Verify if incoming message belongs to unregistered client (returns default value if not)
-  size_t clientsNumber = *(server->ref_clientsCount);
-  for( size_t clientIndex = 0; clientIndex < clientsNumber; clientIndex++ )
-  {
-    if( ARE_EQUAL_IP_ADDRESSES( &(server->clientsList[ clientIndex ]->addressData), &clientAddress ) )
-      return NULL;
-  }
+  if( IsClientAddress( server, &clientAddress ) ) return NULL;
   
-  IPConnection client = AddConnection( server->socket->fd, (IPAddress) &clientAddress, IP_UDP, false );
-
+  // Clients share the server socket
+  IPConnection client = AddConnection( server->socket->fd, (IPAddress) &clientAddress, ( server->type & TRANSPORT_MASK ), false, server->socket );
+  if( client == NULL ) return NULL;
+  
+  client->receiveFlags |= ( server->receiveFlags & RECEIVE_TIMESTAMPING );
   AddClient( server, client );
   
-  //DEBUG_PRINT( "client accepted (clients count after: %lu)", *(server->ref_clientsCount) );
+  IP_TRACE( ACCEPT, server->socket->fd, 0 );
   
   return client;
 }
@@ -837,42 +2358,75 @@ static IPConnection AcceptUDPClient( IPConnection server )
 
 // Handle proper destruction of any given connection type
 
-void RemoveSocket( Socket socketFD )
+// Stops polling and closes the given socket (e.g. remotely closed), keeping its poller for the owner connection
+static void InvalidateSocket( SocketPoller* poller )
 {
+  if( poller->fd == INVALID_SOCKET ) return;
+  
   #ifndef IP_NETWORK_LEGACY
-  SocketPoller cmpPoller = { .fd = socketFD };
-  SocketPoller* poller = bsearch( &cmpPoller, polledSocketsList, polledSocketsNumber, sizeof(SocketPoller), CompareSockets );
-  if( poller != NULL )
-  {
-    poller->fd = (Socket) 0xFFFF;
-    qsort( polledSocketsList, polledSocketsNumber, sizeof(SocketPoller), CompareSockets );
-    polledSocketsNumber--;
-  }
+  poller->revents = 0;
+  #else
+  FD_CLR( poller->fd, &polledSocketsSet );
+  #endif
+  close( poller->fd );
+  poller->fd = INVALID_SOCKET;
+}
+
+// Includes or excludes the given socket from polling by IP_WaitEvent() (bulk receiving connections wait on their own)
+static void SetSocketPolling( SocketPoller* poller, bool isPolled )
+{
+  #ifndef IP_NETWORK_LEGACY
+  poller->events = isPolled ? ( POLLIN | POLLRDNORM | POLLRDBAND ) : 0;
+  poller->revents = 0;
+  #else
+  if( poller->fd == INVALID_SOCKET ) return;
+  if( isPolled ) FD_SET( poller->fd, &polledSocketsSet );
+  else FD_CLR( poller->fd, &polledSocketsSet );
+  #endif
+}
+
+// Closes the given socket, if still valid, and releases its poller for new connections
+static void RemoveSocket( SocketPoller* poller )
+{
+  InvalidateSocket( poller );
+  
+  #ifndef IP_NETWORK_LEGACY
+  freeSocketIndexesList[ freeSocketsNumber++ ] = (size_t) ( poller - polledSocketsList );
   #else
-  FD_CLR( socketFD, &polledSocketsSet );
-  if( socketFD + 1 >= polledSocketsNumber ) polledSocketsNumber = socketFD - 1;
+  free( poller );
+  #endif
+}
+
+// Removes socket file of local (Unix domain) sockets bound to a path, on their owner side
+static void UnlinkLocalAddress( Socket socketFD )
+{
+  #ifndef WIN32
+  struct sockaddr_un localAddress = { 0 };
+  socklen_t addressLength = sizeof(localAddress);
+  if( getsockname( socketFD, (struct sockaddr*) &localAddress, &addressLength ) == SOCKET_ERROR ) return;
+  if( localAddress.sun_family == AF_UNIX && addressLength > offsetof( struct sockaddr_un, sun_path ) && localAddress.sun_path[ 0 ] != '\0' ) 
+    unlink( localAddress.sun_path );
   #endif
-  close( socketFD );
 }
 
 void CloseTCPServer( IPConnection server )
 {
+  if( server->type & ( IP_UNIX_STREAM | IP_SHM ) ) UnlinkLocalAddress( server->socket->fd );
   shutdown( server->socket->fd, SHUT_RDWR );
-  RemoveSocket( server->socket->fd );
-  free( server->ref_clientsCount );
-  if( server->clientsList != NULL ) free( server->clientsList );
-  free( server );
+  RemoveSocket( server->socket );
+  if( server->info->clientsList != NULL ) free( server->info->clientsList );
+  System_FreeAligned( server );
 }
 
 void CloseUDPServer( IPConnection server )
 {
   // Check number of client connections of a server (also of sharers of a socket for UDP connections)
-  if( *(server->ref_clientsCount) == 0 )
+  if( server->info->clientsCount == 0 )
   {
-    RemoveSocket( server->socket->fd );
-    free( server->ref_clientsCount );
-    if( server->clientsList != NULL ) free( server->clientsList );
-    free( server );
+    if( server->type & IP_UNIX_DGRAM ) UnlinkLocalAddress( server->socket->fd );
+    RemoveSocket( server->socket );
+    if( server->info->clientsList != NULL ) free( server->info->clientsList );
+    System_FreeAligned( server );
   }
 }
 
@@ -880,13 +2434,13 @@ static inline void RemoveClient( IPConnection server, IPConnection client )
 {
   if( server == NULL ) return;
   
-  size_t clientsNumber = *(server->ref_clientsCount);
+  size_t clientsNumber = server->info->clientsCount;
   for( size_t clientIndex = 0; clientIndex < clientsNumber; clientIndex++ )
   {
-    if( server->clientsList[ clientIndex ] == client )
+    if( server->info->clientsList[ clientIndex ] == client )
     {
-      server->clientsList[ clientIndex ] = NULL;
-      (*(server->ref_clientsCount))--;
+      server->info->clientsList[ clientIndex ] = NULL;
+      server->info->clientsCount--;
       break;
     }
   }
@@ -894,29 +2448,56 @@ static inline void RemoveClient( IPConnection server, IPConnection client )
 
 void CloseTCPClient( IPConnection client )
 {
-  RemoveClient( client->server, client );
+  RemoveClient( client->info->server, client );
+  CloseStreamFilter( client );
+  UnmapBulkWindow( client );
+  free( client->info->bulkBuffer );
   shutdown( client->socket->fd, SHUT_RDWR );
-  RemoveSocket( client->socket->fd );
-  if( client->buffer != NULL ) free( client->buffer );
-  free( client );
+  RemoveSocket( client->socket );
+  System_FreeAligned( client );
+}
+
+void CloseShmClient( IPConnection client )
+{
+  RemoveClient( client->info->server, client );
+  IPShm_Close( client->info->sharedChannel );
+  RemoveSocket( client->socket );
+  System_FreeAligned( client );
+}
+
+// Drops datagrams left from the train received by given UDP client connection
+static void DiscardTrain( IPConnection client )
+{
+  IPConnectionInfo* info = client->info;
+  if( info->trainOffset > 0 && info->trainOffset < info->trainLength ) ATOMIC_FETCH_SUB( &pendingTrainsCount, 1 );
+  free( info->trainBuffer );
+  info->trainBuffer = NULL;
+  info->trainLength = info->trainOffset = 0;
+  client->receiveFlags &= ~RECEIVE_TRAIN_PENDING;
 }
 
 void CloseUDPClient( IPConnection client )
 {
-  RemoveClient( client->server, client );
+  RemoveClient( client->info->server, client );
+  DiscardTrain( client );
   
-  if( client->server == NULL ) close( client->socket->fd );
-  else if( *(client->server->ref_clientsCount) == 0 ) CloseUDPServer( client->server );
+  if( client->info->server == NULL ) 
+  {
+    if( client->type & IP_UNIX_DGRAM ) UnlinkLocalAddress( client->socket->fd );
+    RemoveSocket( client->socket );
+  }
+  else if( client->info->server->info->clientsCount == 0 ) CloseUDPServer( client->info->server );
 
-  if( client->buffer != NULL ) free( client->buffer );
-  free( client );
+  System_FreeAligned( client );
 }
 
 void IP_CloseConnection( IPConnection connection )
 {
   if( connection == NULL ) return;
+  
+  IP_TRACE( CLOSE, connection->socket->fd, 0 );
 
   // Each TCP connection has its own socket, so we can close it without problem. But UDP connections
   // from the same server share the socket, so we need to wait for all of them to be stopped to close the socket
-  connection->ref_Close( connection );
+  connection->info->ref_Close( connection );
 }
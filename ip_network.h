@@ -41,6 +41,9 @@
 
 #define IP_TCP 0x10                     ///< IP TCP (stream) connection creation flag
 #define IP_UDP 0x20                     ///< IP UDP (datagram) connection creation flag
+#define IP_UNIX_STREAM 0x40             ///< Local (Unix domain) stream connection creation flag, for peers on the same host
+#define IP_UNIX_DGRAM 0x80              ///< Local (Unix domain) datagram connection creation flag, for peers on the same host
+#define IP_SHM 0x08                     ///< Shared memory connection creation flag, for peers on the same host (Linux only)
 
 
 
@@ -49,10 +52,27 @@ typedef struct _IPConnectionData IPConnectionData;
 /// Opaque type to reference encapsulated IP connection structure
 typedef IPConnectionData* IPConnection;
 
+/// Stream transformation layer (e.g. encryption) used by TCP connections in place of direct socket system calls
+typedef struct _IPStreamFilter
+{
+  void* (*ref_Open)( void* settings, intptr_t socketFD, bool isServerSide, const char* host );   ///< Creates filter state for a connected socket, e.g. performing handshakes (NULL on failure). Host is the remote name given to client connections (NULL otherwise), e.g. for certificate verification
+  int (*ref_Send)( void* state, const char* data, size_t length );              ///< Sends data, returning number of bytes sent (0 if not ready yet, e.g. before the end of a handshake, -1 on error)
+  int (*ref_Receive)( void* state, char* buffer, size_t length );               ///< Receives data, returning number of bytes received (0 on remote closing or fatal error, -1 if no data is available yet)
+  void (*ref_Close)( void* state );                                             ///< Releases filter state, before socket closing
+  bool (*ref_IsOffloaded)( void* state );                                       ///< Tells if data written directly to the socket is transformed by the kernel (e.g. kTLS), allowing file sending without user space copies (optional, NULL if never)
+  bool (*ref_HasPending)( void* state );                                        ///< Tells if received data is left in filter state (e.g. rest of a decrypted record), not signaled by socket polling (optional, NULL if never)
+  bool (*ref_IsExpired)( void* state );                                         ///< Tells if filter state will not become usable anymore, e.g. handshake not finished before its deadline (optional, NULL if never)
+  size_t maxSendLength;                                                         ///< Maximum length of data taken by a single ref_Send call, e.g. for framing filters (0 for no limit)
+  void* settings;                                                               ///< Filter specific data, passed to ref_Open
+}
+IPStreamFilter;
+
 
 /// @brief Creates a new IP connection structure (with defined properties) and add it to the asynchronous connections list                              
-/// @param[in] connectionType flag defining connection as client or server, TCP or UDP (see ip_connection.h)                                   
-/// @param[in] host IPv4 or IPv6 host string (NULL for server listening on any local address)                                         
+/// @param[in] connectionType flag defining connection as client or server, TCP, UDP, local (Unix domain) stream or datagram, or shared memory (see ip_connection.h)                                   
+/// @param[in] host IPv4 or IPv6 host string (NULL for server listening on any local address). For local connections, socket file path (starting with "/" or ".") 
+///                 or abstract name (starting with "@", Linux only), with any other string (or NULL) selecting a default name based on the port number.
+///                 Shared memory connections are set up through a local stream socket with the same naming
 /// @param[in] port IP port number (local for server, remote for client)       
 /// @return unique generic identifier to newly created connection (NULL on error) 
 IPConnection IP_OpenConnection( uint8_t connectionType, const char* host, uint16_t port );
@@ -71,16 +91,58 @@ char* IP_GetAddress( IPConnection connection );
 /// @return number of clients (1 for client connection and 0 on error)  
 size_t IP_GetClientsNumber( IPConnection connection );
 
+/// @brief Returns memory allocated by the library for the given connection (data, receive buffers and clients list), excluding stream filter states and shared memory rings
+/// @param[in] connection connection reference 
+/// @return length (in bytes) of allocated memory (0 on error)
+size_t IP_GetMemoryUsage( IPConnection connection );
+
 /// @brief Verifies if given connection is of server type/role
 /// @param[in] connection connection reference 
 /// @return true for server connection, false for client or on error
 bool IP_IsServer( IPConnection connection );
+
+/// @brief Verifies if given connection transfers a byte stream (TCP or local stream), instead of separate messages
+/// @param[in] connection connection reference 
+/// @return true for stream connection, false for datagram or shared memory ones, or on error
+bool IP_IsStream( IPConnection connection );
+
+/// @brief Verifies if given connection is a client accepted by a server, instead of connected to a remote one
+/// @param[in] connection connection reference 
+/// @return true for accepted client connection, false for others or on error
+bool IP_IsAccepted( IPConnection connection );
+
+/// @brief Returns system socket descriptor of the given connection, for direct system calls (shared by UDP server and its clients)
+/// @param[in] connection connection reference 
+/// @return socket descriptor (-1 on error)
+intptr_t IP_GetSocketDescriptor( IPConnection connection );
+
+/// @brief Returns socket address data (remote for clients, local for servers) of the given connection
+/// @param[in] connection connection reference 
+/// @param[out] ref_addressLength pointer to where address data length (in bytes) is stored (ignored if NULL)
+/// @return pointer to system socket address structure (NULL on error)
+const void* IP_GetAddressData( IPConnection connection, size_t* ref_addressLength );
                                                                       
 /// @brief Defines fixed message length for the given connection                                                
 /// @param[in] connection connection reference                                 
 /// @param[in] messageLength desired length (in bytes, limited by IP_MAX_MESSAGE_LENGTH) of the connection messages                                               
 /// @return actual new length of connection messages 
 size_t IP_SetMessageLength( IPConnection connection, size_t messageLength );
+
+/// @brief Returns fixed message length of the given connection
+/// @param[in] connection connection reference
+/// @return length (in bytes) of connection messages (0 on error)
+size_t IP_GetMessageLength( IPConnection connection );
+ 
+/// @brief Defines stream filter used for data transmission of the given TCP (or local stream) connection (for servers, applied to clients accepted afterwards)
+/// @param[in] connection TCP connection reference
+/// @param[in] filter stream filter methods and settings (copied)
+/// @return true on success, false on error (e.g. not a TCP connection, filter already defined or filter opening failure)
+bool IP_SetStreamFilter( IPConnection connection, const IPStreamFilter* filter );
+
+/// @brief Closes the socket of the given connection if its stream filter state expired (e.g. handshake of a silent peer), to be called periodically
+/// @param[in] connection connection reference
+/// @return false if the connection socket is (or got) closed, true otherwise
+bool IP_CheckStreamFilter( IPConnection connection );
  
 /// @brief Calls type specific client method for receiving network messages                      
 /// @param[in] connection client connection reference  
@@ -90,13 +152,24 @@ char* IP_ReceiveMessage( IPConnection connection );
 /// @brief Calls type specific connection method for sending network messages                                                
 /// @param[in] connection connection reference   
 /// @param[in] message message string pointer  
-/// @return 0 on success, -1 on error  
+/// @return 0 on success, 1 if the message could not be sent yet (full shared memory ring or unfinished filter handshake), -1 on error  
 int IP_SendMessage( IPConnection connection, const char* message );
                                                                             
 /// @brief Calls type specific server method for accepting new network clients                                                
 /// @param[in] connection server connection reference        
 /// @return reference to already filled newly accepted client (NULL on error)  
 IPConnection IP_AcceptClient( IPConnection connection );
+
+/// @brief Refuses next pending client of given server connection, closing (or discarding the first datagram of) it without allocating a connection
+/// @param[in] connection server connection reference
+/// @return true if a client was refused, false if there is none (e.g. datagram from already accepted client) or on error
+bool IP_RejectClient( IPConnection connection );
+
+/// @brief Limits number of clients of given server connection, beyond which new ones are refused on IP_AcceptClient() calls
+/// @param[in] connection server connection reference
+/// @param[in] maxClientsNumber maximum number of clients (0 for no limit)
+/// @return true on success, false on error
+bool IP_SetMaxClients( IPConnection connection, size_t maxClientsNumber );
                                                                              
 /// @brief Blocks execution on calling thread for given time or until a network event (read/accept) is available                                                
 /// @param[in] milliseconds timeout for network events waiting (in milliseconds)    
@@ -108,5 +181,111 @@ int IP_WaitEvent( unsigned int milliseconds );
 /// @return true if data is available, false otherwise 
 bool IP_IsDataAvailable( IPConnection connection );
 
+/// @brief Verifies if given connection socket is still usable (not closed by the remote side, for stream clients)
+/// @param[in] connection connection reference
+/// @return true if connection is usable, false otherwise
+bool IP_IsConnected( IPConnection connection );
+
+/// @brief Signals end of sent data to the remote side of given stream client connection, which may still send data (half-close)
+/// @param[in] connection connection reference
+/// @return true on success, false on error or for connections without half-close (servers, datagram and shared memory)
+bool IP_ShutdownSending( IPConnection connection );
+
+/// @brief Holds partial segments of given TCP client connection until uncorked, so that consecutive messages are coalesced (TCP_CORK/TCP_NOPUSH)
+/// @param[in] connection connection reference
+/// @param[in] isCorked true to start holding segments, false to send remaining data right away
+/// @return true on success, false on error or where unsupported (non TCP connections or platforms without cork option)
+bool IP_CorkSending( IPConnection connection, bool isCorked );
+
+/// @brief Sends data from given file through given stream client connection, moved by the kernel (sendfile/splice) without user space copies where possible 
+/// (not for filtered connections, unless their filter is offloaded to the kernel)
+/// @param[in] connection connection reference
+/// @param[in] fileDescriptor descriptor of file (or pipe) to be read, not closed by the call
+/// @param[in] offset position (in bytes) of data to be sent in the file (ignored for pipes)
+/// @param[in] length maximum number of bytes to be sent
+/// @return number of bytes sent, possibly less than length (0 if socket is not ready for sending), or -1 on error
+long IP_SendFile( IPConnection connection, int fileDescriptor, uint64_t offset, size_t length );
+
+/// @brief Enables zero-copy sending (SO_ZEROCOPY) on socket of given unfiltered TCP or UDP client connection
+/// @param[in] connection connection reference
+/// @return true on success, false on error or where unsupported
+bool IP_EnableZeroCopy( IPConnection connection );
+
+/// @brief Makes closing of given TCP client connection abortive (reset, dropping data not sent yet), so that the kernel stops reading buffers sent without copies
+/// @param[in] connection connection reference
+/// @return true on success, false on error (e.g. not a TCP client connection)
+bool IP_SetAbortiveClose( IPConnection connection );
+
+/// @brief Sends data of given length through given TCP or UDP client connection, as stream data or a single datagram
+/// @param[in] connection connection reference
+/// @param[in] buffer pointer to data, which should not be changed until completion is read when sent without copies
+/// @param[in] length number of bytes to be sent
+/// @param[in] isZeroCopy true to have data read by the kernel from the given buffer (MSG_ZEROCOPY), if enabled with IP_EnableZeroCopy()
+/// @return number of bytes sent, possibly less than length for TCP (0 if socket is not ready for sending), or -1 on error
+long IP_SendBuffer( IPConnection connection, const void* buffer, size_t length, bool isZeroCopy );
+
+/// @brief Reads next range of finished zero-copy sends of given connection, numbered in sending order from 0
+/// @param[in] connection connection reference
+/// @param[out] ref_firstID pointer to number of first finished send
+/// @param[out] ref_lastID pointer to number of last finished send
+/// @return 1 if a range was read, 0 if there are no pending completions, -1 on error
+int IP_ReadZeroCopyCompletion( IPConnection connection, uint32_t* ref_firstID, uint32_t* ref_lastID );
+
+/// @brief Enables bulk receiving mode of given TCP client connection, in which data is received by the application with IP_ReceiveBulk(), instead of being polled with other connections
+/// @param[in] connection connection reference
+/// @param[in] windowLength maximum length (in bytes, rounded up to whole pages) of data received at once (0 to disable)
+/// @return true on success, false on error
+bool IP_SetBulkReceive( IPConnection connection, size_t windowLength );
+
+/// @brief Waits for and receives available data of given bulk receiving connection, with received pages mapped to memory (TCP_ZEROCOPY_RECEIVE, on Linux) or copied otherwise
+/// @param[in] connection connection reference
+/// @param[out] ref_length pointer to number of bytes received (0 on error, remote closing or timeout)
+/// @param[in] timeout maximum time (in milliseconds) waiting for data
+/// @return pointer to read-only received data, valid until the next call for the same connection (NULL on error, remote closing or timeout)
+const void* IP_ReceiveBulk( IPConnection connection, size_t* ref_length, unsigned int timeout );
+
+/// @brief Enables sending and receiving of UDP datagrams in trains, segmented (UDP_SEGMENT) and coalesced (UDP_GRO) by the kernel, on Linux
+/// @param[in] connection UDP server (also applied to its accepted clients) or client connection reference
+/// @param[in] isEnabled true to send and receive trains, false to return to one datagram per call
+/// @return true on success, false on error or where unsupported
+bool IP_SetSegmentationOffload( IPConnection connection, bool isEnabled );
+
+/// @brief Sends given messages through given client connection, as a single train of equal-length datagrams for offloading UDP connections
+/// @param[in] connection connection reference
+/// @param[in] messagesList list of message strings, each sent with the connection message length (longer ones are skipped)
+/// @param[in] messagesNumber number of messages in the list
+/// @return 0 on success, 1 if the remaining messages could not be sent yet (full shared memory ring), -1 on (socket) error
+int IP_SendMessages( IPConnection connection, const char** messagesList, size_t messagesNumber );
+
+/// @brief Enables reading of kernel receive time (SO_TIMESTAMPNS, where supported) along with data received by given socket connection
+/// @param[in] connection connection reference (settings of servers are applied to clients accepted from then on)
+/// @param[in] isEnabled true to read receive times, false to stop reading them
+/// @return true on success, false on error or where unsupported
+bool IP_SetReceiveTimestamps( IPConnection connection, bool isEnabled );
+
+/// @brief Gets kernel receive time of the last message received by given client connection
+/// @param[in] connection connection reference
+/// @return wall clock time (in nanoseconds since the Unix epoch) of data arrival on the socket (0 if not available, e.g. for filtered connections)
+uint64_t IP_GetReceiveTime( IPConnection connection );
+
+/// @brief Marks packets sent by given connection socket for differentiated handling by network devices and local queues
+/// @param[in] connection connection reference (local connections are not marked, and clients accepted by UDP servers, sharing their socket, are rejected)
+/// @param[in] dscp differentiated services code point (6 bits) of IPv4 type of service or IPv6 traffic class
+/// @param[in] socketPriority local queueing priority (SO_PRIORITY, on Linux; values above 6 require administrator privileges)
+/// @return true on success, false on error
+bool IP_SetTrafficClass( IPConnection connection, uint8_t dscp, int socketPriority );
+
+/// @brief Limits sending rate of given connection socket, spacing its packets out when the kernel supports it 
+/// (SO_MAX_PACING_RATE, on Linux, with TCP internal pacing or the fq queueing discipline)
+/// @param[in] connection connection reference (local connections are not paced, and clients accepted by UDP servers, sharing their socket, are rejected)
+/// @param[in] bytesPerSecond maximum sending rate, or 0 to remove the limit (rates above 4 GB/s are not limited)
+/// @return true on success (or where kernel pacing is not available), false on error
+bool IP_SetPacingRate( IPConnection connection, uint64_t bytesPerSecond );
+
+/// @brief Replaces socket of given stream client connection by a new one, connected to the same remote address (keeping message length and stream filter)
+/// @param[in] connection connection reference
+/// @return true on success, false on error (connection remains unusable until reconnected)
+bool IP_Reconnect( IPConnection connection );
+
 
 #endif // IP_NETWORK_H
@@ -0,0 +1,272 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+/// @file ip_network.hpp
+/// @brief Compile-time specialized C++ interface for synchronous IP connections.
+///
+/// Header-only templates where transport (TCP or UDP) and role (client or server) are part of the connection 
+/// type. Client messages are sent and received with system calls inlined at the caller, with no function 
+/// pointers dispatch or runtime role/transport checks. Connection setup, client acceptance, server broadcasts 
+/// and termination still go through the C interface, that keeps track of polled sockets and server clients
+///
+/// Inlined client transmission bypasses stream filters (see IP_SetStreamFilter()): filtered (e.g. TLS) 
+/// connections should use the C interface for sending and receiving messages
+
+#ifndef IP_NETWORK_HPP
+#define IP_NETWORK_HPP
+
+#include <cstring>
+
+#ifdef WIN32
+  #include <ws2tcpip.h>
+#else
+  #include <sys/types.h>
+  #include <sys/socket.h>
+  #include <netinet/in.h>
+  #include <sys/un.h>
+#endif
+
+extern "C" 
+{
+  #include "ip_network.h"
+}
+
+
+namespace IP
+{
+  #ifdef WIN32
+  typedef SOCKET SocketHandle;
+  typedef int AddressLength;
+  #else
+  typedef int SocketHandle;
+  typedef socklen_t AddressLength;
+  #endif
+  
+  // Writes to remotely closed sockets do not raise signals (sockets get SO_NOSIGPIPE on creation where the flag is not available)
+  #ifdef MSG_NOSIGNAL
+  const int SEND_FLAGS = MSG_NOSIGNAL;
+  #else
+  const int SEND_FLAGS = 0;
+  #endif
+  
+  /// Client role tag
+  struct Client { static const uint8_t FLAG = IP_CLIENT; };
+  /// Server role tag
+  struct Server { static const uint8_t FLAG = IP_SERVER; };
+  
+  /// TCP (stream) transport policy, with inlined system calls
+  struct TCP
+  {
+    static const uint8_t FLAG = IP_TCP;
+    
+    static inline int Send( SocketHandle socketFD, const char* message, size_t length, const struct sockaddr*, AddressLength )
+    {
+      return ( send( socketFD, message, length, SEND_FLAGS ) < 0 ) ? -1 : 0;
+    }
+    
+    // Returns false on error or remote connection closing
+    static inline bool Receive( SocketHandle socketFD, char* buffer, size_t length, const struct sockaddr* )
+    {
+      return ( recv( socketFD, buffer, length, 0 ) > 0 );
+    }
+  };
+  
+  /// UDP (datagram) transport policy, with inlined system calls
+  struct UDP
+  {
+    static const uint8_t FLAG = IP_UDP;
+    
+    static inline int Send( SocketHandle socketFD, const char* message, size_t length, const struct sockaddr* address, AddressLength addressLength )
+    {
+      return ( sendto( socketFD, message, length, SEND_FLAGS, address, addressLength ) < 0 ) ? -1 : 0;
+    }
+    
+    // Only consumes the pending datagram if it comes from the connection address (UDP server clients share the same socket)
+    static inline bool Receive( SocketHandle socketFD, char* buffer, size_t length, const struct sockaddr* address )
+    {
+      struct sockaddr_storage sourceAddress;
+      memset( &sourceAddress, 0, sizeof(sourceAddress) );     // Local addresses are compared on the whole path buffer
+      AddressLength sourceAddressLength = sizeof(sourceAddress);
+      if( recvfrom( socketFD, buffer, length, MSG_PEEK, (struct sockaddr*) &sourceAddress, &sourceAddressLength ) < 0 ) return false;
+      
+      if( !AreEqualAddresses( address, (const struct sockaddr*) &sourceAddress ) ) return false;
+      
+      return ( recv( socketFD, buffer, length, 0 ) >= 0 );
+    }
+    
+    static inline bool AreEqualAddresses( const struct sockaddr* address_1, const struct sockaddr* address_2 )
+    {
+      if( address_1->sa_family != address_2->sa_family ) return false;
+      
+      if( address_1->sa_family == AF_INET )
+      {
+        const struct sockaddr_in* ipv4Address_1 = (const struct sockaddr_in*) address_1;
+        const struct sockaddr_in* ipv4Address_2 = (const struct sockaddr_in*) address_2;
+        return ( ipv4Address_1->sin_port == ipv4Address_2->sin_port && ipv4Address_1->sin_addr.s_addr == ipv4Address_2->sin_addr.s_addr );
+      }
+      #ifndef IP_NETWORK_LEGACY
+      else if( address_1->sa_family == AF_INET6 )
+      {
+        const struct sockaddr_in6* ipv6Address_1 = (const struct sockaddr_in6*) address_1;
+        const struct sockaddr_in6* ipv6Address_2 = (const struct sockaddr_in6*) address_2;
+        return ( ipv6Address_1->sin6_port == ipv6Address_2->sin6_port && 
+                 memcmp( ipv6Address_1->sin6_addr.s6_addr, ipv6Address_2->sin6_addr.s6_addr, sizeof(ipv6Address_1->sin6_addr.s6_addr) ) == 0 );
+      }
+      #endif
+      #ifndef WIN32
+      else if( address_1->sa_family == AF_UNIX )
+      {
+        return ( memcmp( ((const struct sockaddr_un*) address_1)->sun_path, ((const struct sockaddr_un*) address_2)->sun_path, sizeof(((const struct sockaddr_un*) address_1)->sun_path) ) == 0 );
+      }
+      #endif
+      
+      return false;
+    }
+  };
+  
+  /// Local (Unix domain) stream transport policy, with the same system calls as TCP
+  struct UnixStream : TCP { static const uint8_t FLAG = IP_UNIX_STREAM; };
+  
+  /// Local (Unix domain) datagram transport policy, with the same system calls as UDP
+  struct UnixDatagram : UDP { static const uint8_t FLAG = IP_UNIX_DGRAM; };
+  
+  
+  /// Data and methods common to all connection types
+  template< typename Transport > class ConnectionBase
+  {
+  public:
+    /// @brief Verifies if the connection was successfully opened (and not closed yet)
+    bool IsValid() const { return ( baseConnection != NULL ); }
+    
+    /// @brief Returns underlying C interface connection reference
+    IPConnection GetBaseConnection() const { return baseConnection; }
+    
+    /// @brief Returns address string ("<host>/<port>") of the connection
+    char* GetAddress() const { return IP_GetAddress( baseConnection ); }
+    
+    /// @brief Verifies if connection has data (messages for clients, clients for servers) to be read, after IP_WaitEvent() call
+    bool IsDataAvailable() const { return IP_IsDataAvailable( baseConnection ); }
+    
+    /// @brief Defines fixed message length (limited by IP_MAX_MESSAGE_LENGTH) of the connection
+    /// @return actual new length of connection messages 
+    size_t SetMessageLength( size_t length )
+    {
+      if( baseConnection != NULL ) messageLength = IP_SetMessageLength( baseConnection, length );
+      return messageLength;
+    }
+    
+    /// @brief Handles termination of the connection (copies of this object become invalid too)
+    void Close()
+    {
+      IP_CloseConnection( baseConnection );
+      baseConnection = NULL;
+    }
+    
+  protected:
+    explicit ConnectionBase( IPConnection connection ) 
+    : baseConnection( connection ), socketFD( (SocketHandle) IP_GetSocketDescriptor( connection ) ), 
+      address( NULL ), addressLength( 0 ), messageLength( IP_GetMessageLength( connection ) )
+    {
+      size_t addressDataLength = 0;
+      address = (const struct sockaddr*) IP_GetAddressData( connection, &addressDataLength );
+      addressLength = (AddressLength) addressDataLength;
+    }
+    
+    IPConnection baseConnection;
+    SocketHandle socketFD;
+    const struct sockaddr* address;
+    AddressLength addressLength;
+    size_t messageLength;
+  };
+  
+  /// Connection type specialized on transport (TCP, UDP or local stream/datagram) and role (Client or Server)
+  template< typename Transport, typename Role > class Connection;
+  
+  /// Client connection, with inlined message transmission
+  template< typename Transport > class Connection< Transport, Client > : public ConnectionBase< Transport >
+  {
+  public:
+    /// @brief Creates a new client connection to the given remote host and port
+    static Connection Open( const char* host, uint16_t port ) { return Connection( IP_OpenConnection( Transport::FLAG | Client::FLAG, host, port ) ); }
+    
+    /// @brief Wraps given client connection reference (invalid if NULL)
+    explicit Connection( IPConnection connection = NULL ) : ConnectionBase< Transport >( connection ) { buffer[ 0 ] = '\0'; }
+    
+    /// @brief Receives next incoming message, after IsDataAvailable() returns true
+    /// @return pointer to message string, overwritten on next call to Receive() (NULL on error, connection closing or message destined to other client)
+    inline const char* Receive()
+    {
+      if( this->baseConnection == NULL ) return NULL;
+      memset( buffer, 0, IP_MAX_MESSAGE_LENGTH );
+      return Transport::Receive( this->socketFD, buffer, this->messageLength, this->address ) ? buffer : NULL;
+    }
+    
+    /// @brief Sends given message string (up to the connection message length)
+    /// @return 0 on success, -1 on error
+    inline int Send( const char* message )
+    {
+      if( this->baseConnection == NULL ) return -1;
+      if( strlen( message ) + 1 > this->messageLength ) return -1;
+      return Transport::Send( this->socketFD, message, this->messageLength, this->address, this->addressLength );
+    }
+    
+  private:
+    char buffer[ IP_MAX_MESSAGE_LENGTH ];
+  };
+  
+  /// Server connection, that accepts and broadcasts messages to clients of the same transport
+  template< typename Transport > class Connection< Transport, Server > : public ConnectionBase< Transport >
+  {
+  public:
+    /// @brief Creates a new server connection listening on the given local host (NULL for any) and port
+    static Connection Open( const char* host, uint16_t port ) { return Connection( IP_OpenConnection( Transport::FLAG | Server::FLAG, host, port ) ); }
+    
+    /// @brief Wraps given server connection reference (invalid if NULL)
+    explicit Connection( IPConnection connection = NULL ) : ConnectionBase< Transport >( connection ) { }
+    
+    /// @brief Accepts new client, after IsDataAvailable() returns true (invalid connection if none)
+    Connection< Transport, Client > Accept()
+    {
+      if( this->baseConnection == NULL ) return Connection< Transport, Client >();
+      return Connection< Transport, Client >( IP_AcceptClient( this->baseConnection ) );
+    }
+    
+    /// @brief Returns number of accepted clients
+    size_t GetClientsNumber() const { return IP_GetClientsNumber( this->baseConnection ); }
+    
+    /// @brief Sends given message string to all accepted clients
+    /// @return 0 on success, -1 on error
+    int Send( const char* message ) { return ( this->baseConnection != NULL ) ? IP_SendMessage( this->baseConnection, message ) : -1; }
+  };
+  
+  typedef Connection< TCP, Client > TCPClient;      ///< TCP client connection type
+  typedef Connection< TCP, Server > TCPServer;      ///< TCP server connection type
+  typedef Connection< UDP, Client > UDPClient;      ///< UDP client connection type
+  typedef Connection< UDP, Server > UDPServer;      ///< UDP server connection type
+  typedef Connection< UnixStream, Client > UnixStreamClient;      ///< Local stream client connection type
+  typedef Connection< UnixStream, Server > UnixStreamServer;      ///< Local stream server connection type
+  typedef Connection< UnixDatagram, Client > UnixDatagramClient;  ///< Local datagram client connection type
+  typedef Connection< UnixDatagram, Server > UnixDatagramServer;  ///< Local datagram server connection type
+}
+
+
+#endif // IP_NETWORK_HPP
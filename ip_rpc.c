@@ -0,0 +1,321 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <Windows.h>
+#define SLEEP_MICROSECONDS( time ) Sleep( ( (time) + 999 ) / 1000 )
+#else
+#include <unistd.h>
+#define SLEEP_MICROSECONDS( time ) usleep( time )
+#endif
+
+#include "ip_rpc.h"
+#include "ip_error.h"
+#include "ip_system.h"
+
+#include "threads/threads.h"
+
+
+#define EXPIRATION_CHECK_INTERVAL 10000       // Microseconds between checks of pending calls deadlines
+#define REPLY_POLL_INTERVAL 100               // Microseconds between checks of waited call state
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                      DATA STRUCTURES                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Slots are claimed and completed with atomic state transitions, as replies arrive on the reading thread
+enum { CALL_FREE, CALL_CLAIMED, CALL_PENDING, CALL_COMPLETING, CALL_COMPLETED, CALL_EXPIRED };
+
+typedef struct _PendingCall
+{
+  uint64_t state;
+  uint64_t callID;
+  uint64_t deadline;
+  unsigned long connectionID;                         // Connection the request was written to, the only one accepted to reply
+  IPRPCCallback ref_Callback;
+  void* userData;
+  size_t replyLength;
+  char reply[ IP_DISPATCH_MAX_PAYLOAD_LENGTH ];       // Stored only for calls waited without callback
+}
+PendingCall;
+
+enum { TIMER_STOPPED, TIMER_STARTING, TIMER_RUNNING, TIMER_STOPPING };
+
+// Call identifiers map to slots by remainder, skipping slots still in use
+static PendingCall pendingCallsList[ IP_RPC_MAX_PENDING_CALLS ];
+static uint64_t lastCallID = IP_RPC_INVALID_CALL;
+
+static uint64_t timerState = TIMER_STOPPED;
+static volatile bool isTimerRunning = false;
+static Thread timerThread = THREAD_INVALID_HANDLE;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                        CALL COMPLETION                                          /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Takes pending call of given identifier for completion. Fails if it was already completed (e.g. on late replies)
+static PendingCall* AcquirePendingCall( uint32_t callID )
+{
+  PendingCall* call = &(pendingCallsList[ callID % IP_RPC_MAX_PENDING_CALLS ]);
+  
+  if( ATOMIC_LOAD( &(call->callID) ) != callID ) return NULL;
+  if( !ATOMIC_COMPARE_EXCHANGE( &(call->state), CALL_PENDING, CALL_COMPLETING ) ) return NULL;
+  // Slot could have been released and claimed again by a newer call in between
+  if( ATOMIC_LOAD( &(call->callID) ) != callID )
+  {
+    ATOMIC_STORE( &(call->state), CALL_PENDING );
+    return NULL;
+  }
+  
+  return call;
+}
+
+// Reply handler, called from the reading thread
+static void ReceiveReply( unsigned long connectionID, const void* payload, size_t payloadLength, void* userData )
+{
+  uint32_t callID = IPDispatch_GetMessageTag( payload );
+  
+  PendingCall* call = AcquirePendingCall( callID );
+  if( call == NULL ) return;
+  
+  // Identifiers are not unique across connections, so replies from others would complete unrelated calls
+  if( call->connectionID != connectionID )
+  {
+    ATOMIC_STORE( &(call->state), CALL_PENDING );
+    IP_REPORT_ERROR( "connection index %lu: discarded reply to call %u, made on another connection", connectionID, callID );
+    return;
+  }
+  
+  if( call->ref_Callback != NULL )
+  {
+    call->ref_Callback( callID, payload, payloadLength, call->userData );
+    ATOMIC_STORE( &(call->state), CALL_FREE );
+  }
+  else
+  {
+    memcpy( call->reply, payload, payloadLength );
+    call->replyLength = payloadLength;
+    ATOMIC_STORE( &(call->state), CALL_COMPLETED );
+  }
+}
+
+// Loop of pending calls deadline checking, completing expired ones without reply, until stopped
+static void* AsyncExpireCalls( void* args )
+{
+  while( isTimerRunning )
+  {
+    uint64_t currentTime = System_GetTimeMilliseconds();
+    
+    for( size_t callIndex = 0; callIndex < IP_RPC_MAX_PENDING_CALLS; callIndex++ )
+    {
+      PendingCall* call = &(pendingCallsList[ callIndex ]);
+      if( ATOMIC_LOAD( &(call->state) ) != CALL_PENDING || call->deadline > currentTime ) continue;
+      
+      call = AcquirePendingCall( (uint32_t) ATOMIC_LOAD( &(call->callID) ) );
+      if( call == NULL ) continue;
+      
+      if( call->ref_Callback != NULL )
+      {
+        call->ref_Callback( (uint32_t) call->callID, NULL, 0, call->userData );
+        ATOMIC_STORE( &(call->state), CALL_FREE );
+      }
+      else
+        ATOMIC_STORE( &(call->state), CALL_EXPIRED );
+    }
+    
+    SLEEP_MICROSECONDS( EXPIRATION_CHECK_INTERVAL );
+  }
+  
+  return NULL;
+}
+
+// Lazily starts deadline checking thread. Returns false while it is still being started or stopped by another thread
+static bool StartTimer( void )
+{
+  static bool isExitHandlerSet = false;
+  
+  if( ATOMIC_LOAD( &timerState ) == TIMER_RUNNING ) return true;
+  
+  if( !ATOMIC_COMPARE_EXCHANGE( &timerState, TIMER_STOPPED, TIMER_STARTING ) ) return false;
+  
+  isTimerRunning = true;
+  timerThread = Thread_Start( AsyncExpireCalls, NULL, THREAD_JOINABLE );
+  
+  // Thread is not left running (in the middle of a callback) on normal process exit
+  if( !isExitHandlerSet ) isExitHandlerSet = ( atexit( IPRPC_StopTimer ) == 0 );
+  
+  ATOMIC_STORE( &timerState, TIMER_RUNNING );
+  
+  return true;
+}
+
+void IPRPC_StopTimer( void )
+{
+  if( !ATOMIC_COMPARE_EXCHANGE( &timerState, TIMER_RUNNING, TIMER_STOPPING ) ) return;
+  
+  isTimerRunning = false;
+  
+  (void) Thread_WaitExit( timerThread, 5000 );
+  timerThread = THREAD_INVALID_HANDLE;
+  
+  ATOMIC_STORE( &timerState, TIMER_STOPPED );
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                           CALLING                                               /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool IPRPC_EnableReplies( IPDispatchTable table )
+{
+  return IPDispatch_RegisterHandler( table, IP_RPC_REPLY_TYPE, IP_DISPATCH_VARIABLE_SIZE, ReceiveReply, NULL );
+}
+
+// Claims free slot for a new call, trying a limited number of identifiers
+static PendingCall* ClaimPendingCall( void )
+{
+  for( size_t attemptIndex = 0; attemptIndex < IP_RPC_MAX_PENDING_CALLS; attemptIndex++ )
+  {
+    uint32_t callID = (uint32_t) ( ATOMIC_FETCH_ADD( &lastCallID, 1 ) + 1 );
+    if( callID == IP_RPC_INVALID_CALL ) continue;
+    
+    PendingCall* call = &(pendingCallsList[ callID % IP_RPC_MAX_PENDING_CALLS ]);
+    if( ATOMIC_COMPARE_EXCHANGE( &(call->state), CALL_FREE, CALL_CLAIMED ) ) 
+    {
+      ATOMIC_STORE( &(call->callID), callID );
+      return call;
+    }
+  }
+  
+  return NULL;
+}
+
+uint32_t IPRPC_Call( unsigned long connectionID, uint8_t requestType, const void* request, size_t requestLength, 
+                     unsigned int timeout, IPRPCCallback callback, void* userData )
+{
+  char message[ IP_MAX_MESSAGE_LENGTH ] = { 0 };
+  
+  if( requestType == IP_RPC_REPLY_TYPE )
+  {
+    IP_REPORT_ERROR( "message type %u is reserved for replies", requestType );
+    return IP_RPC_INVALID_CALL;
+  }
+  
+  if( IPDispatch_BuildMessage( message, requestType, request, requestLength ) == 0 ) return IP_RPC_INVALID_CALL;
+  
+  if( callback != NULL ) 
+  {
+    // Calls may be made before the thread is running (it will check them on start)
+    (void) StartTimer();
+  }
+  
+  PendingCall* call = ClaimPendingCall();
+  if( call == NULL )
+  {
+    IP_REPORT_ERROR( "maximum number of pending calls (%u) reached", IP_RPC_MAX_PENDING_CALLS );
+    return IP_RPC_INVALID_CALL;
+  }
+  
+  uint32_t callID = (uint32_t) call->callID;
+  call->deadline = System_GetTimeMilliseconds() + timeout;
+  call->connectionID = connectionID;
+  call->ref_Callback = callback;
+  call->userData = userData;
+  call->replyLength = 0;
+  // Registered before sending, as the reply may arrive before the write method returns
+  ATOMIC_STORE( &(call->state), CALL_PENDING );
+  
+  IPDispatch_SetMessageTag( message, callID );
+  if( !AsyncIP_WriteMessage( connectionID, message ) )
+  {
+    if( AcquirePendingCall( callID ) != NULL ) ATOMIC_STORE( &(call->state), CALL_FREE );
+    return IP_RPC_INVALID_CALL;
+  }
+  
+  return callID;
+}
+
+int IPRPC_WaitReply( uint32_t callID, void* reply, size_t maxLength )
+{
+  PendingCall* call = &(pendingCallsList[ callID % IP_RPC_MAX_PENDING_CALLS ]);
+  
+  if( callID == IP_RPC_INVALID_CALL || ATOMIC_LOAD( &(call->callID) ) != callID || call->ref_Callback != NULL )
+  {
+    IP_REPORT_ERROR( "call %u is not waiting for reply", callID );
+    return -1;
+  }
+  
+  while( true )
+  {
+    uint64_t callState = ATOMIC_LOAD( &(call->state) );
+    if( callState == CALL_COMPLETED )
+    {
+      size_t replyLength = ( call->replyLength < maxLength ) ? call->replyLength : maxLength;
+      if( reply != NULL ) memcpy( reply, call->reply, replyLength );
+      ATOMIC_STORE( &(call->state), CALL_FREE );
+      return (int) replyLength;
+    }
+    else if( callState == CALL_EXPIRED )
+    {
+      ATOMIC_STORE( &(call->state), CALL_FREE );
+      return -1;
+    }
+    else if( callState == CALL_PENDING && System_GetTimeMilliseconds() > call->deadline )
+    {
+      if( AcquirePendingCall( callID ) != NULL ) 
+      {
+        ATOMIC_STORE( &(call->state), CALL_FREE );
+        return -1;
+      }
+    }
+    
+    SLEEP_MICROSECONDS( REPLY_POLL_INTERVAL );
+  }
+  
+  return -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                          REPLYING                                               /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint32_t IPRPC_GetCallID( const void* request )
+{
+  return IPDispatch_GetMessageTag( request );
+}
+
+bool IPRPC_Reply( unsigned long connectionID, uint32_t callID, const void* reply, size_t replyLength )
+{
+  char message[ IP_MAX_MESSAGE_LENGTH ] = { 0 };
+  
+  if( IPDispatch_BuildMessage( message, IP_RPC_REPLY_TYPE, reply, replyLength ) == 0 ) return false;
+  IPDispatch_SetMessageTag( message, callID );
+  
+  return AsyncIP_WriteMessage( connectionID, message );
+}
@@ -0,0 +1,91 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+
+/// @file ip_rpc.h
+/// @brief Request/response calls over asynchronous connections, with correlation identifiers and pipelining.
+///
+/// Requests are typed messages (see ip_dispatch.h) tagged with a call identifier, that servers echo on replies, 
+/// so that many calls may be in flight over the same connection and replies are matched to them as they arrive. 
+/// Replies are either delivered to a callback (from the reading thread) or stored until waited for, 
+/// and calls not answered before their deadline are completed without reply
+
+#ifndef IP_RPC_H
+#define IP_RPC_H
+
+#include "async_ip_network.h"
+
+
+#define IP_RPC_REPLY_TYPE 255                 ///< Message type reserved for replies (not available as request type)
+#define IP_RPC_MAX_PENDING_CALLS 256           ///< Maximum number of calls waiting for replies, over all connections
+#define IP_RPC_INVALID_CALL 0                  ///< Call identifier returned on errors
+
+/// Handler of call completion
+/// @param[in] callID identifier of the completed call
+/// @param[in] reply pointer to reply payload, valid only during the call (NULL if the deadline expired)
+/// @param[in] replyLength length (in bytes) of the reply payload
+/// @param[in] userData pointer given on call
+typedef void (*IPRPCCallback)( uint32_t callID, const void* reply, size_t replyLength, void* userData );
+
+
+/// @brief Registers reply handling on the dispatch table of calling (client) connections
+/// @param[in] table dispatch table reference, to be set on the connections (see AsyncIP_SetDispatchTable())
+/// @return true on success, false on error
+bool IPRPC_EnableReplies( IPDispatchTable table );
+
+/// @brief Sends request (typed message) through connection of given identifier
+/// @param[in] connectionID calling connection identifier (the only one replies are accepted from)
+/// @param[in] requestType request message type, whose handler is registered on the remote dispatch table
+/// @param[in] request pointer to request payload data
+/// @param[in] requestLength length (in bytes) of the request payload
+/// @param[in] timeout maximum time (in milliseconds) to wait for the reply
+/// @param[in] callback function called on reply or deadline expiration (NULL to wait with IPRPC_WaitReply())
+/// @param[in] userData pointer passed to the callback
+/// @return unique call identifier (IP_RPC_INVALID_CALL on error)
+uint32_t IPRPC_Call( unsigned long connectionID, uint8_t requestType, const void* request, size_t requestLength, 
+                     unsigned int timeout, IPRPCCallback callback, void* userData );
+
+/// @brief Waits for reply of given call (made without callback), up to its deadline. Should be called once for every such call
+/// @param[in] callID call identifier
+/// @param[out] reply buffer where reply payload is copied (may be NULL)
+/// @param[in] maxLength size (in bytes) of the reply buffer (longer replies are truncated)
+/// @return reply payload length (-1 on error or expired deadline)
+int IPRPC_WaitReply( uint32_t callID, void* reply, size_t maxLength );
+
+/// @brief Returns identifier of the call whose request payload is given, when called from request handlers
+/// @param[in] request request payload pointer passed to the handler
+/// @return call identifier, to be passed to IPRPC_Reply()
+uint32_t IPRPC_GetCallID( const void* request );
+
+/// @brief Sends reply for given call, from the request handler or any time later
+/// @param[in] connectionID identifier of the connection that received the request
+/// @param[in] callID call identifier
+/// @param[in] reply pointer to reply payload data
+/// @param[in] replyLength length (in bytes) of the reply payload
+/// @return true on success, false on error
+bool IPRPC_Reply( unsigned long connectionID, uint32_t callID, const void* reply, size_t replyLength );
+
+/// @brief Stops the background thread that expires deadlines of calls made with callback (restarted by the next one). Also called on normal process exit
+void IPRPC_StopTimer( void );
+
+
+#endif // IP_RPC_H
@@ -0,0 +1,445 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef __linux__
+  #define _GNU_SOURCE                                           // For memfd_create()
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+  #include <unistd.h>
+  #include <errno.h>
+  #include <poll.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/socket.h>
+  #include <sys/eventfd.h>
+  #include <sys/epoll.h>
+#endif
+
+#include "ip_shm.h"
+#include "ip_network.h"
+#include "ip_error.h"
+#include "ip_system.h"
+
+
+#define SHM_MAGIC 0x49505348                                    // "IPSH"
+#define SHM_VERSION 1
+#define SHM_HANDSHAKE_TIMEOUT_MS 5000
+
+#define CLIENT_TO_SERVER 0
+#define SERVER_TO_CLIENT 1
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                      DATA STRUCTURES                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Message slot, padded to whole cache lines so that producer and consumer do not touch the same line
+typedef struct _ShmSlot
+{
+  uint32_t length;
+  char data[ IP_MAX_MESSAGE_LENGTH ];
+  char padding[ CACHE_LINE_SIZE - sizeof(uint32_t) ];
+}
+ShmSlot;
+
+// Single producer, single consumer ring. Indexes written by each side live on separate cache lines
+typedef struct _ShmRing
+{
+  uint64_t tail;                                                // Written by producer only
+  char tailPadding[ CACHE_LINE_SIZE - sizeof(uint64_t) ];
+  uint64_t head;                                                // Written by consumer only
+  char headPadding[ CACHE_LINE_SIZE - sizeof(uint64_t) ];
+  uint64_t isConsumerWaiting;                                   // Consumer found the ring empty and needs a wakeup event
+  uint64_t isClosed;
+  char flagsPadding[ CACHE_LINE_SIZE - 2 * sizeof(uint64_t) ];
+  ShmSlot slotsList[ IP_SHM_RING_SLOTS ];
+}
+ShmRing;
+
+// Layout of the shared memory region, checked by the server on handshake
+typedef struct _ShmRegion
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slotsNumber;
+  uint32_t slotSize;
+  char headerPadding[ CACHE_LINE_SIZE - 4 * sizeof(uint32_t) ];
+  ShmRing ringsList[ 2 ];
+}
+ShmRegion;
+
+// Process local view of a channel, with cached copies of the remote side indexes
+struct _IPShmChannel
+{
+  ShmRegion* region;
+  ShmRing* sendRing;
+  ShmRing* receiveRing;
+  int receiveEventFD;                                           // Signaled by the remote side
+  int sendEventFD;                                              // Signaled for waking up the remote side
+  int controlSocketFD;                                          // Kept open after the handshake, hung up when the remote process exits
+  int pollFD;                                                   // Reports both receive event and control socket, polled by the library
+  uint64_t cachedSendHead;
+  uint64_t cachedReceiveTail;
+};
+
+typedef char ShmRingSizeCheck[ ( ( IP_SHM_RING_SLOTS & ( IP_SHM_RING_SLOTS - 1 ) ) == 0 ) ? 1 : -1 ];
+
+
+#ifdef __linux__
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                         HANDSHAKE                                               /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static IPShmChannel* CreateChannel( int regionFD, int receiveEventFD, int sendEventFD, bool isServerSide )
+{
+  ShmRegion* region = (ShmRegion*) mmap( NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, regionFD, 0 );
+  close( regionFD );
+  if( region == MAP_FAILED )
+  {
+    IP_REPORT_ERROR( "mmap: failed mapping shared memory region: %s", strerror( errno ) );
+    return NULL;
+  }
+  
+  IPShmChannel* channel = (IPShmChannel*) System_AllocateAligned( CACHE_LINE_SIZE, sizeof(IPShmChannel) );
+  if( channel == NULL )
+  {
+    IP_REPORT_ERROR( "failed allocating shared memory channel" );
+    munmap( region, sizeof(ShmRegion) );
+    return NULL;
+  }
+  memset( channel, 0, sizeof(IPShmChannel) );
+  channel->region = region;
+  channel->sendRing = &(region->ringsList[ isServerSide ? SERVER_TO_CLIENT : CLIENT_TO_SERVER ]);
+  channel->receiveRing = &(region->ringsList[ isServerSide ? CLIENT_TO_SERVER : SERVER_TO_CLIENT ]);
+  channel->receiveEventFD = receiveEventFD;
+  channel->sendEventFD = sendEventFD;
+  channel->controlSocketFD = -1;
+  
+  struct epoll_event eventData = { .events = EPOLLIN, .data.fd = receiveEventFD };
+  channel->pollFD = epoll_create1( EPOLL_CLOEXEC );
+  if( channel->pollFD == -1 || epoll_ctl( channel->pollFD, EPOLL_CTL_ADD, receiveEventFD, &eventData ) == -1 )
+  {
+    IP_REPORT_ERROR( "epoll: failed creating shared memory poller: %s", strerror( errno ) );
+    if( channel->pollFD != -1 ) close( channel->pollFD );
+    munmap( region, sizeof(ShmRegion) );
+    System_FreeAligned( channel );
+    return NULL;
+  }
+  
+  return channel;
+}
+
+// Takes the control socket for detecting remote process exits (with no call to IPShm_Close), which leave the rings open
+static bool WatchControlSocket( IPShmChannel* channel, int controlSocketFD )
+{
+  struct epoll_event eventData = { .events = EPOLLIN | EPOLLRDHUP, .data.fd = controlSocketFD };
+  if( epoll_ctl( channel->pollFD, EPOLL_CTL_ADD, controlSocketFD, &eventData ) == -1 )
+  {
+    IP_REPORT_ERROR( "epoll: failed watching control socket %d: %s", controlSocketFD, strerror( errno ) );
+    return false;
+  }
+  
+  channel->controlSocketFD = controlSocketFD;
+  
+  return true;
+}
+
+// Default (abstract) socket names are reachable by any local user, so memory is only shared with processes of the same user (or root)
+static bool IsPeerTrusted( int controlSocketFD )
+{
+  struct ucred peerCredentials;
+  socklen_t credentialsLength = sizeof(peerCredentials);
+  if( getsockopt( controlSocketFD, SOL_SOCKET, SO_PEERCRED, &peerCredentials, &credentialsLength ) == -1 )
+  {
+    IP_REPORT_ERROR( "getsockopt: failed reading peer credentials of socket %d: %s", controlSocketFD, strerror( errno ) );
+    return false;
+  }
+  
+  if( peerCredentials.uid != geteuid() && peerCredentials.uid != 0 )
+  {
+    IP_REPORT_ERROR( "shared memory peer of socket %d belongs to another user (%u)", controlSocketFD, (unsigned int) peerCredentials.uid );
+    return false;
+  }
+  
+  return true;
+}
+
+IPShmChannel* IPShm_Connect( int controlSocketFD )
+{
+  if( !IsPeerTrusted( controlSocketFD ) ) return NULL;
+  
+  int regionFD = memfd_create( "async_ip_shm", MFD_CLOEXEC );
+  if( regionFD == -1 || ftruncate( regionFD, sizeof(ShmRegion) ) == -1 )
+  {
+    IP_REPORT_ERROR( "memfd_create: failed creating shared memory region: %s", strerror( errno ) );
+    if( regionFD != -1 ) close( regionFD );
+    return NULL;
+  }
+  
+  // Events start non-signaled, with both consumers waiting, so that the first message wakes them up
+  int eventFDsList[ 2 ] = { eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ), eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) };
+  if( eventFDsList[ CLIENT_TO_SERVER ] == -1 || eventFDsList[ SERVER_TO_CLIENT ] == -1 )
+  {
+    IP_REPORT_ERROR( "eventfd: failed creating wakeup events: %s", strerror( errno ) );
+    close( regionFD );
+    for( size_t eventIndex = 0; eventIndex < 2; eventIndex++ )
+      if( eventFDsList[ eventIndex ] != -1 ) close( eventFDsList[ eventIndex ] );
+    return NULL;
+  }
+  
+  int sharedFDsList[ 3 ] = { regionFD, eventFDsList[ CLIENT_TO_SERVER ], eventFDsList[ SERVER_TO_CLIENT ] };
+  
+  IPShmChannel* channel = CreateChannel( dup( regionFD ), eventFDsList[ SERVER_TO_CLIENT ], eventFDsList[ CLIENT_TO_SERVER ], false );
+  if( channel != NULL )
+  {
+    ShmRegion* region = channel->region;
+    region->slotsNumber = IP_SHM_RING_SLOTS;
+    region->slotSize = sizeof(ShmSlot);
+    region->version = SHM_VERSION;
+    region->ringsList[ CLIENT_TO_SERVER ].isConsumerWaiting = 1;
+    region->ringsList[ SERVER_TO_CLIENT ].isConsumerWaiting = 1;
+    ATOMIC_STORE( &(region->magic), SHM_MAGIC );
+    
+    // Pass region and events descriptors to the server process
+    char controlData[ CMSG_SPACE( sizeof(sharedFDsList) ) ];
+    memset( controlData, 0, sizeof(controlData) );
+    char version = SHM_VERSION;
+    struct iovec messageData = { .iov_base = &version, .iov_len = 1 };
+    struct msghdr message = { .msg_iov = &messageData, .msg_iovlen = 1, .msg_control = controlData, .msg_controllen = sizeof(controlData) };
+    struct cmsghdr* controlHeader = CMSG_FIRSTHDR( &message );
+    controlHeader->cmsg_level = SOL_SOCKET;
+    controlHeader->cmsg_type = SCM_RIGHTS;
+    controlHeader->cmsg_len = CMSG_LEN( sizeof(sharedFDsList) );
+    memcpy( CMSG_DATA( controlHeader ), sharedFDsList, sizeof(sharedFDsList) );
+    
+    struct pollfd controlPoller = { .fd = controlSocketFD, .events = POLLOUT };
+    if( poll( &controlPoller, 1, SHM_HANDSHAKE_TIMEOUT_MS ) <= 0 || sendmsg( controlSocketFD, &message, MSG_NOSIGNAL ) != 1 )
+    {
+      IP_REPORT_ERROR( "sendmsg: failed passing shared memory to server on socket %d", controlSocketFD );
+      munmap( channel->region, sizeof(ShmRegion) );
+      close( channel->pollFD );
+      close( channel->receiveEventFD );
+      close( channel->sendEventFD );
+      System_FreeAligned( channel );
+      channel = NULL;
+    }
+    else if( !WatchControlSocket( channel, controlSocketFD ) )
+    {
+      close( channel->pollFD );
+      IPShm_Close( channel );
+      channel = NULL;
+    }
+  }
+  else
+  {
+    close( eventFDsList[ CLIENT_TO_SERVER ] );
+    close( eventFDsList[ SERVER_TO_CLIENT ] );
+  }
+  
+  close( regionFD );
+  
+  return channel;
+}
+
+IPShmChannel* IPShm_Accept( int controlSocketFD )
+{
+  if( !IsPeerTrusted( controlSocketFD ) ) return NULL;
+  
+  int sharedFDsList[ 3 ] = { -1, -1, -1 };
+  
+  char controlData[ CMSG_SPACE( sizeof(sharedFDsList) ) ];
+  char version = 0;
+  struct iovec messageData = { .iov_base = &version, .iov_len = 1 };
+  struct msghdr message = { .msg_iov = &messageData, .msg_iovlen = 1, .msg_control = controlData, .msg_controllen = sizeof(controlData) };
+  
+  struct pollfd controlPoller = { .fd = controlSocketFD, .events = POLLIN };
+  if( poll( &controlPoller, 1, SHM_HANDSHAKE_TIMEOUT_MS ) <= 0 || recvmsg( controlSocketFD, &message, MSG_CMSG_CLOEXEC ) != 1 )
+  {
+    IP_REPORT_ERROR( "recvmsg: failed receiving shared memory from client on socket %d", controlSocketFD );
+    return NULL;
+  }
+  
+  struct cmsghdr* controlHeader = CMSG_FIRSTHDR( &message );
+  if( controlHeader == NULL || controlHeader->cmsg_type != SCM_RIGHTS || controlHeader->cmsg_len != CMSG_LEN( sizeof(sharedFDsList) ) )
+  {
+    IP_REPORT_ERROR( "recvmsg: invalid shared memory handshake on socket %d", controlSocketFD );
+    return NULL;
+  }
+  memcpy( sharedFDsList, CMSG_DATA( controlHeader ), sizeof(sharedFDsList) );
+  
+  struct stat regionInfo;
+  if( version != SHM_VERSION || fstat( sharedFDsList[ 0 ], &regionInfo ) == -1 || regionInfo.st_size < (off_t) sizeof(ShmRegion) )
+  {
+    IP_REPORT_ERROR( "shared memory region from socket %d does not match this library build", controlSocketFD );
+    for( size_t fdIndex = 0; fdIndex < 3; fdIndex++ ) close( sharedFDsList[ fdIndex ] );
+    return NULL;
+  }
+  
+  IPShmChannel* channel = CreateChannel( sharedFDsList[ 0 ], sharedFDsList[ 1 + CLIENT_TO_SERVER ], sharedFDsList[ 1 + SERVER_TO_CLIENT ], true );
+  if( channel == NULL )
+  {
+    close( sharedFDsList[ 1 + CLIENT_TO_SERVER ] );
+    close( sharedFDsList[ 1 + SERVER_TO_CLIENT ] );
+    return NULL;
+  }
+  
+  ShmRegion* region = channel->region;
+  if( ATOMIC_LOAD( &(region->magic) ) != SHM_MAGIC || region->slotsNumber != IP_SHM_RING_SLOTS || region->slotSize != sizeof(ShmSlot) )
+  {
+    IP_REPORT_ERROR( "shared memory region from socket %d does not match this library build", controlSocketFD );
+    close( channel->pollFD );
+    IPShm_Close( channel );
+    return NULL;
+  }
+  
+  if( !WatchControlSocket( channel, controlSocketFD ) )
+  {
+    close( channel->pollFD );
+    IPShm_Close( channel );
+    return NULL;
+  }
+  
+  return channel;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                       COMMUNICATION                                             /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int IPShm_GetEventDescriptor( IPShmChannel* channel ) { return channel->pollFD; }
+
+// The control socket carries no data after the handshake, so its end of stream (or error) means the remote process is gone
+static bool IsRemoteLost( IPShmChannel* channel )
+{
+  char data;
+  ssize_t peekResult = recv( channel->controlSocketFD, &data, 1, MSG_PEEK | MSG_DONTWAIT );
+  if( peekResult == 0 ) return true;
+  if( peekResult == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) return true;
+  
+  return false;
+}
+
+// Signals the event of a ring consumer, if it is waiting for one
+static inline void WakeConsumer( ShmRing* ring, int eventFD )
+{
+  if( ATOMIC_LOAD( &(ring->isConsumerWaiting) ) && ATOMIC_COMPARE_EXCHANGE( &(ring->isConsumerWaiting), 1, 0 ) )
+  {
+    uint64_t eventCount = 1;
+    if( write( eventFD, &eventCount, sizeof(eventCount) ) == -1 ) IP_REPORT_ERROR( "write: failed signaling event %d", eventFD );
+  }
+}
+
+int IPShm_Send( IPShmChannel* channel, const char* message, size_t length )
+{
+  ShmRing* ring = channel->sendRing;
+  
+  if( ATOMIC_LOAD( &(ring->isClosed) ) ) return -1;
+  
+  uint64_t tail = ring->tail;
+  // Only read the consumer index (shared cache line) when the cached one says the ring is full. 
+  // Callers keep messages not taken by a full ring, instead of waiting here for the consumer
+  if( tail - channel->cachedSendHead >= IP_SHM_RING_SLOTS )
+  {
+    channel->cachedSendHead = ATOMIC_LOAD( &(ring->head) );
+    if( tail - channel->cachedSendHead >= IP_SHM_RING_SLOTS ) return IsRemoteLost( channel ) ? -1 : 0;
+  }
+  
+  ShmSlot* slot = &(ring->slotsList[ tail & ( IP_SHM_RING_SLOTS - 1 ) ]);
+  slot->length = (uint32_t) length;
+  memcpy( slot->data, message, length );
+  ATOMIC_STORE( &(ring->tail), tail + 1 );
+  
+  // Publish the message before checking for a waiting consumer (pairs with fence in IPShm_Receive)
+  ATOMIC_FENCE();
+  WakeConsumer( ring, channel->sendEventFD );
+  
+  return 1;
+}
+
+int IPShm_Receive( IPShmChannel* channel, char* buffer, size_t length )
+{
+  ShmRing* ring = channel->receiveRing;
+  
+  uint64_t head = ring->head;
+  if( head == channel->cachedReceiveTail ) channel->cachedReceiveTail = ATOMIC_LOAD( &(ring->tail) );
+  if( head == channel->cachedReceiveTail )
+  {
+    if( ATOMIC_LOAD( &(ring->isClosed) ) ) return 0;
+    
+    // Clear pending wakeups and ask for a new one. The event stays signaled while the ring is not empty
+    uint64_t eventCount;
+    if( read( channel->receiveEventFD, &eventCount, sizeof(eventCount) ) == -1 )
+    {
+      if( errno != EAGAIN ) IP_REPORT_ERROR( "read: failed clearing event %d", channel->receiveEventFD );
+      // Without a wakeup event, polling may have reported the control socket instead
+      else if( IsRemoteLost( channel ) ) return 0;
+    }
+    ATOMIC_STORE( &(ring->isConsumerWaiting), 1 );
+    ATOMIC_FENCE();
+    if( ATOMIC_LOAD( &(ring->tail) ) != head || ATOMIC_LOAD( &(ring->isClosed) ) ) WakeConsumer( ring, channel->receiveEventFD );
+    
+    return -1;
+  }
+  
+  // Length is written by the remote process, and read only once, so that the copy stays within the checked bounds
+  ShmSlot* slot = &(ring->slotsList[ head & ( IP_SHM_RING_SLOTS - 1 ) ]);
+  size_t messageLength = (size_t) ATOMIC_LOAD( &(slot->length) );
+  if( messageLength > length ) messageLength = length;
+  memcpy( buffer, slot->data, messageLength );
+  ATOMIC_STORE( &(ring->head), head + 1 );
+  
+  return (int) messageLength;
+}
+
+void IPShm_Close( IPShmChannel* channel )
+{
+  if( channel == NULL ) return;
+  
+  // Remote side sees both directions closed after consuming pending messages
+  ATOMIC_STORE( &(channel->sendRing->isClosed), 1 );
+  ATOMIC_STORE( &(channel->receiveRing->isClosed), 1 );
+  uint64_t eventCount = 1;
+  if( write( channel->sendEventFD, &eventCount, sizeof(eventCount) ) == -1 ) IP_REPORT_ERROR( "write: failed signaling event %d", channel->sendEventFD );
+  
+  munmap( channel->region, sizeof(ShmRegion) );
+  close( channel->receiveEventFD );
+  close( channel->sendEventFD );
+  if( channel->controlSocketFD != -1 ) close( channel->controlSocketFD );
+  System_FreeAligned( channel );
+}
+
+#else
+
+IPShmChannel* IPShm_Connect( int controlSocketFD ) { IP_REPORT_ERROR( "shared memory connections are not supported on this system" ); return NULL; }
+IPShmChannel* IPShm_Accept( int controlSocketFD ) { IP_REPORT_ERROR( "shared memory connections are not supported on this system" ); return NULL; }
+int IPShm_GetEventDescriptor( IPShmChannel* channel ) { return -1; }
+int IPShm_Send( IPShmChannel* channel, const char* message, size_t length ) { return -1; }
+int IPShm_Receive( IPShmChannel* channel, char* buffer, size_t length ) { return 0; }
+void IPShm_Close( IPShmChannel* channel ) { }
+
+#endif
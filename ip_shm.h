@@ -0,0 +1,61 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+/////  Internal shared memory channels (one SPSC ring per direction) used by   /////
+/////  IP_SHM connections. Not part of the public interface                    /////
+/////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef IP_SHM_H
+#define IP_SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef IP_SHM_RING_SLOTS
+#define IP_SHM_RING_SLOTS 1024                                  // Number of messages per ring direction (power of 2)
+#endif
+
+typedef struct _IPShmChannel IPShmChannel;
+
+// Creates shared memory region and wakeup events, passing them to the server through the given connected control socket 
+// (only if the server process belongs to the same user, or root). The channel keeps the socket on success, for detecting remote exits
+IPShmChannel* IPShm_Connect( int controlSocketFD );
+
+// Receives shared memory region and wakeup events from a client through the given accepted control socket (same restrictions)
+IPShmChannel* IPShm_Accept( int controlSocketFD );
+
+// Returns descriptor signaled when incoming messages are available or the remote process exits (to be polled, closed by the caller)
+int IPShm_GetEventDescriptor( IPShmChannel* channel );
+
+// Writes message to the outgoing ring, without waiting. Returns 1 if written, 0 if the ring is full, or -1 on error, remote closing or exit
+int IPShm_Send( IPShmChannel* channel, const char* message, size_t length );
+
+// Reads message from the incoming ring into given buffer. Returns message length, 0 on remote closing or exit, or -1 if no message is available
+int IPShm_Receive( IPShmChannel* channel, char* buffer, size_t length );
+
+// Notifies remote side of closing and releases channel resources (except the event descriptor)
+void IPShm_Close( IPShmChannel* channel );
+
+
+#endif // IP_SHM_H
@@ -0,0 +1,108 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+/////  Internal platform abstractions (atomic operations and monotonic time)   /////
+/////  shared by the library modules. Not part of the public interface         /////
+/////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef IP_SYSTEM_H
+#define IP_SYSTEM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef WIN32
+  #include <Windows.h>
+  #include <malloc.h>
+  
+  #define ATOMIC_FETCH_ADD( ref_value, increment ) (uint64_t) ( InterlockedExchangeAdd64( (LONGLONG volatile*) (ref_value), (LONGLONG) (increment) ) )
+  #define ATOMIC_FETCH_SUB( ref_value, decrement ) (uint64_t) ( InterlockedExchangeAdd64( (LONGLONG volatile*) (ref_value), -(LONGLONG) (decrement) ) )
+  #define ATOMIC_LOAD( ref_value ) (uint64_t) InterlockedCompareExchange64( (LONGLONG volatile*) (ref_value), 0, 0 )
+  #define ATOMIC_STORE( ref_value, value ) InterlockedExchange64( (LONGLONG volatile*) (ref_value), (LONGLONG) (value) )
+  #define ATOMIC_COMPARE_EXCHANGE( ref_value, expected, desired ) ( InterlockedCompareExchange64( (LONGLONG volatile*) (ref_value), (LONGLONG) (desired), (LONGLONG) (expected) ) == (LONGLONG) (expected) )
+  #define ATOMIC_COMPARE_EXCHANGE_POINTER( ref_pointer, expected, desired ) ( InterlockedCompareExchangePointer( (PVOID volatile*) (ref_pointer), (PVOID) (desired), (PVOID) (expected) ) == (PVOID) (expected) )
+  #define ATOMIC_FENCE() MemoryBarrier()
+  
+  #define THREAD_LOCAL __declspec( thread )
+#else
+  #include <time.h>
+  
+  #define ATOMIC_FETCH_ADD( ref_value, increment ) __atomic_fetch_add( (ref_value), (increment), __ATOMIC_RELAXED )
+  #define ATOMIC_FETCH_SUB( ref_value, decrement ) __atomic_fetch_sub( (ref_value), (decrement), __ATOMIC_RELAXED )
+  #define ATOMIC_LOAD( ref_value ) __atomic_load_n( (ref_value), __ATOMIC_ACQUIRE )
+  #define ATOMIC_STORE( ref_value, value ) __atomic_store_n( (ref_value), (value), __ATOMIC_RELEASE )
+  #define ATOMIC_COMPARE_EXCHANGE( ref_value, expected, desired ) __sync_bool_compare_and_swap( (ref_value), (expected), (desired) )
+  #define ATOMIC_COMPARE_EXCHANGE_POINTER( ref_pointer, expected, desired ) __sync_bool_compare_and_swap( (ref_pointer), (expected), (desired) )
+  #define ATOMIC_FENCE() __atomic_thread_fence( __ATOMIC_SEQ_CST )
+  
+  #define THREAD_LOCAL __thread
+#endif
+
+
+#define CACHE_LINE_SIZE 64                                      // Assumed processor cache line size (in bytes)
+
+
+// Allocates memory block starting on an address multiple of the given alignment (power of 2)
+static inline void* System_AllocateAligned( size_t alignment, size_t size )
+{
+  #ifdef WIN32
+  return _aligned_malloc( size, alignment );
+  #else
+  void* memoryBlock = NULL;
+  if( posix_memalign( &memoryBlock, alignment, size ) != 0 ) return NULL;
+  return memoryBlock;
+  #endif
+}
+
+// Releases memory block allocated with System_AllocateAligned()
+static inline void System_FreeAligned( void* memoryBlock )
+{
+  #ifdef WIN32
+  _aligned_free( memoryBlock );
+  #else
+  free( memoryBlock );
+  #endif
+}
+
+// Monotonic clock time (in nanoseconds)
+static inline uint64_t System_GetTimeNanoseconds( void )
+{
+  #ifdef WIN32
+  static LARGE_INTEGER frequency = { 0 };
+  LARGE_INTEGER counter;
+  if( frequency.QuadPart == 0 ) QueryPerformanceFrequency( &frequency );
+  QueryPerformanceCounter( &counter );
+  return (uint64_t) ( counter.QuadPart / frequency.QuadPart ) * 1000000000 + (uint64_t) ( counter.QuadPart % frequency.QuadPart ) * 1000000000 / frequency.QuadPart;
+  #else
+  struct timespec timeStamp;
+  clock_gettime( CLOCK_MONOTONIC, &timeStamp );
+  return (uint64_t) timeStamp.tv_sec * 1000000000 + (uint64_t) timeStamp.tv_nsec;
+  #endif
+}
+
+// Monotonic clock time (in milliseconds)
+static inline uint64_t System_GetTimeMilliseconds( void ) { return System_GetTimeNanoseconds() / 1000000; }
+
+
+#endif // IP_SYSTEM_H
@@ -0,0 +1,349 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+#include <stdlib.h>
+
+#ifdef WIN32
+  #include <winsock2.h>
+  #define poll WSAPoll
+#else
+  #include <poll.h>
+  #include <fcntl.h>
+#endif
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "ip_tls.h"
+#include "ip_error.h"
+#include "ip_system.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                      DATA STRUCTURES                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct _IPTLSContextData
+{
+  SSL_CTX* sslContext;
+  bool isServer;
+  size_t offloadedNumber;
+};
+
+// Filter state of each TLS connection
+typedef struct _TLSConnection
+{
+  SSL* ssl;
+  IPTLSContext context;
+  volatile bool isEstablished;        // Handshake completed (by the reading side, for accepted connections)
+  uint64_t handshakeDeadline;
+}
+TLSConnection;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                        CONFIGURATION                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void ReportSSLErrors( const char* operation )
+{
+  char errorString[ 128 ];
+  unsigned long errorCode = ERR_get_error();
+  if( errorCode == 0 ) IP_REPORT_ERROR( "%s: unknown TLS error", operation );
+  for( ; errorCode != 0; errorCode = ERR_get_error() )
+  {
+    ERR_error_string_n( errorCode, errorString, sizeof(errorString) );
+    IP_REPORT_ERROR( "%s: %s", operation, errorString );
+  }
+}
+
+IPTLSContext IPTLS_CreateContext( bool isServer, const char* certificateFile, const char* keyFile, const char* verifyFile )
+{
+  if( isServer && ( certificateFile == NULL || keyFile == NULL ) ) 
+  {
+    IP_REPORT_ERROR( "TLS server configuration requires certificate and key files" );
+    return NULL;
+  }
+  
+  SSL_CTX* sslContext = SSL_CTX_new( isServer ? TLS_server_method() : TLS_client_method() );
+  if( sslContext == NULL )
+  {
+    ReportSSLErrors( "SSL_CTX_new" );
+    return NULL;
+  }
+  
+  SSL_CTX_set_min_proto_version( sslContext, TLS1_2_VERSION );
+  // Messages are written whole and may be retried from a different buffer address
+  SSL_CTX_set_mode( sslContext, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+  #ifdef SSL_OP_ENABLE_KTLS
+  SSL_CTX_set_options( sslContext, SSL_OP_ENABLE_KTLS );
+  #endif
+  
+  if( certificateFile != NULL && keyFile != NULL )
+  {
+    if( SSL_CTX_use_certificate_chain_file( sslContext, certificateFile ) != 1 || SSL_CTX_use_PrivateKey_file( sslContext, keyFile, SSL_FILETYPE_PEM ) != 1 )
+    {
+      ReportSSLErrors( "loading TLS certificate" );
+      SSL_CTX_free( sslContext );
+      return NULL;
+    }
+  }
+  
+  // Clients always verify servers, by default against the system trusted certificates
+  if( verifyFile != NULL || !isServer )
+  {
+    int loadResult = ( verifyFile != NULL ) ? SSL_CTX_load_verify_locations( sslContext, verifyFile, NULL ) : SSL_CTX_set_default_verify_paths( sslContext );
+    if( loadResult != 1 )
+    {
+      ReportSSLErrors( "loading TLS trusted certificates" );
+      SSL_CTX_free( sslContext );
+      return NULL;
+    }
+    SSL_CTX_set_verify( sslContext, SSL_VERIFY_PEER | ( isServer ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT : 0 ), NULL );
+  }
+  
+  IPTLSContext context = (IPTLSContext) malloc( sizeof(struct _IPTLSContextData) );
+  context->sslContext = sslContext;
+  context->isServer = isServer;
+  context->offloadedNumber = 0;
+  
+  return context;
+}
+
+void IPTLS_DiscardContext( IPTLSContext context )
+{
+  if( context == NULL ) return;
+  
+  SSL_CTX_free( context->sslContext );
+  free( context );
+}
+
+size_t IPTLS_GetOffloadedNumber( IPTLSContext context )
+{
+  if( context == NULL ) return 0;
+  
+  return (size_t) ATOMIC_LOAD( &(context->offloadedNumber) );
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////                                        STREAM FILTER                                            /////
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Waits for the socket of the given TLS connection to become ready for the operation OpenSSL asked for
+static bool WaitSSLSocket( SSL* ssl, int result, int timeoutMilliseconds )
+{
+  int errorCode = SSL_get_error( ssl, result );
+  
+  struct pollfd socketPoller = { .fd = SSL_get_fd( ssl ) };
+  if( errorCode == SSL_ERROR_WANT_READ ) socketPoller.events = POLLIN;
+  else if( errorCode == SSL_ERROR_WANT_WRITE ) socketPoller.events = POLLOUT;
+  else return false;
+  
+  return ( poll( &socketPoller, 1, timeoutMilliseconds ) > 0 );
+}
+
+// Advances handshake of the given connection, waiting for its completion (up to the deadline) if requested.
+// Returns 1 once established, 0 if not finished yet (when not waiting) and -1 on failure or expired deadline
+static int ContinueHandshake( TLSConnection* connection, bool isWaiting )
+{
+  SSL* ssl = connection->ssl;
+  
+  int result;
+  while( (result = SSL_do_handshake( ssl )) != 1 )
+  {
+    int remainingTime = (int) ( connection->handshakeDeadline - System_GetTimeMilliseconds() );
+    int errorCode = SSL_get_error( ssl, result );
+    bool isBlocked = ( errorCode == SSL_ERROR_WANT_READ || errorCode == SSL_ERROR_WANT_WRITE );
+    if( isBlocked && remainingTime > 0 && !isWaiting ) return 0;
+    if( !isBlocked || remainingTime <= 0 || !WaitSSLSocket( ssl, result, remainingTime ) )
+    {
+      ReportSSLErrors( "SSL_do_handshake" );
+      return -1;
+    }
+  }
+  
+  connection->isEstablished = true;
+  
+  #ifdef SSL_OP_ENABLE_KTLS
+  if( BIO_get_ktls_send( SSL_get_wbio( ssl ) ) ) ATOMIC_FETCH_ADD( &(connection->context->offloadedNumber), 1 );
+  #endif
+  
+  return 1;
+}
+
+static void* OpenTLSFilter( void* settings, intptr_t socketFD, bool isServerSide, const char* host )
+{
+  IPTLSContext context = (IPTLSContext) settings;
+  
+  if( context == NULL ) return NULL;
+  
+  if( context->isServer != isServerSide )
+  {
+    IP_REPORT_ERROR( "TLS %s configuration used for %s side connection", context->isServer ? "server" : "client", isServerSide ? "server" : "client" );
+    return NULL;
+  }
+  
+  // Accepted sockets do not inherit the non-blocking state, required for handshakes driven by data arrival
+  #ifdef WIN32
+  u_long nonBlocking = 1;
+  (void) ioctlsocket( (SOCKET) socketFD, FIONBIO, &nonBlocking );
+  #else
+  (void) fcntl( (int) socketFD, F_SETFL, fcntl( (int) socketFD, F_GETFL ) | O_NONBLOCK );
+  #endif
+  
+  SSL* ssl = SSL_new( context->sslContext );
+  if( ssl == NULL || SSL_set_fd( ssl, (int) socketFD ) != 1 )
+  {
+    ReportSSLErrors( "SSL_new" );
+    SSL_free( ssl );
+    return NULL;
+  }
+  
+  if( isServerSide ) SSL_set_accept_state( ssl );
+  else 
+  {
+    // Server certificate has to match the connected host (not defined for local sockets), given either as address or as name (also sent for virtual hosting)
+    if( host != NULL && X509_VERIFY_PARAM_set1_ip_asc( SSL_get0_param( ssl ), host ) != 1 )
+    {
+      if( SSL_set1_host( ssl, host ) != 1 || SSL_set_tlsext_host_name( ssl, host ) != 1 )
+      {
+        ReportSSLErrors( "setting TLS host name" );
+        SSL_free( ssl );
+        return NULL;
+      }
+    }
+    SSL_set_connect_state( ssl );
+  }
+  
+  TLSConnection* connection = (TLSConnection*) malloc( sizeof(TLSConnection) );
+  if( connection == NULL )
+  {
+    SSL_free( ssl );
+    return NULL;
+  }
+  connection->ssl = ssl;
+  connection->context = context;
+  connection->isEstablished = false;
+  connection->handshakeDeadline = System_GetTimeMilliseconds() + IP_TLS_HANDSHAKE_TIMEOUT;
+  
+  // Accepted connections shake hands as data arrives, without blocking the accepting thread
+  if( !isServerSide && ContinueHandshake( connection, true ) != 1 )
+  {
+    SSL_free( ssl );
+    free( connection );
+    return NULL;
+  }
+  
+  return connection;
+}
+
+static int SendTLSData( void* state, const char* data, size_t length )
+{
+  const int WRITE_TIMEOUT_MS = 1000;
+  
+  TLSConnection* connection = (TLSConnection*) state;
+  SSL* ssl = connection->ssl;
+  
+  // Data written before the end of handshake (driven by data arrival) is held by the caller, without blocking its thread
+  if( !connection->isEstablished ) return ( System_GetTimeMilliseconds() < connection->handshakeDeadline ) ? 0 : -1;
+  
+  int result;
+  while( (result = SSL_write( ssl, data, (int) length )) <= 0 )
+  {
+    if( !WaitSSLSocket( ssl, result, WRITE_TIMEOUT_MS ) ) return -1;
+  }
+  
+  return result;
+}
+
+static int ReceiveTLSData( void* state, char* buffer, size_t length )
+{
+  TLSConnection* connection = (TLSConnection*) state;
+  SSL* ssl = connection->ssl;
+  
+  if( !connection->isEstablished )
+  {
+    int handshakeResult = ContinueHandshake( connection, false );
+    if( handshakeResult == -1 ) return 0;           // Failed handshakes close the connection
+    else if( handshakeResult == 0 ) return -1;
+  }
+  
+  int result = SSL_read( ssl, buffer, (int) length );
+  if( result > 0 ) return result;
+  
+  int errorCode = SSL_get_error( ssl, result );
+  // Incomplete record: wait for more data
+  if( errorCode == SSL_ERROR_WANT_READ || errorCode == SSL_ERROR_WANT_WRITE ) return -1;
+  
+  // Remote closing (with or without alert) and fatal errors (e.g. corrupted records) close the connection, 
+  // as the socket would stay readable without any data to be read
+  if( errorCode != SSL_ERROR_ZERO_RETURN && ERR_peek_error() != 0 ) ReportSSLErrors( "SSL_read" );
+  
+  return 0;
+}
+
+// Accepted connections whose handshake is not finished in time are closed, even if the peer stays silent
+static bool IsTLSExpired( void* state )
+{
+  TLSConnection* connection = (TLSConnection*) state;
+  
+  return ( !connection->isEstablished && System_GetTimeMilliseconds() >= connection->handshakeDeadline );
+}
+
+// With kernel TLS sending, data written to the socket (e.g. by sendfile) is encrypted into records by the kernel
+static bool IsTLSOffloaded( void* state )
+{
+  TLSConnection* connection = (TLSConnection*) state;
+  
+  #ifdef SSL_OP_ENABLE_KTLS
+  if( connection->isEstablished && BIO_get_ktls_send( SSL_get_wbio( connection->ssl ) ) ) return true;
+  #endif
+  
+  return false;
+}
+
+// Records are decrypted whole, while only the requested length is taken from them
+static bool HasTLSPending( void* state )
+{
+  TLSConnection* connection = (TLSConnection*) state;
+  
+  return ( SSL_pending( connection->ssl ) > 0 );
+}
+
+static void CloseTLSFilter( void* state )
+{
+  TLSConnection* connection = (TLSConnection*) state;
+  
+  if( connection->isEstablished ) SSL_shutdown( connection->ssl );
+  SSL_free( connection->ssl );
+  free( connection );
+}
+
+IPStreamFilter IPTLS_GetFilter( IPTLSContext context )
+{
+  IPStreamFilter filter = { .ref_Open = OpenTLSFilter, .ref_Send = SendTLSData, .ref_Receive = ReceiveTLSData, 
+                            .ref_Close = CloseTLSFilter, .ref_IsOffloaded = IsTLSOffloaded, .ref_HasPending = HasTLSPending, 
+                            .ref_IsExpired = IsTLSExpired, .settings = context };
+  
+  return filter;
+}
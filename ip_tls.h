@@ -0,0 +1,66 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+/// @file ip_tls.h
+/// @brief TLS stream filter for TCP connections, based on OpenSSL.
+///
+/// Provides encryption of TCP connections through the stream filter interface (see IP_SetStreamFilter()).
+/// When supported by both OpenSSL (3.0 or newer) and the operating system kernel, record encryption is 
+/// offloaded to the kernel (kTLS) after the handshake, keeping the socket system calls data path
+
+#ifndef IP_TLS_H
+#define IP_TLS_H
+
+#include "ip_network.h"
+
+
+#define IP_TLS_HANDSHAKE_TIMEOUT 5000   ///< Maximum time (in milliseconds) for TLS handshake completion (client side blocks up to it, server side proceeds as data arrives)
+
+/// Opaque type to reference encapsulated TLS configuration (certificates and protocol options)
+typedef struct _IPTLSContextData* IPTLSContext;
+
+
+/// @brief Creates TLS configuration for server or client connections
+/// @param[in] isServer true for server (accepted clients) side configuration, false for client side
+/// @param[in] certificateFile path to PEM certificate (chain) file (required for servers, NULL for clients without certificate)
+/// @param[in] keyFile path to PEM private key file of the given certificate (NULL if no certificate)
+/// @param[in] verifyFile path to PEM trusted certificates file used to verify the remote peer (NULL for system default ones on clients, or no client verification on servers).
+///                       Client connections also check the server certificate against their host name or address
+/// @return reference to newly created configuration (NULL on error)
+IPTLSContext IPTLS_CreateContext( bool isServer, const char* certificateFile, const char* keyFile, const char* verifyFile );
+
+/// @brief Releases given TLS configuration, after all connections using it are closed
+/// @param[in] context TLS configuration reference
+void IPTLS_DiscardContext( IPTLSContext context );
+
+/// @brief Returns stream filter that encrypts connections with the given TLS configuration
+/// @param[in] context TLS configuration reference
+/// @return stream filter data, to be passed to IP_SetStreamFilter()
+IPStreamFilter IPTLS_GetFilter( IPTLSContext context );
+
+/// @brief Returns number of connections of the given configuration with encryption offloaded to the kernel (kTLS)
+/// @param[in] context TLS configuration reference
+/// @return number of handshakes completed with kernel TLS enabled for sending
+size_t IPTLS_GetOffloadedNumber( IPTLSContext context );
+
+
+#endif // IP_TLS_H
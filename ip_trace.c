@@ -0,0 +1,91 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+#include "ip_trace.h"
+
+#if defined( IP_NETWORK_TRACE ) && !defined( IP_NETWORK_TRACE_USDT )
+
+#include "ip_system.h"
+
+#define BUFFER_INDEX_MASK ( IP_TRACE_BUFFER_LENGTH - 1 )
+
+// Ring buffer slot. The sequence number (event index + 1) is only stored after the event data is complete, 
+// so that readers can detect slots still being written or already overwritten
+typedef struct _TraceSlot
+{
+  uint64_t sequence;
+  IPTraceEvent event;
+}
+TraceSlot;
+
+static TraceSlot traceBuffer[ IP_TRACE_BUFFER_LENGTH ];
+static uint64_t writeIndex = 0;         // Shared by all recording threads
+static uint64_t readIndex = 0;          // Owned by the single reading thread
+
+
+void IPTrace_Record( enum IPTracePoint point, uint64_t reference, uint32_t length )
+{
+  uint64_t eventIndex = ATOMIC_FETCH_ADD( &writeIndex, 1 );
+  TraceSlot* slot = &(traceBuffer[ eventIndex & BUFFER_INDEX_MASK ]);
+  
+  ATOMIC_STORE( &(slot->sequence), 0 );
+  slot->event.timestamp = System_GetTimeNanoseconds();
+  slot->event.reference = reference;
+  slot->event.point = (uint32_t) point;
+  slot->event.length = length;
+  ATOMIC_STORE( &(slot->sequence), eventIndex + 1 );
+}
+
+size_t IPTrace_GetEvents( IPTraceEvent* eventsList, size_t maxEventsNumber )
+{
+  size_t eventsNumber = 0;
+  
+  if( eventsList == NULL ) return 0;
+  
+  uint64_t lastIndex = ATOMIC_LOAD( &writeIndex );
+  // Skip events already overwritten
+  if( lastIndex - readIndex > IP_TRACE_BUFFER_LENGTH ) readIndex = lastIndex - IP_TRACE_BUFFER_LENGTH;
+  
+  while( readIndex < lastIndex && eventsNumber < maxEventsNumber )
+  {
+    TraceSlot* slot = &(traceBuffer[ readIndex & BUFFER_INDEX_MASK ]);
+    
+    uint64_t sequence = ATOMIC_LOAD( &(slot->sequence) );
+    if( sequence < readIndex + 1 ) break;   // Still being written: retry on next call
+    
+    eventsList[ eventsNumber ] = slot->event;
+    // Keep the copied event only if it was not overwritten in the meantime
+    if( sequence == readIndex + 1 && ATOMIC_LOAD( &(slot->sequence) ) == sequence ) eventsNumber++;
+    
+    readIndex++;
+  }
+  
+  return eventsNumber;
+}
+
+#else
+
+void IPTrace_Record( enum IPTracePoint point, uint64_t reference, uint32_t length ) { return; }
+
+size_t IPTrace_GetEvents( IPTraceEvent* eventsList, size_t maxEventsNumber ) { return 0; }
+
+#endif
@@ -0,0 +1,89 @@
+//////////////////////////////////////////////////////////////////////////////////////
+//                                                                                  //
+//  Copyright (c) 2016-2017 Leonardo Consoni <consoni_2519@hotmail.com>             //
+//                                                                                  //
+//  This file is part of Async IP Connections.                                      //
+//                                                                                  //
+//  Async IP Connections is free software: you can redistribute it and/or modify    //
+//  it under the terms of the GNU Lesser General Public License as published        //
+//  by the Free Software Foundation, either version 3 of the License, or            //
+//  (at your option) any later version.                                             //
+//                                                                                  //
+//  Async IP Connections is distributed in the hope that it will be useful,         //
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of                  //
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                    //
+//  GNU Lesser General Public License for more details.                             //
+//                                                                                  //
+//  You should have received a copy of the GNU Lesser General Public License        //
+//  along with Async IP Connections. If not, see <http://www.gnu.org/licenses/>.    //
+//                                                                                  //
+//////////////////////////////////////////////////////////////////////////////////////
+
+
+/// @file ip_trace.h
+/// @brief Static tracepoints for the connections data path.
+///
+/// Tracepoints compile to nothing unless IP_NETWORK_TRACE is defined. When enabled, events are 
+/// recorded in a lock-free ring buffer (read with IPTrace_GetEvents()) or, if IP_NETWORK_TRACE_USDT 
+/// is also defined, emitted as USDT probes of the "async_ip" provider (for tools like bpftrace or perf)
+
+#ifndef IP_TRACE_H
+#define IP_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define IP_TRACE_BUFFER_LENGTH 4096     ///< Number of events stored in the trace ring buffer (power of 2)
+
+/// Data path points where events are recorded
+enum IPTracePoint
+{
+  IP_TRACE_ACCEPT,                      ///< New client accepted by a server (reference: client socket)
+  IP_TRACE_RECEIVE,                     ///< Message received from a socket (reference: socket)
+  IP_TRACE_SEND,                        ///< Message sent through a socket (reference: socket)
+  IP_TRACE_CLOSE,                       ///< Connection closed (reference: socket)
+  IP_TRACE_READ_ENQUEUE,                ///< Received message or client pushed to an asynchronous read queue (reference: connection identifier)
+  IP_TRACE_READ_DEQUEUE,                ///< Message or client popped from an asynchronous read queue (reference: connection identifier)
+  IP_TRACE_WRITE_ENQUEUE,               ///< Message pushed to an asynchronous write queue (reference: connection identifier)
+  IP_TRACE_WRITE_DEQUEUE,               ///< Message popped from an asynchronous write queue (reference: connection identifier)
+  IP_TRACE_REJECT                       ///< New client refused by a server at its limits (reference: server socket)
+};
+
+/// Single recorded trace event
+typedef struct _IPTraceEvent
+{
+  uint64_t timestamp;                   ///< Monotonic clock time (in nanoseconds)
+  uint64_t reference;                   ///< Socket descriptor or asynchronous connection identifier, depending on the point
+  uint32_t point;                       ///< Event point (see IPTracePoint)
+  uint32_t length;                      ///< Message length (in bytes), or 0 when not applicable
+}
+IPTraceEvent;
+
+
+#ifdef IP_NETWORK_TRACE
+  #ifdef IP_NETWORK_TRACE_USDT
+    #include <sys/sdt.h>
+    #define IP_TRACE( point, reference, length ) DTRACE_PROBE2( async_ip, point, (uint64_t) (reference), (uint32_t) (length) )
+  #else
+    #define IP_TRACE( point, reference, length ) IPTrace_Record( IP_TRACE_##point, (uint64_t) (reference), (uint32_t) (length) )
+  #endif
+#else
+  #define IP_TRACE( point, reference, length ) do { (void) sizeof( length ); } while( 0 )  // No evaluation of arguments
+#endif
+
+
+/// @brief Stores event in the trace ring buffer, overwriting the oldest one when full (used through IP_TRACE macro)
+/// @param[in] point data path point (see IPTracePoint)
+/// @param[in] reference socket descriptor or connection identifier
+/// @param[in] length message length (in bytes)
+void IPTrace_Record( enum IPTracePoint point, uint64_t reference, uint32_t length );
+
+/// @brief Copies recorded events not read yet, oldest first (events overwritten before reading are lost)
+/// @param[out] eventsList array where events are copied to
+/// @param[in] maxEventsNumber maximum number of events to be copied
+/// @return number of events copied (always 0 if ring buffer tracing is disabled)
+size_t IPTrace_GetEvents( IPTraceEvent* eventsList, size_t maxEventsNumber );
+
+
+#endif // IP_TRACE_H